@@ -0,0 +1,284 @@
+
+/*
+   Copyright (c) 2014-2016 Malte Hildingsson, malte (at) afterwi.se
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+   THE SOFTWARE.
+ */
+
+#include "aw-websocket.h"
+
+#if WEBSOCKET_DEFLATE
+
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+/* Pools are not locked; keep one per i/o thread. */
+
+struct websocket_deflate_slot {
+	struct websocket_deflate_slot *next;
+	z_stream z;
+	int bits;
+	int full;
+	int final;
+	unsigned char *in;
+	unsigned char *out;
+};
+
+struct websocket_deflate_pool {
+	struct websocket_deflate_slot *inflaters;
+	struct websocket_deflate_slot *deflaters[16];
+	int level;
+	int memlevel;
+	size_t bufsize;
+};
+
+static const unsigned char trailer[4] = {0x00, 0x00, 0xff, 0xff};
+
+struct websocket_deflate_pool *websocket_deflate_pool_create(int level, int memlevel, size_t bufsize) {
+	struct websocket_deflate_pool *pool;
+
+	if ((pool = calloc(1, sizeof *pool)) == NULL)
+		return NULL;
+
+	pool->level = level;
+	pool->memlevel = memlevel > 0 ? memlevel : 8;
+	pool->bufsize = bufsize > 0 ? bufsize : 16384;
+
+	return pool;
+}
+
+static void freeslot(struct websocket_deflate_slot *slot) {
+	if (slot->bits == 0)
+		inflateEnd(&slot->z);
+	else
+		deflateEnd(&slot->z);
+
+	free(slot);
+}
+
+void websocket_deflate_pool_destroy(struct websocket_deflate_pool *pool) {
+	struct websocket_deflate_slot *slot;
+	int i;
+
+	while ((slot = pool->inflaters) != NULL) {
+		pool->inflaters = slot->next;
+		freeslot(slot);
+	}
+
+	for (i = 0; i < 16; ++i)
+		while ((slot = pool->deflaters[i]) != NULL) {
+			pool->deflaters[i] = slot->next;
+			freeslot(slot);
+		}
+
+	free(pool);
+}
+
+/* bits == 0 is an inflater; inflating with the largest window reads any peer window */
+static struct websocket_deflate_slot *getslot(struct websocket_deflate_pool *pool, int bits) {
+	struct websocket_deflate_slot **list = bits == 0 ? &pool->inflaters : &pool->deflaters[bits];
+	struct websocket_deflate_slot *slot;
+	size_t extra = bits == 0 ? 2 * pool->bufsize + sizeof trailer : 0;
+	int err;
+
+	if ((slot = *list) != NULL) {
+		*list = slot->next;
+		return slot;
+	}
+
+	if ((slot = calloc(1, sizeof *slot + extra)) == NULL)
+		return NULL;
+
+	slot->bits = bits;
+
+	if (bits == 0) {
+		slot->in = (unsigned char *) (slot + 1);
+		slot->out = slot->in + pool->bufsize + sizeof trailer;
+		err = inflateInit2(&slot->z, -15);
+	} else
+		err = deflateInit2(&slot->z, pool->level, Z_DEFLATED, -bits, pool->memlevel, Z_DEFAULT_STRATEGY);
+
+	if (err != Z_OK)
+		return free(slot), NULL;
+
+	return slot;
+}
+
+static void putslot(struct websocket_deflate_pool *pool, struct websocket_deflate_slot *slot) {
+	struct websocket_deflate_slot **list = slot->bits == 0 ? &pool->inflaters : &pool->deflaters[slot->bits];
+
+	if (slot->bits == 0)
+		inflateReset(&slot->z);
+	else
+		deflateReset(&slot->z);
+
+	slot->full = 0;
+	slot->final = 0;
+	slot->next = *list;
+	*list = slot;
+}
+
+void websocket_deflate_init(
+		struct websocket_deflate *ctx, struct websocket_deflate_pool *pool,
+		const struct websocket_deflate_params *prefs, int server) {
+	memset(ctx, 0, sizeof *ctx);
+	ctx->pool = pool;
+	ctx->server = server != 0;
+
+	if (prefs != NULL)
+		ctx->prefs = *prefs;
+}
+
+void websocket_deflate_release(struct websocket_deflate *ctx) {
+	if (ctx->inflater != NULL)
+		putslot(ctx->pool, ctx->inflater);
+
+	if (ctx->deflater != NULL)
+		putslot(ctx->pool, ctx->deflater);
+
+	ctx->inflater = NULL;
+	ctx->deflater = NULL;
+}
+
+void *_websocket_inflatebuf(struct websocket_deflate *ctx, size_t *size) {
+	if (ctx->inflater == NULL && (ctx->inflater = getslot(ctx->pool, 0)) == NULL)
+		return NULL;
+
+	*size = ctx->pool->bufsize;
+	return ctx->inflater->in;
+}
+
+void _websocket_inflateinput(struct websocket_deflate *ctx, size_t n, int final) {
+	struct websocket_deflate_slot *slot = ctx->inflater;
+
+	if (final) {
+		memcpy(slot->in + n, trailer, sizeof trailer);
+		n += sizeof trailer;
+	}
+
+	slot->z.next_in = slot->in;
+	slot->z.avail_in = (uInt) n;
+	slot->final = final;
+}
+
+ssize_t _websocket_inflate(struct websocket_deflate *ctx) {
+	struct websocket_deflate_slot *slot = ctx->inflater;
+	int err, notakeover;
+
+	if (slot->z.avail_in > 0 || slot->full) {
+		slot->z.next_out = slot->out;
+		slot->z.avail_out = (uInt) ctx->pool->bufsize;
+
+		if ((err = inflate(&slot->z, Z_SYNC_FLUSH)) == Z_STREAM_END)
+			inflateReset(&slot->z);
+		else if (err != Z_OK && err != Z_BUF_ERROR)
+			return WEBSOCKET_DATA_ERROR;
+
+		ctx->out = slot->out;
+		ctx->outlen = ctx->pool->bufsize - slot->z.avail_out;
+		slot->full = slot->z.avail_out == 0;
+
+		if (ctx->outlen > 0)
+			return ctx->outlen;
+
+		if (slot->z.avail_in > 0)
+			return WEBSOCKET_DATA_ERROR;
+	}
+
+	notakeover = ctx->server ?
+		ctx->params.client_no_context_takeover : ctx->params.server_no_context_takeover;
+
+	if (slot->final && notakeover) {
+		putslot(ctx->pool, slot);
+		ctx->inflater = NULL;
+	}
+
+	return 0;
+}
+
+ssize_t websocket_deflate_message(
+		struct websocket_deflate *ctx, unsigned char op, unsigned char mask[4],
+		void *dst, size_t size, const void *src, size_t len) {
+	struct websocket_frame frame = {0, {op | WEBSOCKET_RSV1, (mask != NULL ? WEBSOCKET_MASK : 0)}};
+	size_t head = 2 + 8 + (mask != NULL ? sizeof frame.mask : 0), n;
+	ssize_t off;
+	int bits, notakeover;
+
+	if (!ctx->enabled || (op & WEBSOCKET_OPCODE) >= WEBSOCKET_CLOSE)
+		return websocket_message(op, mask, dst, size, src, len);
+
+	if (mask != NULL)
+		memcpy(frame.mask, mask, sizeof frame.mask);
+
+	/* Nothing to flush: zlib would give Z_BUF_ERROR right after the last message's
+	   sync flush. RFC 7692 7.2.3.6 lets an empty message go as the single byte 0x00,
+	   which leaves the compressor context as it is. */
+	if (len == 0) {
+		frame.length = 1;
+		if ((off = websocket_writeframe(dst, size, &frame)) < 0 ||
+				(off = websocket_writedata(dst, off, size, trailer, 1)) < 0)
+			return off;
+		websocket_maskdata((unsigned char *) dst + off - 1, 1, &frame, 0);
+		return off;
+	}
+
+	bits = ctx->server ?
+		ctx->params.server_max_window_bits : ctx->params.client_max_window_bits;
+	notakeover = ctx->server ?
+		ctx->params.server_no_context_takeover : ctx->params.client_no_context_takeover;
+
+	if (ctx->deflater == NULL &&
+			(ctx->deflater = getslot(ctx->pool, bits ? bits : 15)) == NULL)
+		return WEBSOCKET_NO_BUFFER_SPACE;
+
+	/* check up front so a failed call leaves the compressor context untouched */
+	if (size < head || size - head < deflateBound(&ctx->deflater->z, len) + 6)
+		return WEBSOCKET_NO_BUFFER_SPACE;
+
+	ctx->deflater->z.next_in = (Bytef *) src;
+	ctx->deflater->z.avail_in = (uInt) len;
+	ctx->deflater->z.next_out = (unsigned char *) dst + head;
+	ctx->deflater->z.avail_out = (uInt) (size - head);
+
+	if (deflate(&ctx->deflater->z, Z_SYNC_FLUSH) != Z_OK || ctx->deflater->z.avail_in != 0)
+		return WEBSOCKET_DATA_ERROR;
+
+	/* a sync flush always ends in the trailer, which does not go on the wire */
+	if ((n = size - head - ctx->deflater->z.avail_out) < sizeof trailer)
+		return WEBSOCKET_DATA_ERROR;
+	n -= sizeof trailer;
+
+	frame.length = n;
+
+	if ((off = websocket_writeframe(dst, size, &frame)) < 0)
+		return off;
+
+	memmove((unsigned char *) dst + off, (unsigned char *) dst + head, n);
+	websocket_maskdata((unsigned char *) dst + off, n, &frame, 0);
+
+	if (notakeover) {
+		putslot(ctx->pool, ctx->deflater);
+		ctx->deflater = NULL;
+	}
+
+	return off + n;
+}
+
+#endif /* WEBSOCKET_DEFLATE */
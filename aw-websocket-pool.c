@@ -0,0 +1,118 @@
+
+/*
+   Copyright (c) 2014-2016 Malte Hildingsson, malte (at) afterwi.se
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+   THE SOFTWARE.
+ */
+
+#include "aw-websocket.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/* Size classes are powers of two from 4 KiB; a free buffer keeps the next
+   pointer in its first bytes. Pools are not locked; keep one per i/o thread. */
+
+#define MINSHIFT (12)
+#define NCLASSES (20)
+
+struct websocket_pool {
+	void *free[NCLASSES];
+};
+
+struct websocket_pool *websocket_pool_create(void) {
+	return calloc(1, sizeof (struct websocket_pool));
+}
+
+void websocket_pool_destroy(struct websocket_pool *pool) {
+	void *p;
+	int i;
+
+	for (i = 0; i < NCLASSES; ++i)
+		while ((p = pool->free[i]) != NULL) {
+			pool->free[i] = *(void **) p;
+			free(p);
+		}
+
+	free(pool);
+}
+
+static int sizeclass(size_t n) {
+	int c = 0;
+
+	while (c < NCLASSES && ((size_t) 1 << (MINSHIFT + c)) < n)
+		++c;
+
+	return c;
+}
+
+static void putbuf(struct websocket_pool *pool, void *p, size_t size) {
+	int c = sizeclass(size);
+
+	*(void **) p = pool->free[c];
+	pool->free[c] = p;
+}
+
+void websocket_assembly_init(
+		struct websocket_assembly *assembly, struct websocket_pool *pool, size_t maxsize) {
+	memset(assembly, 0, sizeof *assembly);
+	assembly->pool = pool;
+	assembly->maxsize = maxsize;
+}
+
+void websocket_assembly_release(struct websocket_assembly *assembly) {
+	if (assembly->buf != NULL)
+		putbuf(assembly->pool, assembly->buf, assembly->size);
+
+	assembly->buf = NULL;
+	assembly->len = 0;
+	assembly->size = 0;
+	assembly->opcode = 0;
+}
+
+int _websocket_reserve(struct websocket_assembly *assembly, size_t n) {
+	unsigned char *buf;
+	size_t size;
+	int c;
+
+	if (n > assembly->maxsize - assembly->len)
+		return WEBSOCKET_DATA_ERROR;
+
+	if (n <= assembly->size - assembly->len)
+		return 0;
+
+	if ((c = sizeclass(assembly->len + n)) == NCLASSES)
+		return WEBSOCKET_DATA_ERROR;
+
+	size = (size_t) 1 << (MINSHIFT + c);
+
+	if ((buf = assembly->pool->free[c]) != NULL)
+		assembly->pool->free[c] = *(void **) buf;
+	else if ((buf = malloc(size)) == NULL)
+		return WEBSOCKET_NO_BUFFER_SPACE;
+
+	if (assembly->buf != NULL) {
+		memcpy(buf, assembly->buf, assembly->len);
+		putbuf(assembly->pool, assembly->buf, assembly->size);
+	}
+
+	assembly->buf = buf;
+	assembly->size = size;
+	return 0;
+}
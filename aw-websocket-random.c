@@ -0,0 +1,170 @@
+
+/*
+   Copyright (c) 2014-2016 Malte Hildingsson, malte (at) afterwi.se
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+   THE SOFTWARE.
+ */
+#ifndef _nofeatures
+# if __linux__
+#  define _GNU_SOURCE 1
+# elif __APPLE__
+#  define _DARWIN_C_SOURCE 1
+# endif
+#endif /* _nofeatures */
+
+#include "aw-websocket.h"
+
+#if _WIN32
+# include <windows.h>
+# include <wincrypt.h>
+#else
+# include <fcntl.h>
+# include <unistd.h>
+# if __linux__
+#  include <sys/syscall.h>
+# endif
+#endif
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* ChaCha20 (RFC 8439) run as a generator: the key is drawn from the OS once and
+   each block of keystream then gives sixteen masks. */
+
+#define ROTL(x, n) ((x) << (n) | (x) >> (32 - (n)))
+#define QR(a, b, c, d) ( \
+	a += b, d ^= a, d = ROTL(d, 16), \
+	c += d, b ^= c, b = ROTL(b, 12), \
+	a += b, d ^= a, d = ROTL(d, 8), \
+	c += d, b ^= c, b = ROTL(b, 7))
+
+static int osrandom(void *p, size_t n) {
+#if _WIN32
+	HCRYPTPROV prov;
+	BOOL ok;
+
+	if (!CryptAcquireContext(&prov, NULL, NULL, PROV_RSA_FULL, CRYPT_VERIFYCONTEXT))
+		return WEBSOCKET_IO_ERROR;
+
+	ok = CryptGenRandom(prov, (DWORD) n, p);
+	CryptReleaseContext(prov, 0);
+	return ok ? 0 : WEBSOCKET_IO_ERROR;
+#elif __APPLE__ || __FreeBSD__ || __OpenBSD__ || __NetBSD__
+	arc4random_buf(p, n);
+	return 0;
+#else
+	ssize_t k;
+	int fd;
+
+# if __linux__ && defined(SYS_getrandom)
+	if (syscall(SYS_getrandom, p, n, 0) == (long) n)
+		return 0;
+# endif
+
+	if ((fd = open("/dev/urandom", O_RDONLY | O_CLOEXEC)) < 0)
+		return WEBSOCKET_IO_ERROR;
+
+	for (; n > 0; p = (unsigned char *) p + k, n -= k)
+		if ((k = read(fd, p, n)) <= 0)
+			return close(fd), WEBSOCKET_IO_ERROR;
+
+	close(fd);
+	return 0;
+#endif
+}
+
+static void block(struct websocket_random *random) {
+	static const uint32_t sigma[4] = {0x61707865, 0x3320646e, 0x79622d32, 0x6b206574};
+	uint32_t x[16], in[16];
+	int i;
+
+	memcpy(in, sigma, sizeof sigma);
+	memcpy(in + 4, random->key, sizeof random->key);
+	in[12] = (uint32_t) random->counter;
+	in[13] = (uint32_t) (random->counter >> 32);
+	in[14] = in[15] = 0;
+	memcpy(x, in, sizeof x);
+
+	for (i = 0; i < 10; ++i) {
+		QR(x[0], x[4], x[8], x[12]);
+		QR(x[1], x[5], x[9], x[13]);
+		QR(x[2], x[6], x[10], x[14]);
+		QR(x[3], x[7], x[11], x[15]);
+		QR(x[0], x[5], x[10], x[15]);
+		QR(x[1], x[6], x[11], x[12]);
+		QR(x[2], x[7], x[8], x[13]);
+		QR(x[3], x[4], x[9], x[14]);
+	}
+
+	for (i = 0; i < 16; ++i) {
+		x[i] += in[i];
+		random->buf[4 * i + 0] = (unsigned char) (x[i] >> 0x00);
+		random->buf[4 * i + 1] = (unsigned char) (x[i] >> 0x08);
+		random->buf[4 * i + 2] = (unsigned char) (x[i] >> 0x10);
+		random->buf[4 * i + 3] = (unsigned char) (x[i] >> 0x18);
+	}
+
+	random->counter++;
+	random->used = 0;
+}
+
+int websocket_random_init(struct websocket_random *random) {
+	memset(random, 0, sizeof *random);
+
+	if (osrandom(random->key, sizeof random->key) < 0)
+		return WEBSOCKET_IO_ERROR;
+
+	random->used = sizeof random->buf;
+	return 0;
+}
+
+void websocket_random_bytes(struct websocket_random *random, void *dst, size_t len) {
+	unsigned char *p = dst;
+	size_t n;
+
+	for (; len > 0; p += n, len -= n) {
+		if (random->used == sizeof random->buf)
+			block(random);
+
+		n = sizeof random->buf - random->used < len ? sizeof random->buf - random->used : len;
+		memcpy(p, random->buf + random->used, n);
+		random->used += (unsigned) n;
+	}
+}
+
+ssize_t websocket_clientmessage(
+		struct websocket_random *random, unsigned char op, void *dst, size_t size,
+		const void *src, size_t len) {
+	unsigned char mask[4];
+
+	websocket_random_bytes(random, mask, sizeof mask);
+	return websocket_message(op, mask, dst, size, src, len);
+}
+
+int websocket_client_init(
+		struct websocket_client *client, const char *uri, const char *fields[], size_t count) {
+	if (websocket_random_init(&client->random) < 0)
+		return WEBSOCKET_IO_ERROR;
+
+	websocket_random_bytes(&client->random, client->nonce, sizeof client->nonce);
+	client->uri = uri;
+	client->fields = fields;
+	client->count = count;
+	return 0;
+}
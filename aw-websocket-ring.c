@@ -0,0 +1,78 @@
+
+/*
+   Copyright (c) 2014-2016 Malte Hildingsson, malte (at) afterwi.se
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+   THE SOFTWARE.
+ */
+
+#ifndef _nofeatures
+# if __linux__
+#  define _GNU_SOURCE 1
+# endif
+#endif /* _nofeatures */
+
+#include "aw-websocket.h"
+
+#if __linux__
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+/* One memfd mapped at base and again at base + size. A reservation of twice the
+   size is made first so both halves land next to each other, then replaced. */
+
+int websocket_ring_init(struct websocket_ring *ring, size_t size) {
+	size_t page = sysconf(_SC_PAGESIZE);
+	unsigned char *base;
+	int fd;
+
+	size = (size + page - 1) & ~(page - 1);
+
+	if ((fd = memfd_create("aw-websocket-ring", MFD_CLOEXEC)) < 0)
+		return WEBSOCKET_IO_ERROR;
+
+	if (ftruncate(fd, size) < 0)
+		return close(fd), WEBSOCKET_IO_ERROR;
+
+	if ((base = mmap(NULL, 2 * size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED)
+		return close(fd), WEBSOCKET_IO_ERROR;
+
+	if (mmap(base, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED ||
+			mmap(base + size, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED)
+		return munmap(base, 2 * size), close(fd), WEBSOCKET_IO_ERROR;
+
+	/* the mappings keep the file alive */
+	close(fd);
+
+	ring->base = base;
+	ring->size = size;
+	ring->head = 0;
+	ring->tail = 0;
+	return 0;
+}
+
+void websocket_ring_release(struct websocket_ring *ring) {
+	if (ring->base != NULL)
+		munmap(ring->base, 2 * ring->size);
+
+	ring->base = NULL;
+	ring->size = ring->head = ring->tail = 0;
+}
+
+#endif /* __linux__ */
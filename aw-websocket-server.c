@@ -0,0 +1,2338 @@
+
+/*
+   Copyright (c) 2014-2016 Malte Hildingsson, malte (at) afterwi.se
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+   THE SOFTWARE.
+ */
+
+#ifndef _nofeatures
+# if __linux__
+#  define _GNU_SOURCE 1
+# endif
+#endif /* _nofeatures */
+
+#include "aw-websocket.h"
+
+#if __linux__
+
+#if !defined(WEBSOCKET_URING) && defined(__has_include)
+# if __has_include(<linux/io_uring.h>)
+#  define WEBSOCKET_URING 1
+# endif
+#endif
+
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#if WEBSOCKET_URING
+# include <linux/io_uring.h>
+# include <sys/mman.h>
+# include <poll.h>
+# ifndef IORING_RECV_MULTISHOT
+#  undef WEBSOCKET_URING
+# endif
+#endif
+
+#define MAXEVENTS (256)
+#define INSIZE (4096)
+#define OUTSIZE (8192)
+#define HIGHWATER (256 * 1024)
+#define IOVMAX (16)
+#define SLABCONNS (1024)
+#define TICK (100)
+#define MAXMESSAGE (1024 * 1024)
+#define FRAGSIZE (64 * 1024)
+
+/* conn->queued */
+#define QUEUED_NONE (0)
+#define QUEUED_PENDING (1)
+#define QUEUED_CORKED (2)
+
+/* conn->cork */
+#define CORK_NONE (0)
+#define CORK_HELD (1) /* corkat is set */
+#define CORK_URGENT (2)
+
+/* conn->deadline */
+#define DEADLINE_NONE (0)
+#define DEADLINE_HANDSHAKE (1)
+#define DEADLINE_PING (2)
+#define DEADLINE_PONG (3)
+#define DEADLINE_LINGER (4)
+
+/* The descriptor behind the fragments of one websocket_conn_sendfile, closed
+   with the last of them whatever order they go in. */
+struct websocket_file {
+	unsigned refs;
+	int fd;
+};
+
+/* A frame from a file keeps only its header in data: the payload past head is
+   sent from file at off. */
+struct websocket_shared {
+	unsigned refs;
+	size_t len;
+	size_t head;
+	off_t off;
+	struct websocket_file *file;
+	unsigned char data[1];
+};
+
+#if WEBSOCKET_URING
+static int uring_init(struct websocket_server *server);
+static void uring_release(struct websocket_server *server);
+static int uring_adopt(struct websocket_server *server, struct websocket_conn *conn);
+static void uring_drop(struct websocket_server *server, struct websocket_conn *conn);
+static int uring_poll(struct websocket_server *server, long long wait);
+static int getslot(struct websocket_server *server, struct websocket_conn *conn);
+static void putslot(struct websocket_uring *u, struct websocket_conn *conn);
+#endif
+
+static void enqueue(struct websocket_conn *conn) {
+	struct websocket_server *server = conn->server;
+
+	if (!conn->queued) {
+		conn->queued = QUEUED_PENDING;
+		conn->next = server->pending;
+		server->pending = conn;
+	} else if (conn->queued == QUEUED_CORKED &&
+			conn->outlen - conn->outoff + conn->qbytes >= server->params.corkbytes)
+		/* corked when it was smaller: due since then, so the next poll sends it */
+		server->corkdue = conn->corkat - server->params.corkus;
+}
+
+/* wraps every 71 minutes, compared as differences */
+static unsigned micros(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned) ((unsigned long long) ts.tv_sec * 1000000 + ts.tv_nsec / 1000);
+}
+
+static unsigned clockticks(const struct websocket_server *server) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned) ((unsigned long long) ts.tv_sec * 1000 / server->params.tick +
+		(unsigned long long) ts.tv_nsec / 1000000 / server->params.tick);
+}
+
+static unsigned ticks(const struct websocket_server *server, unsigned ms) {
+	return (ms + server->params.tick - 1) / server->params.tick;
+}
+
+/* a connection waits on one deadline at a time; setting one replaces the last */
+static void settimer(struct websocket_server *server, struct websocket_conn *conn, unsigned char deadline, unsigned ms) {
+	websocket_wheel_cancel(&server->wheel, &conn->timer);
+	conn->deadline = ms != 0 ? deadline : DEADLINE_NONE;
+
+	/* polls stop keeping time while nothing is pending */
+	if (server->wheel.count == 0)
+		websocket_wheel_advance(&server->wheel, clockticks(server));
+
+	if (ms != 0)
+		websocket_wheel_add(&server->wheel, &conn->timer, server->wheel.now + ticks(server, ms) + 1);
+}
+
+static void upgraded(struct websocket_server *server, struct websocket_conn *conn) {
+	settimer(server, conn, DEADLINE_PING, server->params.pinginterval);
+	conn->seen = server->wheel.now;
+}
+
+static void lingering(struct websocket_server *server, struct websocket_conn *conn) {
+	if (conn->deadline != DEADLINE_LINGER && server->params.linger != 0)
+		settimer(server, conn, DEADLINE_LINGER, server->params.linger);
+}
+
+/* Records come a slab at a time and are never moved or freed before the server,
+   so ids stay valid and io_uring can keep pointers to them in flight. */
+static struct websocket_conn *newconn(struct websocket_server *server) {
+	struct websocket_conn *conn, *slab, **slabs;
+	unsigned i;
+
+	if (server->freeconns == NULL) {
+		if ((slabs = realloc(server->slabs, (server->nslabs + 1) * sizeof *slabs)) == NULL)
+			return NULL;
+		server->slabs = slabs;
+
+		if ((slab = malloc(SLABCONNS * sizeof *slab)) == NULL)
+			return NULL;
+
+		for (i = SLABCONNS; i-- > 0;) {
+			slab[i].fd = -1;
+			slab[i].id = server->nslabs * SLABCONNS + i;
+			slab[i].next = server->freeconns;
+			server->freeconns = &slab[i];
+		}
+
+		server->slabs[server->nslabs++] = slab;
+	}
+
+	conn = server->freeconns;
+	server->freeconns = conn->next;
+	return conn;
+}
+
+static void putconn(struct websocket_server *server, struct websocket_conn *conn) {
+	conn->fd = -1;
+	conn->next = server->freeconns;
+	server->freeconns = conn;
+}
+
+struct websocket_conn *websocket_server_conn(struct websocket_server *server, unsigned id) {
+	struct websocket_conn *conn;
+
+	if (id / SLABCONNS >= server->nslabs)
+		return NULL;
+
+	conn = &server->slabs[id / SLABCONNS][id % SLABCONNS];
+	return conn->fd >= 0 ? conn : NULL;
+}
+
+/* free buffers are chained through their first word */
+static void *borrow(void **list, size_t size) {
+	void *p;
+
+	if ((p = *list) == NULL)
+		return malloc(size);
+
+	*list = *(void **) p;
+	return p;
+}
+
+static void giveback(void **list, void *p) {
+	*(void **) p = *list;
+	*list = p;
+}
+
+static void drain(void **list) {
+	void *p;
+
+	while ((p = *list) != NULL) {
+		*list = *(void **) p;
+		free(p);
+	}
+}
+
+static int needout(struct websocket_server *server, struct websocket_conn *conn) {
+	if (conn->out != NULL)
+		return 0;
+
+#if WEBSOCKET_URING
+	if (server->uring != NULL)
+		return getslot(server, conn);
+#endif
+
+	if ((conn->out = borrow(&server->freeout, server->params.outsize)) == NULL)
+		return WEBSOCKET_NO_BUFFER_SPACE;
+
+	return 0;
+}
+
+/* hand back whatever buffers the connection is done with before it waits */
+static void rest(struct websocket_server *server, struct websocket_conn *conn) {
+	if (conn->in != NULL && conn->inoff == conn->inlen) {
+		giveback(&server->freein, conn->in);
+		conn->in = NULL;
+		conn->inoff = conn->inlen = 0;
+	}
+
+	if (conn->out != NULL && conn->outoff == conn->outlen && !conn->sending) {
+#if WEBSOCKET_URING
+		if (server->uring != NULL)
+			putslot(server->uring, conn);
+		else
+#endif
+		giveback(&server->freeout, conn->out);
+		conn->out = NULL;
+		conn->outoff = conn->outlen = 0;
+	}
+}
+
+struct websocket_shared *websocket_shared_create(unsigned char op, const void *src, size_t len) {
+	struct websocket_shared *shared;
+	ssize_t n;
+
+	if ((shared = malloc(offsetof(struct websocket_shared, data) + len + 14)) == NULL)
+		return NULL;
+
+	if ((n = websocket_message(op, NULL, shared->data, len + 14, src, len)) < 0)
+		return free(shared), NULL;
+
+	shared->refs = 1;
+	shared->len = shared->head = n;
+	shared->file = NULL;
+	return shared;
+}
+
+void websocket_shared_retain(struct websocket_shared *shared, unsigned n) {
+	__atomic_add_fetch(&shared->refs, n, __ATOMIC_RELAXED);
+}
+
+void websocket_shared_release(struct websocket_shared *shared) {
+	if (__atomic_sub_fetch(&shared->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+		if (shared->file != NULL && __atomic_sub_fetch(&shared->file->refs, 1, __ATOMIC_ACQ_REL) == 0)
+			close(shared->file->fd), free(shared->file);
+		free(shared);
+	}
+}
+
+/* maxqueue would be passed: drop the message, or the connection with EVICT */
+static int overflows(struct websocket_conn *conn, size_t len) {
+	struct websocket_server *server = conn->server;
+
+	if (server->params.maxqueue == 0 || conn->qbytes + len <= server->params.maxqueue)
+		return 0;
+
+	if (server->params.flags & WEBSOCKET_SERVER_EVICT) {
+		server->nevicted++;
+		websocket_conn_abort(conn);
+	} else
+		server->ndropped++;
+
+	return 1;
+}
+
+/* room for n more, so the fragments of a message are queued all or none */
+static int reserve(struct websocket_conn *conn, unsigned n) {
+	struct websocket_shared **queue;
+	unsigned i, size = conn->qsize ? conn->qsize : 8;
+
+	while (size - conn->qcount < n)
+		size *= 2;
+
+	if (size == conn->qsize)
+		return 0;
+
+	if ((queue = malloc(size * sizeof *queue)) == NULL)
+		return WEBSOCKET_NO_BUFFER_SPACE;
+
+	for (i = 0; i < conn->qcount; ++i)
+		queue[i] = conn->queue[(conn->qhead + i) & (conn->qsize - 1)];
+
+	free(conn->queue);
+	conn->queue = queue;
+	conn->qsize = size;
+	conn->qhead = 0;
+	return 0;
+}
+
+static int control(const struct websocket_shared *shared) {
+	return (shared->data[0] & WEBSOCKET_OPCODE) >= WEBSOCKET_CLOSE;
+}
+
+/* only pings and pongs may overtake data; nothing follows a close */
+static int priority(const struct websocket_shared *shared) {
+	return (shared->data[0] & WEBSOCKET_OPCODE) > WEBSOCKET_CLOSE;
+}
+
+/* queued frames the socket already has part of, or io_uring is writing */
+static unsigned started(const struct websocket_conn *conn) {
+	return conn->qsending > 0 ? conn->qsending : conn->qoff > 0;
+}
+
+/* drop queued frames from the back until keep are left */
+static void cut(struct websocket_conn *conn, unsigned keep) {
+	struct websocket_shared *shared;
+
+	while (conn->qcount > keep) {
+		shared = conn->queue[(conn->qhead + --conn->qcount) & (conn->qsize - 1)];
+		conn->qbytes -= shared->len;
+		conn->server->qbytes -= shared->len;
+		websocket_shared_release(shared);
+	}
+}
+
+/* Takes over the caller's reference on success. Control frames are never
+   dropped. Pings and pongs go ahead of queued data, behind the frames already
+   started and the pings and pongs before them; the ones in front step back a
+   slot. A close ends the connection's output: it goes behind everything queued
+   and the connection takes nothing more. */
+static int push(struct websocket_conn *conn, struct websocket_shared *shared) {
+	struct websocket_server *server = conn->server;
+	unsigned i, j, mask;
+
+	if (conn->closing)
+		return WEBSOCKET_DATA_ERROR;
+
+	if ((!control(shared) && overflows(conn, shared->len)) || reserve(conn, 1) < 0)
+		return WEBSOCKET_NO_BUFFER_SPACE;
+
+	mask = conn->qsize - 1;
+	i = conn->qcount;
+
+	if (priority(shared)) {
+		i = started(conn);
+		while (i < conn->qcount && priority(conn->queue[(conn->qhead + i) & mask]))
+			++i;
+
+		if (i < conn->qcount) {
+			conn->qhead = (conn->qhead - 1) & mask;
+			for (j = 0; j < i; ++j)
+				conn->queue[(conn->qhead + j) & mask] = conn->queue[(conn->qhead + j + 1) & mask];
+		}
+	}
+
+	conn->queue[(conn->qhead + i) & mask] = shared;
+	conn->qcount++;
+	conn->qbytes += shared->len;
+	server->qbytes += shared->len;
+
+	if (!conn->paused && conn->qbytes >= server->params.highwater) {
+		conn->paused = 1;
+		server->npaused++;
+		if (server->params.pressure != NULL)
+			server->params.pressure(conn, 1);
+	}
+
+	if (!priority(shared) && control(shared))
+		conn->closing = 1;
+
+	enqueue(conn);
+	return 0;
+}
+
+/* all of a message or none of it, so a full queue never cuts one short */
+static int pushall(struct websocket_conn *conn, struct websocket_shared *const *frames, size_t n, size_t len) {
+	size_t i;
+
+	if (conn->closing)
+		return WEBSOCKET_DATA_ERROR;
+
+	if ((!control(frames[0]) && overflows(conn, len)) || reserve(conn, n) < 0)
+		return WEBSOCKET_NO_BUFFER_SPACE;
+
+	for (i = 0; i < n; ++i)
+		push(conn, frames[i]);
+
+	return 0;
+}
+
+/* whole data messages are cut at fragsize, anything else goes as it is */
+static size_t nfragments(const struct websocket_server *server, unsigned char op, size_t len) {
+	if (!(op & WEBSOCKET_FIN) || (op & WEBSOCKET_OPCODE) >= WEBSOCKET_CLOSE || len <= server->params.fragsize)
+		return 1;
+
+	return (len + server->params.fragsize - 1) / server->params.fragsize;
+}
+
+/* encode the message as n frames, RSV1 on the first only; returns their total length */
+static ssize_t fragment(
+		const struct websocket_server *server, unsigned char op, const unsigned char *src, size_t len,
+		struct websocket_shared **frames, size_t n) {
+	size_t i, k, total = 0, fragsize = server->params.fragsize;
+
+	for (i = 0; i < n; ++i, src += k, len -= k) {
+		k = n == 1 || len < fragsize ? len : fragsize;
+
+		if ((frames[i] = websocket_shared_create(
+				n == 1 ? op :
+				i == 0 ? op & ~WEBSOCKET_FIN :
+				i + 1 == n ? WEBSOCKET_FIN | WEBSOCKET_CONTINUATION : WEBSOCKET_CONTINUATION,
+				src, k)) == NULL) {
+			while (i > 0)
+				websocket_shared_release(frames[--i]);
+			return WEBSOCKET_NO_BUFFER_SPACE;
+		}
+
+		total += frames[i]->len;
+	}
+
+	return total;
+}
+
+static void pop(struct websocket_conn *conn) {
+	struct websocket_shared *shared = conn->queue[conn->qhead];
+
+	conn->qbytes -= shared->len - conn->qoff;
+	conn->server->qbytes -= shared->len - conn->qoff;
+
+	websocket_shared_release(shared);
+	conn->qhead = (conn->qhead + 1) & (conn->qsize - 1);
+	conn->qcount--;
+	conn->qoff = 0;
+}
+
+static void popall(struct websocket_conn *conn) {
+	while (conn->qcount > 0)
+		pop(conn);
+
+	if (conn->paused) {
+		conn->paused = 0;
+		conn->server->npaused--;
+	}
+
+	free(conn->queue);
+	conn->queue = NULL;
+	conn->qsize = 0;
+}
+
+/* n bytes of the first queued frame went out */
+static void sent(struct websocket_conn *conn, size_t n) {
+	struct websocket_server *server = conn->server;
+
+	conn->qoff += n;
+	conn->qbytes -= n;
+	server->qbytes -= n;
+
+	if (conn->qoff == conn->queue[conn->qhead]->len)
+		pop(conn);
+
+	if (conn->paused && conn->qbytes <= server->params.lowwater) {
+		conn->paused = 0;
+		server->npaused--;
+		if (server->params.pressure != NULL)
+			server->params.pressure(conn, 0);
+		enqueue(conn);
+	}
+}
+
+static void dispose(struct websocket_server *server, struct websocket_conn *conn) {
+	if (conn->in != NULL)
+		giveback(&server->freein, conn->in);
+	if (conn->state.http != NULL)
+		giveback(&server->freehttp, conn->state.http);
+	if (conn->state.assembly != NULL) {
+		websocket_assembly_release(conn->state.assembly);
+		free(conn->state.assembly);
+	}
+
+	popall(conn);
+	putconn(server, conn);
+}
+
+/* with work: copy each message out whole and queue it on the connection's strand */
+static ssize_t collect(int op, void *dst, size_t size, const void *src, size_t len, void *userdata) {
+	struct websocket_conn *conn = userdata;
+	struct websocket_job *job;
+
+	(void) dst;
+	(void) size;
+
+	if (conn->strand == NULL && (conn->strand = _websocket_strand_create(conn->server->mailbox, conn)) == NULL)
+		return WEBSOCKET_NO_BUFFER_SPACE;
+
+	if ((job = malloc(sizeof *job + len)) == NULL)
+		return WEBSOCKET_NO_BUFFER_SPACE;
+
+	job->userdata = conn->userdata;
+	job->id = conn->id;
+	job->op = (unsigned char) op;
+	job->data = (unsigned char *) (job + 1);
+	job->len = len;
+
+	if (len > 0)
+		memcpy(job->data, src, len);
+
+	_websocket_strand_submit(conn->strand, job);
+	return 0;
+}
+
+/* read nothing more at a message boundary while output or work has piled up */
+static int stalled(struct websocket_server *server, struct websocket_conn *conn) {
+	return conn->state.idle && (conn->paused ||
+		(conn->strand != NULL && _websocket_strand_full(conn->strand, server->params.highwater)));
+}
+
+static void closework(struct websocket_server *server) {
+	if (server->mailbox != NULL)
+		_websocket_mailbox_destroy(server->mailbox);
+	if (server->pool != NULL)
+		websocket_pool_destroy(server->pool);
+}
+
+int websocket_server_init(
+		struct websocket_server *server, int lfd, const struct websocket_server_params *params) {
+	struct epoll_event ev = {EPOLLIN | EPOLLET, {NULL}};
+
+	memset(server, 0, sizeof *server);
+	server->params = *params;
+	server->lfd = lfd;
+	server->epfd = -1;
+
+	if (server->params.insize == 0)
+		server->params.insize = INSIZE;
+	if (server->params.outsize == 0)
+		server->params.outsize = OUTSIZE;
+	if (server->params.highwater == 0)
+		server->params.highwater = HIGHWATER;
+	if (server->params.lowwater == 0 || server->params.lowwater > server->params.highwater)
+		server->params.lowwater = server->params.highwater / 4;
+	if (server->params.tick == 0)
+		server->params.tick = TICK;
+	if (server->params.pongtimeout == 0)
+		server->params.pongtimeout = server->params.pinginterval;
+
+	if (server->params.maxmessage == 0)
+		server->params.maxmessage = MAXMESSAGE;
+	if (server->params.fragsize == 0)
+		server->params.fragsize = FRAGSIZE;
+	if (server->params.corkbytes == 0)
+		server->params.corkbytes = server->params.outsize;
+
+	websocket_wheel_init(&server->wheel, clockticks(server));
+
+	if (server->params.work != NULL) {
+		server->params.handler = &collect;
+
+		if ((server->pool = websocket_pool_create()) == NULL || (server->mailbox = _websocket_mailbox_create(
+				server->params.workers, server->params.work, server->params.lowwater)) == NULL)
+			return closework(server), WEBSOCKET_NO_BUFFER_SPACE;
+	}
+
+#if WEBSOCKET_URING
+	if (!(server->params.flags & WEBSOCKET_SERVER_EPOLL) && uring_init(server) == 0)
+		return 0;
+#endif
+
+	if ((server->events = malloc(MAXEVENTS * sizeof (struct epoll_event))) == NULL)
+		return closework(server), WEBSOCKET_IO_ERROR;
+
+	if ((server->epfd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+		return free(server->events), closework(server), WEBSOCKET_IO_ERROR;
+
+	if (lfd >= 0 && (fcntl(lfd, F_SETFL, fcntl(lfd, F_GETFL) | O_NONBLOCK) < 0 ||
+			epoll_ctl(server->epfd, EPOLL_CTL_ADD, lfd, &ev) < 0))
+		return close(server->epfd), free(server->events), closework(server), WEBSOCKET_IO_ERROR;
+
+	/* told apart from connections by its pointer */
+	ev.data.ptr = server->mailbox;
+
+	if (server->mailbox != NULL &&
+			epoll_ctl(server->epfd, EPOLL_CTL_ADD, _websocket_mailbox_fd(server->mailbox), &ev) < 0)
+		return close(server->epfd), free(server->events), closework(server), WEBSOCKET_IO_ERROR;
+
+	return 0;
+}
+
+static void release(struct websocket_server *server, struct websocket_conn *conn) {
+	struct websocket_conn **p;
+
+	if (server->params.close != NULL)
+		server->params.close(conn);
+
+	websocket_wheel_cancel(&server->wheel, &conn->timer);
+
+	/* work still queued is skipped, replies still coming are dropped */
+	if (conn->strand != NULL) {
+		_websocket_strand_close(conn->strand);
+		conn->strand = NULL;
+	}
+
+	if (conn->queued)
+		for (p = conn->queued == QUEUED_CORKED ? &server->corked : &server->pending; *p != NULL; p = &(*p)->next)
+			if (*p == conn) {
+				*p = conn->next;
+				break;
+			}
+
+	server->conns[conn->index] = server->conns[--server->count];
+	server->conns[conn->index]->index = conn->index;
+
+#if WEBSOCKET_URING
+	if (server->uring != NULL) {
+		uring_drop(server, conn);
+		return;
+	}
+#endif
+
+	close(conn->fd);
+
+	if (conn->out != NULL)
+		giveback(&server->freeout, conn->out);
+
+	dispose(server, conn);
+}
+
+void websocket_server_release(struct websocket_server *server) {
+	while (server->count > 0)
+		release(server, server->conns[server->count - 1]);
+
+#if WEBSOCKET_URING
+	if (server->uring != NULL)
+		uring_release(server);
+#endif
+
+	if (server->epfd >= 0)
+		close(server->epfd);
+
+	closework(server);
+
+	while (server->nslabs > 0)
+		free(server->slabs[--server->nslabs]);
+
+	drain(&server->freein);
+	drain(&server->freeout);
+	drain(&server->freehttp);
+
+	free(server->slabs);
+	free(server->conns);
+	free(server->events);
+}
+
+int websocket_server_adopt(struct websocket_server *server, int fd) {
+	struct websocket_conn *conn, **conns;
+	struct websocket_http *http;
+	struct epoll_event ev = {EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, {NULL}};
+	size_t capacity;
+	unsigned id;
+
+	if (server->count == server->capacity) {
+		capacity = server->capacity ? server->capacity * 2 : 64;
+		if ((conns = realloc(server->conns, capacity * sizeof *conns)) == NULL)
+			return WEBSOCKET_NO_BUFFER_SPACE;
+		server->conns = conns;
+		server->capacity = capacity;
+	}
+
+	if ((http = borrow(&server->freehttp, sizeof *http)) == NULL)
+		return WEBSOCKET_NO_BUFFER_SPACE;
+
+	if ((conn = newconn(server)) == NULL)
+		return giveback(&server->freehttp, http), WEBSOCKET_NO_BUFFER_SPACE;
+
+	id = conn->id;
+	memset(conn, 0, sizeof *conn);
+	conn->fd = fd;
+	conn->id = id;
+	conn->server = server;
+	conn->held = -1;
+	websocket_state_init_http(&conn->state, http);
+
+	/* set up front, since the first message can come in with the handshake */
+	if (server->params.work != NULL) {
+		if ((conn->state.assembly = malloc(sizeof *conn->state.assembly)) == NULL)
+			return dispose(server, conn), WEBSOCKET_NO_BUFFER_SPACE;
+		websocket_assembly_init(conn->state.assembly, server->pool, server->params.maxmessage);
+	}
+
+	ev.data.ptr = conn;
+
+	if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) < 0)
+		return dispose(server, conn), WEBSOCKET_IO_ERROR;
+
+#if WEBSOCKET_URING
+	if (server->uring != NULL) {
+		if (uring_adopt(server, conn) < 0)
+			return dispose(server, conn), WEBSOCKET_IO_ERROR;
+	} else
+#endif
+	if (epoll_ctl(server->epfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+		return dispose(server, conn), WEBSOCKET_IO_ERROR;
+
+	conn->index = server->count;
+	server->conns[server->count++] = conn;
+	settimer(server, conn, DEADLINE_HANDSHAKE, server->params.handshake);
+
+	if (server->params.open != NULL)
+		server->params.open(conn);
+
+	return 0;
+}
+
+static void accepted(struct websocket_server *server, int fd) {
+	int one = 1;
+
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+
+	if (websocket_server_adopt(server, fd) < 0)
+		close(fd);
+}
+
+static void acceptall(struct websocket_server *server) {
+	int fd;
+
+	while ((fd = accept4(server->lfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0)
+		accepted(server, fd);
+}
+
+/* n bytes of queued frames went out, however many frames they span */
+static void sentframes(struct websocket_conn *conn, size_t n) {
+	size_t k;
+
+	while (n > 0) {
+		if ((k = conn->queue[conn->qhead]->len - conn->qoff) > n)
+			k = n;
+
+		sent(conn, k);
+		n -= k;
+	}
+}
+
+static void advance(struct websocket_conn *conn, size_t n) {
+	size_t k;
+
+	if ((k = conn->outlen - conn->outoff) > n)
+		k = n;
+
+	conn->outoff += k;
+	sentframes(conn, n - k);
+}
+
+/* Queued frames go out between the handler's messages; a closing connection
+   still sends the ones it kept, so no frame is cut short and a close goes last. */
+static int queueready(const struct websocket_conn *conn) {
+	return conn->state.idle || conn->closing;
+}
+
+/* the first queued frame is down to payload in a file */
+static int filenext(const struct websocket_conn *conn) {
+	return conn->qcount > 0 && queueready(conn) && conn->qoff >= conn->queue[conn->qhead]->head;
+}
+
+/* straight from the page cache; the payload never enters user space */
+static int sendpayload(struct websocket_conn *conn) {
+	struct websocket_shared *shared = conn->queue[conn->qhead];
+	off_t off = shared->off + (off_t) (conn->qoff - shared->head);
+	ssize_t n;
+
+	conn->server->nsends++;
+
+	if ((n = sendfile(conn->fd, shared->file->fd, &off, shared->len - conn->qoff)) < 0)
+		return errno == EAGAIN || errno == EWOULDBLOCK ? WEBSOCKET_NO_BUFFER_SPACE : WEBSOCKET_IO_ERROR;
+
+	/* the file was cut short: the frame can never be finished */
+	if (n == 0)
+		return WEBSOCKET_IO_ERROR;
+
+	sent(conn, n);
+	return 0;
+}
+
+/* Own output first, then shared frames once the parser sits between messages;
+   gathered so a burst of broadcasts costs one system call. A frame from a file
+   ends the gather after its header, corked so the payload can share a segment. */
+static int flush(struct websocket_conn *conn) {
+	struct iovec iov[IOVMAX];
+	struct msghdr msg;
+	struct websocket_shared *shared;
+	unsigned i, n;
+	size_t off;
+	ssize_t err;
+	int more;
+
+	for (;;) {
+		n = 0;
+		more = 0;
+
+		if (conn->outoff < conn->outlen) {
+			iov[n].iov_base = conn->out + conn->outoff;
+			iov[n++].iov_len = conn->outlen - conn->outoff;
+		}
+
+		if (queueready(conn))
+			for (i = 0, off = conn->qoff; i < conn->qcount && n < IOVMAX && !more; ++i, off = 0) {
+				shared = conn->queue[(conn->qhead + i) & (conn->qsize - 1)];
+				if (off >= shared->head)
+					break;
+				iov[n].iov_base = shared->data + off;
+				iov[n++].iov_len = shared->head - off;
+				more = shared->head < shared->len;
+			}
+
+		if (n == 0) {
+			if (!filenext(conn))
+				break;
+			if ((err = sendpayload(conn)) < 0)
+				return err;
+			continue;
+		}
+
+		memset(&msg, 0, sizeof msg);
+		msg.msg_iov = iov;
+		msg.msg_iovlen = n;
+		conn->server->nsends++;
+
+		if ((err = sendmsg(conn->fd, &msg, MSG_NOSIGNAL | (more ? MSG_MORE : 0))) < 0)
+			return errno == EAGAIN || errno == EWOULDBLOCK ? WEBSOCKET_NO_BUFFER_SPACE : WEBSOCKET_IO_ERROR;
+
+		advance(conn, err);
+	}
+
+	conn->outoff = conn->outlen = 0;
+	return 0;
+}
+
+/* While queued data holds up the parser, answer the pings already read with
+   pongs through the queue's priority lane and drop the pongs, as websocket_update
+   would. Stops at the first frame it would have to hand to the handler. */
+static void pings(struct websocket_conn *conn) {
+	struct websocket_frame frame;
+	unsigned char payload[125];
+	struct websocket_shared *shared;
+	ssize_t n;
+
+	if (!conn->state.idle || conn->state.http != NULL || conn->closing || conn->in == NULL)
+		return;
+
+	while ((n = websocket_readframe(conn->in + conn->inoff, conn->inlen - conn->inoff, &frame)) > 0) {
+		if ((frame.header[0] & ~WEBSOCKET_OPCODE) != WEBSOCKET_FIN || !(frame.header[1] & WEBSOCKET_MASK) ||
+				frame.length > sizeof payload || frame.length > conn->inlen - conn->inoff - (size_t) n)
+			break;
+
+		if ((frame.header[0] & WEBSOCKET_OPCODE) == WEBSOCKET_PING) {
+			websocket_unmaskcopy(payload, conn->in + conn->inoff + n, frame.length, &frame, 0);
+			if ((shared = websocket_shared_create(WEBSOCKET_FIN | WEBSOCKET_PONG, payload, frame.length)) == NULL)
+				break;
+			if (push(conn, shared) < 0) {
+				websocket_shared_release(shared);
+				break;
+			}
+		} else if ((frame.header[0] & WEBSOCKET_OPCODE) != WEBSOCKET_PONG)
+			break;
+
+		conn->inoff += n + frame.length;
+	}
+}
+
+/* read what fits while the queue waits on the socket, for pings to answer */
+static int peek(struct websocket_server *server, struct websocket_conn *conn) {
+	ssize_t n;
+
+	if (conn->in == NULL && (conn->in = borrow(&server->freein, server->params.insize)) == NULL)
+		return WEBSOCKET_NO_BUFFER_SPACE;
+
+	if (conn->inoff > 0) {
+		memmove(conn->in, conn->in + conn->inoff, conn->inlen - conn->inoff);
+		conn->inlen -= conn->inoff;
+		conn->inoff = 0;
+	}
+
+	while (conn->inlen < server->params.insize) {
+		if ((n = recv(conn->fd, conn->in + conn->inlen, server->params.insize - conn->inlen, 0)) <= 0) {
+			if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+				return WEBSOCKET_IO_ERROR;
+			break;
+		}
+
+		conn->inlen += n;
+		conn->seen = server->wheel.now;
+	}
+
+	pings(conn);
+	return 0;
+}
+
+/* Run until the socket would block either way, as edge triggering requires;
+   returns 0 to wait for the next event or an error to drop the connection. */
+static int service(struct websocket_server *server, struct websocket_conn *conn) {
+	struct websocket_result r;
+	struct websocket_http *http;
+	ssize_t err;
+
+	for (;;) {
+		if ((err = flush(conn)) < 0) {
+			if (err != WEBSOCKET_NO_BUFFER_SPACE)
+				return err;
+			if (conn->closing)
+				lingering(server, conn);
+			else if (conn->qcount > 0 && conn->state.idle && (err = peek(server, conn)) < 0)
+				return err;
+			rest(server, conn);
+			return 0;
+		}
+
+		if (conn->closing)
+			return WEBSOCKET_NO_DATA;
+
+		/* over the high watermark: read nothing more until the queue drains */
+		if (stalled(server, conn)) {
+			rest(server, conn);
+			return 0;
+		}
+
+		if (needout(server, conn) < 0 ||
+				(conn->in == NULL && (conn->in = borrow(&server->freein, server->params.insize)) == NULL))
+			return WEBSOCKET_NO_BUFFER_SPACE;
+
+		http = conn->state.http;
+		r = websocket_update(
+			&conn->state, conn->out, server->params.outsize,
+			conn->in + conn->inoff, conn->inlen - conn->inoff, server->params.handler, conn);
+
+		if (http != NULL && conn->state.http == NULL) {
+			giveback(&server->freehttp, http);
+			upgraded(server, conn);
+		}
+
+		conn->inoff += r.srclen;
+		conn->outlen = r.dstlen;
+
+		if (r.error == 0)
+			conn->closing = 1;
+		else if (r.error == WEBSOCKET_NO_BUFFER_SPACE) {
+			if (r.dstlen == 0)
+				return r.error;
+		} else if (r.error != WEBSOCKET_NO_DATA)
+			return r.error;
+		else if (r.dstlen == 0) {
+			/* the message that held up the queue is over */
+			if (conn->qcount > 0 && queueready(conn))
+				continue;
+
+			if (conn->inoff > 0) {
+				memmove(conn->in, conn->in + conn->inoff, conn->inlen - conn->inoff);
+				conn->inlen -= conn->inoff;
+				conn->inoff = 0;
+			}
+
+			if (conn->inlen == server->params.insize)
+				return WEBSOCKET_NO_BUFFER_SPACE;
+
+			if ((err = recv(conn->fd, conn->in + conn->inlen, server->params.insize - conn->inlen, 0)) == 0)
+				return WEBSOCKET_NO_DATA;
+			if (err < 0) {
+				if (errno != EAGAIN && errno != EWOULDBLOCK)
+					return WEBSOCKET_IO_ERROR;
+				rest(server, conn);
+				return 0;
+			}
+
+			conn->inlen += err;
+			conn->seen = server->wheel.now;
+		}
+	}
+}
+
+/* Run every deadline that passed since the last poll in one go. Input only
+   stamps conn->seen, so keepalive costs the wheel nothing while data flows: a
+   ping deadline finding recent input is just pushed out from there. */
+static void expire(struct websocket_server *server) {
+	struct websocket_timer *timer, *next;
+	struct websocket_conn *conn;
+	unsigned now, interval, pong;
+
+	timer = websocket_wheel_advance(&server->wheel, clockticks(server));
+	now = server->wheel.now;
+	interval = ticks(server, server->params.pinginterval);
+	pong = ticks(server, server->params.pongtimeout);
+
+	for (; timer != NULL; timer = next) {
+		next = timer->next;
+		conn = (struct websocket_conn *) ((char *) timer - offsetof(struct websocket_conn, timer));
+
+		if (conn->deadline == DEADLINE_PING && now - conn->seen < interval)
+			websocket_wheel_add(&server->wheel, &conn->timer, conn->seen + interval + 1);
+		else if (conn->deadline == DEADLINE_PING) {
+			/* mid-message or closing, no ping can go out; silence is enough to decide */
+			if (conn->state.idle && !conn->closing)
+				websocket_conn_send(conn, WEBSOCKET_FIN | WEBSOCKET_PING, "", 0);
+			settimer(server, conn, DEADLINE_PONG, server->params.pongtimeout);
+		} else if (conn->deadline == DEADLINE_PONG && (int) (conn->seen - (timer->expires - pong - 1)) >= 0) {
+			/* heard from since the ping */
+			conn->deadline = DEADLINE_PING;
+			websocket_wheel_add(&server->wheel, &conn->timer, conn->seen + interval + 1);
+		} else
+			release(server, conn);
+	}
+}
+
+/* from the workers, each connection's in the order they were made */
+static void replies(struct websocket_server *server) {
+	struct websocket_conn *conn;
+	struct websocket_shared *shared;
+	int kind;
+
+	while ((kind = _websocket_mailbox_pop(server->mailbox, &conn, &shared)) != 0) {
+		if (conn != NULL && kind == _WEBSOCKET_REPLY_SEND)
+			websocket_conn_sendshared(conn, shared);
+		else if (conn != NULL && kind == _WEBSOCKET_REPLY_CLOSE)
+			websocket_conn_close(conn);
+		else if (conn != NULL)
+			enqueue(conn);
+
+		if (shared != NULL)
+			websocket_shared_release(shared);
+	}
+}
+
+/* Corked connections go back on the pending list at every poll and are held
+   again unless their output has to go now; there are only ever as many as
+   wrote something within the last corkus. */
+static void uncork(struct websocket_server *server) {
+	struct websocket_conn *conn;
+
+	while ((conn = server->corked) != NULL) {
+		server->corked = conn->next;
+		conn->queued = QUEUED_NONE;
+		enqueue(conn);
+	}
+}
+
+static int cork(struct websocket_server *server, struct websocket_conn *conn, unsigned now) {
+	size_t n = conn->outlen - conn->outoff + conn->qbytes;
+
+	/* input held from the ring has to be parsed anyway */
+	if (server->params.corkus == 0 || conn->cork == CORK_URGENT || conn->closing ||
+			n == 0 || n >= server->params.corkbytes || conn->held >= 0 ||
+			(conn->cork == CORK_HELD && (int) (now - conn->corkat) >= 0)) {
+		conn->cork = CORK_NONE;
+		return 0;
+	}
+
+	if (conn->cork == CORK_NONE) {
+		conn->cork = CORK_HELD;
+		conn->corkat = now + server->params.corkus;
+	}
+
+	if (server->corked == NULL || (int) (conn->corkat - server->corkdue) < 0)
+		server->corkdue = conn->corkat;
+
+	conn->queued = QUEUED_CORKED;
+	conn->next = server->corked;
+	server->corked = conn;
+	return 1;
+}
+
+void websocket_conn_flush(struct websocket_conn *conn) {
+	struct websocket_server *server = conn->server;
+
+	if (conn->queued == QUEUED_CORKED)
+		server->corkdue = conn->corkat - server->params.corkus;
+	else
+		enqueue(conn);
+
+	conn->cork = CORK_URGENT;
+}
+
+/* microseconds to wait, -1 for no limit */
+static long long waittime(struct websocket_server *server, int timeout) {
+	long long wait = timeout < 0 ? -1 : timeout * 1000LL;
+	int due;
+
+	if (server->pending != NULL)
+		return 0;
+
+	if (server->corked != NULL) {
+		due = (int) (server->corkdue - micros());
+		if (due < 0)
+			due = 0;
+		if (wait < 0 || due < wait)
+			wait = due;
+	}
+
+	return wait;
+}
+
+/* epoll_wait rounds up to whole milliseconds, which a cork budget cannot afford */
+static int waitevents(struct websocket_server *server, long long wait) {
+#ifdef SYS_epoll_pwait2
+	static int nopwait2;
+	struct timespec ts;
+	int n;
+
+	if (wait > 0 && wait % 1000 != 0 && !nopwait2) {
+		ts.tv_sec = wait / 1000000;
+		ts.tv_nsec = wait % 1000000 * 1000;
+
+		if ((n = syscall(SYS_epoll_pwait2, server->epfd, server->events, MAXEVENTS, &ts, NULL, 0)) >= 0 ||
+				errno != ENOSYS)
+			return n;
+		nopwait2 = 1;
+	}
+#endif
+
+	return epoll_wait(server->epfd, server->events, MAXEVENTS, wait < 0 ? -1 : (int) ((wait + 999) / 1000));
+}
+
+int websocket_server_poll(struct websocket_server *server, int timeout) {
+	struct epoll_event *events = server->events;
+	struct websocket_conn *conn;
+	unsigned now = 0;
+	int i, n;
+
+	/* wake for the next tick while deadlines are pending */
+	if (server->wheel.count > 0 && (timeout < 0 || (unsigned) timeout > server->params.tick))
+		timeout = server->params.tick;
+
+#if WEBSOCKET_URING
+	if (server->uring != NULL)
+		return uring_poll(server, waittime(server, timeout));
+#endif
+
+	if ((n = waitevents(server, waittime(server, timeout))) < 0)
+		return errno == EINTR ? 0 : WEBSOCKET_IO_ERROR;
+
+	for (i = 0; i < n; ++i) {
+		if ((conn = events[i].data.ptr) == NULL)
+			acceptall(server);
+		else if (events[i].data.ptr == server->mailbox)
+			replies(server);
+		else if (server->params.corkus != 0 && events[i].events == EPOLLOUT)
+			/* room to write alone is no reason to skip the cork */
+			enqueue(conn);
+		else if (service(server, conn) < 0)
+			release(server, conn);
+	}
+
+	expire(server);
+	uncork(server);
+
+	if (server->params.corkus != 0 && server->pending != NULL)
+		now = micros();
+
+	while ((conn = server->pending) != NULL) {
+		server->pending = conn->next;
+		conn->queued = QUEUED_NONE;
+
+		if (!cork(server, conn, now) && service(server, conn) < 0)
+			release(server, conn);
+	}
+
+	return n;
+}
+
+ssize_t websocket_conn_send(struct websocket_conn *conn, unsigned char op, const void *src, size_t len) {
+	struct websocket_shared *frames[64], **shared = frames;
+	size_t i, n, size = conn->server->params.outsize;
+	ssize_t err, total;
+
+	if (conn->closing)
+		return WEBSOCKET_DATA_ERROR;
+
+	/* behind shared frames, or while the handler may be mid-message in out,
+	   keep order by queueing this one the same way */
+	if (conn->qcount == 0 && queueready(conn)) {
+		if ((err = needout(conn->server, conn)) < 0)
+			return err;
+
+		/* never move bytes the kernel is still sending from */
+		if (conn->outoff > 0 && !conn->sending && size - conn->outlen < len + 14) {
+			memmove(conn->out, conn->out + conn->outoff, conn->outlen - conn->outoff);
+			conn->outlen -= conn->outoff;
+			conn->outoff = 0;
+		}
+
+		if ((err = websocket_message(op, NULL, conn->out + conn->outlen, size - conn->outlen, src, len)) >= 0) {
+			conn->outlen += err;
+			conn->closing = (op & WEBSOCKET_OPCODE) == WEBSOCKET_CLOSE;
+			if ((op & WEBSOCKET_OPCODE) >= WEBSOCKET_CLOSE)
+				websocket_conn_flush(conn);
+			else
+				enqueue(conn);
+			return err;
+		}
+
+		if (err != WEBSOCKET_NO_BUFFER_SPACE)
+			return err;
+	}
+
+	/* does not fit in out: spill onto the queue, cut so control frames can pass */
+	n = nfragments(conn->server, op, len);
+	if (n > sizeof frames / sizeof *frames && (shared = malloc(n * sizeof *shared)) == NULL)
+		return WEBSOCKET_NO_BUFFER_SPACE;
+
+	if ((total = fragment(conn->server, op, src, len, shared, n)) >= 0 && (err = pushall(conn, shared, n, total)) < 0) {
+		for (i = 0; i < n; ++i)
+			websocket_shared_release(shared[i]);
+		total = err;
+	}
+
+	if (shared != frames)
+		free(shared);
+
+	if (total >= 0 && (op & WEBSOCKET_OPCODE) >= WEBSOCKET_CLOSE)
+		websocket_conn_flush(conn);
+
+	return total;
+}
+
+void websocket_conn_close(struct websocket_conn *conn) {
+	conn->closing = 1;
+	websocket_conn_flush(conn);
+}
+
+void websocket_conn_abort(struct websocket_conn *conn) {
+	cut(conn, started(conn));
+	conn->closing = 1;
+	websocket_conn_flush(conn);
+}
+
+int websocket_conn_sendshared(struct websocket_conn *conn, struct websocket_shared *shared) {
+	int err;
+
+	if ((err = push(conn, shared)) < 0)
+		return err;
+
+	websocket_shared_retain(shared, 1);
+	return 0;
+}
+
+ssize_t websocket_conn_sendfile(struct websocket_conn *conn, unsigned char op, int fd, off_t off, size_t len) {
+	struct websocket_server *server = conn->server;
+	struct websocket_shared *frames[64], **shared = frames;
+	struct websocket_file *file;
+	struct websocket_frame frame;
+	size_t i, n, k, total = 0, fragsize = server->params.fragsize;
+	ssize_t err = 0;
+
+	if (conn->closing)
+		return WEBSOCKET_DATA_ERROR;
+
+	n = len > 0 ? (len + fragsize - 1) / fragsize : 1;
+
+	if (n > sizeof frames / sizeof *frames && (shared = malloc(n * sizeof *shared)) == NULL)
+		return WEBSOCKET_NO_BUFFER_SPACE;
+
+	memset(&frame, 0, sizeof frame);
+
+	for (i = 0; i < n; ++i, off += k) {
+		k = len - i * fragsize < fragsize ? len - i * fragsize : fragsize;
+
+		if ((shared[i] = malloc(offsetof(struct websocket_shared, data) + WEBSOCKET_FRAMEMAX)) == NULL)
+			break;
+
+		frame.header[0] = (i == 0 ? op & WEBSOCKET_OPCODE : WEBSOCKET_CONTINUATION) | (i + 1 == n ? WEBSOCKET_FIN : 0);
+		frame.length = k;
+
+		shared[i]->refs = 1;
+		shared[i]->head = websocket_writeframe_server(shared[i]->data, &frame);
+		_websocket_countout(&frame);
+		shared[i]->len = shared[i]->head + k;
+		shared[i]->off = off;
+		total += shared[i]->len;
+	}
+
+	/* one descriptor of our own, held by every fragment */
+	if (i < n || (file = malloc(sizeof *file)) == NULL)
+		err = WEBSOCKET_NO_BUFFER_SPACE;
+	else if ((file->fd = fcntl(fd, F_DUPFD_CLOEXEC, 0)) < 0)
+		err = WEBSOCKET_IO_ERROR, free(file);
+
+	if (err < 0) {
+		while (i > 0)
+			free(shared[--i]);
+	} else {
+		file->refs = n;
+		for (i = 0; i < n; ++i)
+			shared[i]->file = file;
+
+		/* the last release closes our descriptor */
+		if ((err = pushall(conn, shared, n, total)) < 0)
+			for (i = 0; i < n; ++i)
+				websocket_shared_release(shared[i]);
+	}
+
+	if (shared != frames)
+		free(shared);
+
+	return err < 0 ? err : (ssize_t) total;
+}
+
+size_t websocket_broadcast(
+		struct websocket_server *server, struct websocket_conn *const *conns, size_t count,
+		unsigned char op, const void *src, size_t len) {
+	struct websocket_shared *frames[64], **shared = frames;
+	size_t i, n = 0, nframes;
+	ssize_t total;
+
+	if (count == 0)
+		return 0;
+
+	nframes = nfragments(server, op, len);
+	if (nframes > sizeof frames / sizeof *frames && (shared = malloc(nframes * sizeof *shared)) == NULL)
+		return 0;
+
+	if ((total = fragment(server, op, src, len, shared, nframes)) >= 0) {
+		for (i = 0; i < count; ++i)
+			if (conns[i]->server == server && pushall(conns[i], shared, nframes, total) == 0)
+				++n;
+
+		/* nothing is sent before the next poll, so one add covers every queue */
+		for (i = 0; i < nframes; ++i) {
+			websocket_shared_retain(shared[i], (unsigned) n);
+			websocket_shared_release(shared[i]);
+		}
+	}
+
+	if (shared != frames)
+		free(shared);
+
+	return n;
+}
+
+#if WEBSOCKET_URING
+
+/* io_uring backend, driven through the raw system calls. Each connection keeps one
+   multishot recv armed on a ring of provided buffers, and websocket_update parses
+   straight out of those buffers; only a frame header or handshake cut off at the
+   end of a buffer is carried over into conn->in. Output is written from arenas of
+   registered buffers, one send in flight per connection. */
+
+#define SQENTRIES (4096)
+#define RINGBUFS (4096)
+#define ARENACONNS (64)
+#define MAXARENAS (16384)
+#define NOTFIXED (0xffff)
+
+#define TAG_RECV (0)
+#define TAG_SEND (1)
+#define TAG_SHUTDOWN (2)
+#define TAG_CANCEL (3)
+#define TAG_ACCEPT (4)
+#define TAG_SHARED (5)
+#define TAG_WAKE (6)
+#define TAG_POLLOUT (7)
+#define TAG_MASK (7)
+
+/* conn->armed */
+#define RECV_IDLE (0)
+#define RECV_ARMED (1)
+#define RECV_CANCEL (2)
+#define RECV_EOF (3)
+
+struct websocket_uring {
+	int fd;
+	int fixed;
+	unsigned *sqhead;
+	unsigned *sqtail;
+	unsigned sqmask;
+	unsigned sqlocal;
+	unsigned sqsubmitted;
+	struct io_uring_sqe *sqes;
+	unsigned *cqhead;
+	unsigned *cqtail;
+	unsigned cqmask;
+	struct io_uring_cqe *cqes;
+	void *ring;
+	size_t ringsize;
+	size_t sqesize;
+	struct io_uring_buf_ring *br;
+	unsigned short brtail;
+	unsigned char recycled;
+	unsigned char *bufs;
+	size_t bufsize;
+	int bufnext[RINGBUFS];
+	unsigned buflen[RINGBUFS];
+	unsigned char **arenas;
+	unsigned narenas;
+	void *freeout;
+	void *freemsg;
+	struct websocket_conn **starved;
+	size_t nstarved;
+	size_t starvedcap;
+	size_t ndead;
+};
+
+struct outslot {
+	void *next;
+	unsigned short index;
+};
+
+/* the queued frames of one send, borrowed until it completes */
+struct queuemsg {
+	struct msghdr msg;
+	struct iovec iov[IOVMAX];
+};
+
+static int enter(struct websocket_uring *u, unsigned want, unsigned flags, void *arg, size_t argsize) {
+	int err;
+
+	__atomic_store_n(u->sqtail, u->sqlocal, __ATOMIC_RELEASE);
+
+	if ((err = syscall(__NR_io_uring_enter, u->fd, u->sqlocal - u->sqsubmitted, want, flags, arg, argsize)) < 0)
+		return errno == EINTR || errno == ETIME || errno == EBUSY || errno == EAGAIN ? 0 : -1;
+
+	u->sqsubmitted += err;
+	return 0;
+}
+
+/* wait in microseconds, -1 for no limit */
+static int waitcq(struct websocket_uring *u, unsigned want, long long wait) {
+	struct io_uring_getevents_arg arg;
+	struct __kernel_timespec ts;
+
+	memset(&arg, 0, sizeof arg);
+
+	if (wait >= 0) {
+		ts.tv_sec = wait / 1000000;
+		ts.tv_nsec = wait % 1000000 * 1000;
+		arg.ts = (uintptr_t) &ts;
+	}
+
+	return enter(u, want, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof arg);
+}
+
+/* room for n entries, so linked chains never get split by a submit */
+static struct io_uring_sqe *getsqe(struct websocket_uring *u, unsigned n) {
+	struct io_uring_sqe *sqe;
+
+	while (u->sqlocal + n - __atomic_load_n(u->sqhead, __ATOMIC_ACQUIRE) > u->sqmask + 1)
+		if (enter(u, 0, 0, NULL, 0) < 0)
+			return NULL;
+
+	sqe = &u->sqes[u->sqlocal++ & u->sqmask];
+	memset(sqe, 0, sizeof *sqe);
+	return sqe;
+}
+
+static void recycle(struct websocket_uring *u, int bid) {
+	struct io_uring_buf *buf = &u->br->bufs[u->brtail & (RINGBUFS - 1)];
+
+	buf->addr = (uintptr_t) (u->bufs + (size_t) bid * u->bufsize);
+	buf->len = (unsigned) u->bufsize;
+	buf->bid = (unsigned short) bid;
+
+	__atomic_store_n(&u->br->tail, ++u->brtail, __ATOMIC_RELEASE);
+	u->recycled = 1;
+}
+
+static int arm(struct websocket_uring *u, struct websocket_conn *conn) {
+	struct io_uring_sqe *sqe;
+
+	if ((sqe = getsqe(u, 1)) == NULL)
+		return WEBSOCKET_IO_ERROR;
+
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = conn->fd;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = 0;
+	sqe->user_data = (uintptr_t) conn | TAG_RECV;
+
+	conn->armed = RECV_ARMED;
+	conn->inflight++;
+	return 0;
+}
+
+static void cancel(struct websocket_uring *u, struct websocket_conn *conn) {
+	struct io_uring_sqe *sqe;
+
+	if ((sqe = getsqe(u, 1)) == NULL)
+		return;
+
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->addr = (uintptr_t) conn | TAG_RECV;
+	sqe->user_data = (uintptr_t) conn | TAG_CANCEL;
+
+	conn->armed = RECV_CANCEL;
+	conn->inflight++;
+}
+
+/* Own output and shared frames go out as one linked chain, so they hit the socket
+   in order; the frames in a single sendmsg that points at them where they are.
+   MSG_WAITALL keeps a send going until all of it is out, so a failed link never
+   leaves half a frame behind; the next service resubmits from where it stopped.
+   A closing connection links a write shutdown behind its last send, so the FIN
+   leaves right after the close frame without another trip through the loop.
+   The chain ends at the header of a frame from a file, corked for its payload. */
+static int submit(struct websocket_uring *u, struct websocket_conn *conn) {
+	struct io_uring_sqe *sqe = NULL;
+	struct websocket_shared *shared = NULL;
+	struct queuemsg *q;
+	unsigned i, n = 0, total;
+	size_t off;
+	int fin;
+
+	if (queueready(conn))
+		for (off = conn->qoff; n < conn->qcount && n < IOVMAX; off = 0) {
+			shared = conn->queue[(conn->qhead + n) & (conn->qsize - 1)];
+			if (off >= shared->head || (++n, shared->head < shared->len))
+				break;
+		}
+
+	/* the FIN waits for a chain that takes everything left */
+	fin = conn->closing && n == conn->qcount && (n == 0 || shared->head == shared->len);
+	total = (conn->outoff < conn->outlen) + (n > 0) + fin;
+
+	if (n > 0 && (q = borrow(&u->freemsg, sizeof *q)) == NULL)
+		return WEBSOCKET_NO_BUFFER_SPACE;
+
+	if (conn->outoff < conn->outlen) {
+		if ((sqe = getsqe(u, total)) == NULL)
+			return WEBSOCKET_IO_ERROR;
+
+		if (conn->bufindex != NOTFIXED) {
+			sqe->opcode = IORING_OP_WRITE_FIXED;
+			sqe->buf_index = conn->bufindex;
+		} else {
+			sqe->opcode = IORING_OP_SEND;
+			sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+		}
+
+		sqe->fd = conn->fd;
+		sqe->addr = (uintptr_t) (conn->out + conn->outoff);
+		sqe->len = (unsigned) (conn->outlen - conn->outoff);
+		sqe->user_data = (uintptr_t) conn | TAG_SEND;
+
+		conn->server->nsends++;
+		conn->sending++;
+		conn->inflight++;
+	}
+
+	if (n > 0) {
+		if (sqe != NULL)
+			sqe->flags |= IOSQE_IO_LINK;
+		if ((sqe = getsqe(u, sqe == NULL ? total : 1)) == NULL) {
+			giveback(&u->freemsg, q);
+			return WEBSOCKET_IO_ERROR;
+		}
+
+		for (i = 0, off = conn->qoff; i < n; ++i, off = 0) {
+			shared = conn->queue[(conn->qhead + i) & (conn->qsize - 1)];
+			q->iov[i].iov_base = shared->data + off;
+			q->iov[i].iov_len = shared->head - off;
+		}
+
+		memset(&q->msg, 0, sizeof q->msg);
+		q->msg.msg_iov = q->iov;
+		q->msg.msg_iovlen = n;
+
+		sqe->opcode = IORING_OP_SENDMSG;
+		sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL | (shared->head < shared->len ? MSG_MORE : 0);
+		sqe->fd = conn->fd;
+		sqe->addr = (uintptr_t) &q->msg;
+		sqe->len = 1;
+		sqe->user_data = (uintptr_t) conn | TAG_SHARED;
+
+		conn->qmsg = q;
+		conn->server->nsends++;
+		conn->sending++;
+		conn->inflight++;
+		conn->qsending = (unsigned char) n;
+	}
+
+	if (fin) {
+		if (sqe != NULL)
+			sqe->flags |= IOSQE_IO_LINK;
+		if ((sqe = getsqe(u, sqe == NULL ? total : 1)) == NULL)
+			return WEBSOCKET_IO_ERROR;
+
+		sqe->opcode = IORING_OP_SHUTDOWN;
+		sqe->fd = conn->fd;
+		sqe->len = SHUT_WR;
+		sqe->user_data = (uintptr_t) conn | TAG_SHUTDOWN;
+
+		conn->inflight++;
+	}
+
+	return 0;
+}
+
+static unsigned pollmask(unsigned events) {
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	return events << 16;
+#else
+	return events;
+#endif
+}
+
+/* There is no ring op that moves a file straight to a socket without a pipe per
+   connection, so file payloads go out with sendfile here; a full socket waits
+   for room with a poll that counts as a send. */
+static int pollout(struct websocket_uring *u, struct websocket_conn *conn) {
+	struct io_uring_sqe *sqe;
+
+	if ((sqe = getsqe(u, 1)) == NULL)
+		return WEBSOCKET_IO_ERROR;
+
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = conn->fd;
+	sqe->poll32_events = pollmask(POLLOUT);
+	sqe->user_data = (uintptr_t) conn | TAG_POLLOUT;
+
+	conn->sending++;
+	conn->inflight++;
+	return 0;
+}
+
+static void hold(struct websocket_uring *u, struct websocket_conn *conn, int bid, unsigned len) {
+	u->bufnext[bid] = -1;
+	u->buflen[bid] = len;
+
+	if (conn->held < 0) {
+		conn->held = bid;
+		conn->heldoff = 0;
+	} else
+		u->bufnext[conn->heldtail] = bid;
+
+	conn->heldtail = bid;
+}
+
+static void unhold(struct websocket_uring *u, struct websocket_conn *conn) {
+	int bid = conn->held;
+
+	conn->held = u->bufnext[bid];
+	conn->heldoff = 0;
+	recycle(u, bid);
+}
+
+/* move held bytes behind the carried-over ones */
+static int carry(struct websocket_server *server, struct websocket_conn *conn) {
+	struct websocket_uring *u = server->uring;
+	size_t n;
+
+	if (conn->in == NULL && (conn->in = borrow(&server->freein, server->params.insize)) == NULL)
+		return WEBSOCKET_NO_BUFFER_SPACE;
+
+	if (conn->inoff > 0) {
+		memmove(conn->in, conn->in + conn->inoff, conn->inlen - conn->inoff);
+		conn->inlen -= conn->inoff;
+		conn->inoff = 0;
+	}
+
+	while (conn->held >= 0 && conn->inlen < server->params.insize) {
+		n = u->buflen[conn->held] - conn->heldoff;
+		if (n > server->params.insize - conn->inlen)
+			n = server->params.insize - conn->inlen;
+
+		memcpy(conn->in + conn->inlen, u->bufs + (size_t) conn->held * u->bufsize + conn->heldoff, n);
+		conn->inlen += n;
+
+		if ((conn->heldoff += n) == u->buflen[conn->held])
+			unhold(u, conn);
+	}
+
+	return 0;
+}
+
+static int uring_service(struct websocket_server *server, struct websocket_conn *conn) {
+	struct websocket_uring *u = server->uring;
+	struct websocket_result r;
+	struct websocket_http *http;
+	const unsigned char *src;
+	size_t len;
+	int carried, err;
+
+	/* queued data in flight holds up the parser: answer pings in the meantime */
+	if (conn->sending && conn->qcount > 0 && conn->state.idle && conn->held >= 0) {
+		if (carry(server, conn) < 0)
+			return WEBSOCKET_NO_BUFFER_SPACE;
+		pings(conn);
+	}
+
+	while (!conn->sending) {
+		if (conn->outoff == conn->outlen && filenext(conn)) {
+			if ((err = sendpayload(conn)) == 0)
+				continue;
+			if (err != WEBSOCKET_NO_BUFFER_SPACE || pollout(u, conn) < 0)
+				return WEBSOCKET_IO_ERROR;
+			break;
+		}
+
+		if (conn->outoff < conn->outlen || (conn->qcount > 0 && queueready(conn))) {
+			if (submit(u, conn) < 0)
+				return WEBSOCKET_IO_ERROR;
+			break;
+		}
+
+		conn->outoff = conn->outlen = 0;
+
+		if (conn->closing)
+			return WEBSOCKET_NO_DATA;
+
+		if (stalled(server, conn)) {
+			if (conn->armed == RECV_ARMED)
+				cancel(u, conn);
+			rest(server, conn);
+			return 0;
+		}
+
+		if (conn->inoff == conn->inlen)
+			conn->inoff = conn->inlen = 0;
+
+		if ((carried = conn->inlen > 0) && conn->held >= 0 && carry(server, conn) < 0)
+			return WEBSOCKET_NO_BUFFER_SPACE;
+
+		if (carried) {
+			src = conn->in + conn->inoff;
+			len = conn->inlen - conn->inoff;
+		} else if (conn->held >= 0) {
+			src = u->bufs + (size_t) conn->held * u->bufsize + conn->heldoff;
+			len = u->buflen[conn->held] - conn->heldoff;
+		} else
+			src = u->bufs, len = 0;
+
+		if (needout(server, conn) < 0)
+			return WEBSOCKET_NO_BUFFER_SPACE;
+
+		http = conn->state.http;
+		r = websocket_update(
+			&conn->state, conn->out, server->params.outsize, src, len, server->params.handler, conn);
+
+		if (http != NULL && conn->state.http == NULL) {
+			giveback(&server->freehttp, http);
+			upgraded(server, conn);
+		}
+
+		if (carried)
+			conn->inoff += r.srclen;
+		else if (conn->held >= 0 && (conn->heldoff += r.srclen) == u->buflen[conn->held])
+			unhold(u, conn);
+
+		conn->outlen = r.dstlen;
+
+		if (r.error == 0)
+			conn->closing = 1;
+		else if (r.error == WEBSOCKET_NO_BUFFER_SPACE) {
+			if (r.dstlen == 0)
+				return r.error;
+		} else if (r.error != WEBSOCKET_NO_DATA)
+			return r.error;
+		else if (r.dstlen == 0) {
+			if (!carried && conn->held >= 0) {
+				if (carry(server, conn) < 0)
+					return WEBSOCKET_NO_BUFFER_SPACE;
+				continue;
+			}
+
+			if (conn->held >= 0) {
+				if (conn->inlen - conn->inoff == server->params.insize)
+					return WEBSOCKET_NO_BUFFER_SPACE;
+				continue;
+			}
+
+			/* the message that held up the queue is over */
+			if (conn->qcount > 0 && queueready(conn))
+				continue;
+
+			if (conn->armed == RECV_EOF)
+				return WEBSOCKET_NO_DATA;
+
+			if (conn->armed == RECV_IDLE && arm(u, conn) < 0)
+				return WEBSOCKET_IO_ERROR;
+
+			rest(server, conn);
+			return 0;
+		}
+	}
+
+	/* stalled on output with input to spare: stop receiving until the peer reads */
+	if (conn->held >= 0 && conn->armed == RECV_ARMED)
+		cancel(u, conn);
+
+	if (conn->closing)
+		lingering(server, conn);
+
+	rest(server, conn);
+	return 0;
+}
+
+static void freeconn(struct websocket_server *server, struct websocket_conn *conn) {
+	struct websocket_uring *u = server->uring;
+
+	if (conn->out != NULL)
+		putslot(u, conn);
+
+	u->ndead--;
+	dispose(server, conn);
+}
+
+static void uring_drop(struct websocket_server *server, struct websocket_conn *conn) {
+	struct websocket_uring *u = server->uring;
+
+	conn->closing = 2;
+	u->ndead++;
+
+	while (conn->held >= 0)
+		unhold(u, conn);
+
+	if (conn->armed == RECV_ARMED)
+		cancel(u, conn);
+
+	/* requests in flight hold their own file reference, but queued ones only
+	   name the descriptor: hand them over before the number can be reused */
+	if (u->sqlocal != u->sqsubmitted)
+		enter(u, 0, 0, NULL, 0);
+
+	close(conn->fd);
+	conn->fd = -1;
+
+	if (conn->inflight == 0)
+		freeconn(server, conn);
+}
+
+static int uring_adopt(struct websocket_server *server, struct websocket_conn *conn) {
+	return arm(server->uring, conn);
+}
+
+/* Output slots are only held while there is output, so arenas grow with the
+   number of connections writing at once rather than the number open. */
+static int getslot(struct websocket_server *server, struct websocket_conn *conn) {
+	struct websocket_uring *u = server->uring;
+	struct io_uring_rsrc_update2 update;
+	struct outslot *slot;
+	struct iovec iov;
+	unsigned char *arena, **arenas;
+	size_t i;
+
+	if (u->freeout == NULL) {
+		if (u->narenas == MAXARENAS)
+			return WEBSOCKET_NO_BUFFER_SPACE;
+
+		if ((arenas = realloc(u->arenas, (u->narenas + 1) * sizeof *arenas)) == NULL)
+			return WEBSOCKET_NO_BUFFER_SPACE;
+		u->arenas = arenas;
+
+		if (posix_memalign((void **) &arena, 4096, ARENACONNS * server->params.outsize) != 0)
+			return WEBSOCKET_NO_BUFFER_SPACE;
+
+		iov.iov_base = arena;
+		iov.iov_len = ARENACONNS * server->params.outsize;
+
+		memset(&update, 0, sizeof update);
+		update.offset = u->narenas;
+		update.data = (uintptr_t) &iov;
+		update.nr = 1;
+
+		/* pinning may be refused (RLIMIT_MEMLOCK); plain sends still work */
+		if (u->fixed && syscall(__NR_io_uring_register,
+				u->fd, IORING_REGISTER_BUFFERS_UPDATE, &update, sizeof update) != 1)
+			u->fixed = 0;
+
+		for (i = ARENACONNS; i-- > 0;) {
+			slot = (struct outslot *) (arena + i * server->params.outsize);
+			slot->next = u->freeout;
+			slot->index = u->fixed ? u->narenas : NOTFIXED;
+			u->freeout = slot;
+		}
+
+		u->arenas[u->narenas++] = arena;
+	}
+
+	slot = u->freeout;
+	u->freeout = slot->next;
+
+	conn->out = (unsigned char *) slot;
+	conn->bufindex = slot->index;
+	return 0;
+}
+
+static void putslot(struct websocket_uring *u, struct websocket_conn *conn) {
+	struct outslot *slot = (struct outslot *) conn->out;
+
+	slot->next = u->freeout;
+	slot->index = conn->bufindex;
+	u->freeout = slot;
+}
+
+static void acceptmulti(struct websocket_server *server) {
+	struct io_uring_sqe *sqe;
+
+	if ((sqe = getsqe(server->uring, 1)) == NULL)
+		return;
+
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = server->lfd;
+	sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+	sqe->user_data = TAG_ACCEPT;
+}
+
+/* the mailbox eventfd, polled for as long as the ring lives */
+static void pollwake(struct websocket_server *server) {
+	struct io_uring_sqe *sqe;
+
+	if ((sqe = getsqe(server->uring, 1)) == NULL)
+		return;
+
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = _websocket_mailbox_fd(server->mailbox);
+	sqe->len = IORING_POLL_ADD_MULTI;
+	sqe->poll32_events = pollmask(POLLIN);
+	sqe->user_data = TAG_WAKE;
+}
+
+/* parked until buffers come back; counts as a reference */
+static int starve(struct websocket_uring *u, struct websocket_conn *conn) {
+	struct websocket_conn **starved;
+	size_t cap;
+
+	if (u->nstarved == u->starvedcap) {
+		cap = u->starvedcap ? u->starvedcap * 2 : 64;
+		if ((starved = realloc(u->starved, cap * sizeof *starved)) == NULL)
+			return WEBSOCKET_NO_BUFFER_SPACE;
+		u->starved = starved;
+		u->starvedcap = cap;
+	}
+
+	u->starved[u->nstarved++] = conn;
+	conn->inflight++;
+	return 0;
+}
+
+static void complete(struct websocket_server *server, const struct io_uring_cqe *cqe) {
+	struct websocket_uring *u = server->uring;
+	struct websocket_conn *conn = (struct websocket_conn *) (uintptr_t) (cqe->user_data & ~(uint64_t) TAG_MASK);
+	int tag = cqe->user_data & TAG_MASK, more = (cqe->flags & IORING_CQE_F_MORE) != 0;
+
+	if (tag == TAG_ACCEPT) {
+		if (cqe->res >= 0)
+			accepted(server, cqe->res);
+		if (!more && server->lfd >= 0)
+			acceptmulti(server);
+		return;
+	}
+
+	if (tag == TAG_WAKE) {
+		if (cqe->res >= 0)
+			replies(server);
+		if (!more && cqe->res != -ECANCELED)
+			pollwake(server);
+		return;
+	}
+
+	if (tag == TAG_RECV) {
+		if (cqe->flags & IORING_CQE_F_BUFFER) {
+			if (cqe->res > 0 && conn->closing < 2) {
+				hold(u, conn, cqe->flags >> IORING_CQE_BUFFER_SHIFT, cqe->res);
+				conn->seen = server->wheel.now;
+			}
+			else
+				recycle(u, cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+		}
+
+		if (!more) {
+			conn->inflight--;
+
+			if (cqe->res == -ENOBUFS && conn->closing < 2 && starve(u, conn) == 0)
+				conn->armed = RECV_CANCEL;
+			else if (cqe->res == -ENOBUFS && conn->closing < 2) {
+				/* nowhere to park it: close rather than never read again */
+				conn->armed = RECV_EOF;
+				conn->closing = conn->closing ? conn->closing : 1;
+			} else
+				conn->armed = cqe->res == -ECANCELED ? RECV_IDLE : RECV_EOF;
+		}
+	} else if (tag == TAG_POLLOUT) {
+		conn->inflight--;
+		conn->sending--;
+	} else if (tag == TAG_SEND || tag == TAG_SHARED) {
+		conn->inflight--;
+		conn->sending--;
+
+		if (tag == TAG_SHARED) {
+			giveback(&u->freemsg, conn->qmsg);
+			conn->qmsg = NULL;
+			conn->qsending = 0;
+		}
+
+		if (cqe->res < 0) {
+			/* cancelled links are resubmitted by the next service */
+			if (cqe->res != -ECANCELED) {
+				conn->outoff = conn->outlen;
+				conn->closing = conn->closing ? conn->closing : 1;
+			}
+			/* a closing connection resubmits nothing after a failed link */
+			if (conn->closing)
+				cut(conn, conn->qsending);
+		} else if (tag == TAG_SEND)
+			conn->outoff += cqe->res;
+		else
+			sentframes(conn, cqe->res);
+	} else
+		conn->inflight--;
+
+	if (conn->closing == 2) {
+		if (conn->inflight == 0)
+			freeconn(server, conn);
+	} else
+		enqueue(conn);
+}
+
+static int uring_poll(struct websocket_server *server, long long wait) {
+	struct websocket_uring *u = server->uring;
+	struct websocket_conn *conn;
+	unsigned head, tail, now = 0;
+	size_t i, nstarved;
+	int n = 0;
+
+	head = *u->cqhead;
+	tail = __atomic_load_n(u->cqtail, __ATOMIC_ACQUIRE);
+
+	if (head == tail) {
+		if (waitcq(u, wait != 0, wait) < 0)
+			return WEBSOCKET_IO_ERROR;
+		tail = __atomic_load_n(u->cqtail, __ATOMIC_ACQUIRE);
+	}
+
+	for (; head != tail; ++head, ++n)
+		complete(server, &u->cqes[head & u->cqmask]);
+
+	__atomic_store_n(u->cqhead, head, __ATOMIC_RELEASE);
+
+	if (u->recycled && u->nstarved > 0) {
+		nstarved = u->nstarved;
+		u->nstarved = 0;
+
+		for (i = 0; i < nstarved; ++i) {
+			conn = u->starved[i];
+			conn->inflight--;
+			conn->armed = RECV_IDLE;
+
+			if (conn->closing == 2) {
+				if (conn->inflight == 0)
+					freeconn(server, conn);
+			} else
+				enqueue(conn);
+		}
+	}
+
+	u->recycled = 0;
+
+	expire(server);
+	uncork(server);
+
+	if (server->params.corkus != 0 && server->pending != NULL)
+		now = micros();
+
+	while ((conn = server->pending) != NULL) {
+		server->pending = conn->next;
+		conn->queued = QUEUED_NONE;
+
+		if (!cork(server, conn, now) && uring_service(server, conn) < 0)
+			release(server, conn);
+	}
+
+	/* submit what servicing queued before the next wait */
+	if (u->sqlocal != u->sqsubmitted && enter(u, 0, 0, NULL, 0) < 0)
+		return WEBSOCKET_IO_ERROR;
+
+	return n;
+}
+
+/* multishot recv into provided buffers is the newest feature used; try it once */
+static int selftest(struct websocket_uring *u) {
+	struct io_uring_cqe *cqe;
+	struct io_uring_sqe *sqe;
+	int sv[2], ok = 0, done = 0, tries;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0)
+		return -1;
+
+	if ((sqe = getsqe(u, 1)) == NULL) {
+		close(sv[0]);
+		close(sv[1]);
+		return -1;
+	}
+
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = sv[0];
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->user_data = TAG_RECV;
+
+	if (write(sv[1], "", 1) == 1 && waitcq(u, 1, 1000000) == 0 &&
+			*u->cqhead != __atomic_load_n(u->cqtail, __ATOMIC_ACQUIRE)) {
+		cqe = &u->cqes[*u->cqhead & u->cqmask];
+		ok = cqe->res == 1 && (cqe->flags & IORING_CQE_F_BUFFER) && (cqe->flags & IORING_CQE_F_MORE);
+	}
+
+	/* closing the peer ends the multishot; drain until it does */
+	close(sv[1]);
+
+	for (tries = 0; !done && tries < 100; ++tries) {
+		while (*u->cqhead != __atomic_load_n(u->cqtail, __ATOMIC_ACQUIRE)) {
+			cqe = &u->cqes[*u->cqhead & u->cqmask];
+
+			if (cqe->flags & IORING_CQE_F_BUFFER)
+				recycle(u, cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+			if (!(cqe->flags & IORING_CQE_F_MORE))
+				done = 1;
+
+			__atomic_store_n(u->cqhead, *u->cqhead + 1, __ATOMIC_RELEASE);
+		}
+
+		if (!done && waitcq(u, 1, 10000) < 0)
+			break;
+	}
+
+	close(sv[0]);
+	return ok && done ? 0 : -1;
+}
+
+static void unmap(struct websocket_uring *u) {
+	if (u->fd >= 0)
+		close(u->fd);
+	if (u->ring != NULL && u->ring != MAP_FAILED)
+		munmap(u->ring, u->ringsize);
+	if (u->sqes != NULL && u->sqes != MAP_FAILED)
+		munmap(u->sqes, u->sqesize);
+	if (u->br != NULL && u->br != MAP_FAILED)
+		munmap(u->br, RINGBUFS * sizeof (struct io_uring_buf));
+
+	free(u->bufs);
+	free(u);
+}
+
+static int uring_init(struct websocket_server *server) {
+	struct websocket_uring *u;
+	struct io_uring_params p;
+	struct io_uring_buf_reg reg;
+	struct io_uring_rsrc_register rsrc;
+	unsigned *array, i;
+	unsigned char *ring;
+
+	if ((u = calloc(1, sizeof *u)) == NULL)
+		return -1;
+
+	memset(&p, 0, sizeof p);
+	p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+	p.cq_entries = SQENTRIES * 4;
+
+	/* older kernels reject the task-run flags; retry without them */
+	if ((u->fd = syscall(__NR_io_uring_setup, SQENTRIES, &p)) < 0 && errno == EINVAL) {
+		p.flags = IORING_SETUP_CQSIZE;
+		u->fd = syscall(__NR_io_uring_setup, SQENTRIES, &p);
+	}
+
+	if (u->fd < 0 || (~p.features & (IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | IORING_FEAT_EXT_ARG)))
+		return unmap(u), -1;
+
+	u->ringsize = p.sq_off.array + p.sq_entries * sizeof (unsigned);
+	if (u->ringsize < p.cq_off.cqes + p.cq_entries * sizeof (struct io_uring_cqe))
+		u->ringsize = p.cq_off.cqes + p.cq_entries * sizeof (struct io_uring_cqe);
+	u->sqesize = p.sq_entries * sizeof (struct io_uring_sqe);
+
+	u->ring = mmap(NULL, u->ringsize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+	u->sqes = mmap(NULL, u->sqesize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+
+	if (u->ring == MAP_FAILED || u->sqes == MAP_FAILED)
+		return unmap(u), -1;
+
+	ring = u->ring;
+	u->sqhead = (unsigned *) (ring + p.sq_off.head);
+	u->sqtail = (unsigned *) (ring + p.sq_off.tail);
+	u->sqmask = *(unsigned *) (ring + p.sq_off.ring_mask);
+	u->cqhead = (unsigned *) (ring + p.cq_off.head);
+	u->cqtail = (unsigned *) (ring + p.cq_off.tail);
+	u->cqmask = *(unsigned *) (ring + p.cq_off.ring_mask);
+	u->cqes = (struct io_uring_cqe *) (ring + p.cq_off.cqes);
+	u->sqlocal = u->sqsubmitted = *u->sqtail;
+
+	array = (unsigned *) (ring + p.sq_off.array);
+	for (i = 0; i < p.sq_entries; ++i)
+		array[i] = i;
+
+	/* the provided-buffer ring is shared by every connection */
+	u->bufsize = server->params.insize;
+	u->br = mmap(NULL, RINGBUFS * sizeof (struct io_uring_buf),
+		PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+	if (u->br == MAP_FAILED || (u->bufs = malloc(RINGBUFS * u->bufsize)) == NULL)
+		return unmap(u), -1;
+
+	memset(&reg, 0, sizeof reg);
+	reg.ring_addr = (uintptr_t) u->br;
+	reg.ring_entries = RINGBUFS;
+	reg.bgid = 0;
+
+	if (syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+		return unmap(u), -1;
+
+	for (i = 0; i < RINGBUFS; ++i)
+		recycle(u, i);
+
+	/* sparse table, filled one arena at a time as connections arrive */
+	memset(&rsrc, 0, sizeof rsrc);
+	rsrc.nr = MAXARENAS;
+	rsrc.flags = IORING_RSRC_REGISTER_SPARSE;
+	u->fixed = syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_BUFFERS2, &rsrc, sizeof rsrc) == 0;
+
+	if (selftest(u) < 0)
+		return unmap(u), -1;
+
+	server->uring = u;
+
+	if (server->lfd >= 0)
+		acceptmulti(server);
+	if (server->mailbox != NULL)
+		pollwake(server);
+
+	return 0;
+}
+
+static void uring_release(struct websocket_server *server) {
+	struct websocket_uring *u = server->uring;
+	struct websocket_conn *conn;
+	struct io_uring_sqe *sqe;
+	const struct io_uring_cqe *cqe;
+	unsigned char **arenas;
+	unsigned head, tail, narenas;
+	void *freemsg;
+	int spins;
+
+	server->lfd = -1;
+
+	while (u->nstarved > 0) {
+		conn = u->starved[--u->nstarved];
+		if (--conn->inflight == 0)
+			freeconn(server, conn);
+	}
+
+	/* everything still armed, the accept and the mailbox poll included; no
+	   connection behind it, so the bare tag is its own */
+	if ((sqe = getsqe(u, 1)) != NULL) {
+		sqe->opcode = IORING_OP_ASYNC_CANCEL;
+		sqe->cancel_flags = IORING_ASYNC_CANCEL_ALL | IORING_ASYNC_CANCEL_ANY;
+		sqe->user_data = TAG_CANCEL;
+	}
+
+	/* dropped connections are freed by their last completion */
+	for (spins = 0; u->ndead > 0 && spins < 100; ++spins) {
+		if (waitcq(u, 1, 10000) < 0)
+			break;
+
+		head = *u->cqhead;
+		tail = __atomic_load_n(u->cqtail, __ATOMIC_ACQUIRE);
+
+		for (; head != tail; ++head) {
+			cqe = &u->cqes[head & u->cqmask];
+
+			if (cqe->user_data == TAG_ACCEPT) {
+				if (cqe->res >= 0)
+					close(cqe->res);
+			} else if (cqe->user_data != TAG_CANCEL)
+				complete(server, cqe);
+		}
+
+		__atomic_store_n(u->cqhead, head, __ATOMIC_RELEASE);
+	}
+
+	arenas = u->arenas;
+	narenas = u->narenas;
+	freemsg = u->freemsg;
+	free(u->starved);
+
+	/* the kernel lets go of whatever was left in flight before its memory goes */
+	unmap(u);
+	server->uring = NULL;
+
+	while (narenas > 0)
+		free(arenas[--narenas]);
+
+	free(arenas);
+	drain(&freemsg);
+}
+
+#endif /* WEBSOCKET_URING */
+
+#endif /* __linux__ */
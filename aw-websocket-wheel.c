@@ -0,0 +1,109 @@
+
+/*
+   Copyright (c) 2014-2016 Malte Hildingsson, malte (at) afterwi.se
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+   THE SOFTWARE.
+ */
+#include "aw-websocket.h"
+
+#include <string.h>
+
+/* Level n holds timers due 64^n to 64^(n+1) ticks after the next one to run,
+   in the slot of their expiry at that resolution. Each time the level below
+   wraps, one slot is emptied and its timers are added again, landing a level
+   lower; a timer moves at most three times on its way down. */
+
+#define SLOTS (1 << WEBSOCKET_WHEEL_BITS)
+#define MASK (SLOTS - 1)
+
+void websocket_wheel_init(struct websocket_wheel *wheel, unsigned now) {
+	memset(wheel, 0, sizeof *wheel);
+	wheel->now = now;
+}
+
+void websocket_wheel_add(struct websocket_wheel *wheel, struct websocket_timer *timer, unsigned expires) {
+	struct websocket_timer **slot;
+	unsigned base = wheel->now + 1, delta, level;
+
+	if ((int) (expires - base) < 0)
+		expires = base;
+	if ((delta = expires - base) >= 1u << (WEBSOCKET_WHEEL_BITS * WEBSOCKET_WHEEL_LEVELS))
+		expires = base + (delta = (1u << (WEBSOCKET_WHEEL_BITS * WEBSOCKET_WHEEL_LEVELS)) - 1);
+
+	for (level = 0; delta >= SLOTS; ++level)
+		delta >>= WEBSOCKET_WHEEL_BITS;
+
+	slot = &wheel->slots[level][(expires >> (WEBSOCKET_WHEEL_BITS * level)) & MASK];
+
+	timer->expires = expires;
+	timer->pprev = slot;
+	if ((timer->next = *slot) != NULL)
+		timer->next->pprev = &timer->next;
+	*slot = timer;
+	wheel->count++;
+}
+
+static void cascade(struct websocket_wheel *wheel, unsigned level, unsigned index) {
+	struct websocket_timer *timer, *next;
+
+	timer = wheel->slots[level][index];
+	wheel->slots[level][index] = NULL;
+
+	for (; timer != NULL; timer = next) {
+		next = timer->next;
+		wheel->count--;
+		websocket_wheel_add(wheel, timer, timer->expires);
+	}
+}
+
+struct websocket_timer *websocket_wheel_advance(struct websocket_wheel *wheel, unsigned now) {
+	struct websocket_timer *expired = NULL, *timer, *next;
+	unsigned t, level;
+
+	/* nothing to run: catch up without walking the ticks */
+	if (wheel->count == 0) {
+		wheel->now = now;
+		return NULL;
+	}
+
+	while ((int) (now - wheel->now) > 0) {
+		t = wheel->now + 1;
+
+		for (level = 1; level < WEBSOCKET_WHEEL_LEVELS &&
+				((t >> (WEBSOCKET_WHEEL_BITS * (level - 1))) & MASK) == 0; ++level)
+			cascade(wheel, level, (t >> (WEBSOCKET_WHEEL_BITS * level)) & MASK);
+
+		timer = wheel->slots[0][t & MASK];
+		wheel->slots[0][t & MASK] = NULL;
+		wheel->now = t;
+
+		for (; timer != NULL; timer = next) {
+			next = timer->next;
+			timer->pprev = NULL;
+			timer->next = expired;
+			expired = timer;
+			wheel->count--;
+		}
+
+		if (wheel->count == 0)
+			wheel->now = now;
+	}
+
+	return expired;
+}
@@ -0,0 +1,564 @@
+
+/*
+   Copyright (c) 2014-2016 Malte Hildingsson, malte (at) afterwi.se
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+   THE SOFTWARE.
+ */
+
+#ifndef _nofeatures
+# if __linux__
+#  define _GNU_SOURCE 1
+# endif
+#endif /* _nofeatures */
+
+#include "aw-websocket.h"
+
+#if __linux__
+
+#include <sys/eventfd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Each connection's messages wait in its strand, a queue that is on at most one
+   worker at a time, so they run one by one and in order. Strands with work are
+   scheduled on the workers: one scheduled from a worker goes on that worker's
+   own deque, one scheduled from an i/o thread on the shared queue, and idle
+   workers steal from the others' deques. Replies go back through the server's
+   mailbox, with an eventfd to wake its poll. */
+
+#define DEQUE (1024) /* strands per worker deque, spilling to the shared queue */
+#define GRAB (32) /* strands moved from the shared queue to a deque at once */
+#define BATCH (16) /* messages a strand runs before making way for others */
+
+/* Intrusive queue after Vyukov: any thread pushes with one exchange, one thread
+   at a time pops. Nodes are chained through their first word. */
+struct queue {
+	void *head;
+	void *tail;
+	void *stub;
+};
+
+struct worker {
+	struct websocket_workers *workers;
+	pthread_t thread;
+	unsigned seed;
+	long top;
+	long bottom;
+	struct websocket_strand *deque[DEQUE];
+};
+
+struct websocket_workers {
+	struct queue shared;
+	int grabbing;
+	int stop;
+	unsigned sleepers;
+	sem_t wake;
+	unsigned count;
+	struct worker workers[];
+};
+
+struct reply {
+	void *next;
+	struct websocket_strand *strand;
+	struct websocket_shared *shared;
+	int kind;
+};
+
+struct websocket_strand {
+	void *next; /* on the shared queue */
+	struct queue jobs;
+	struct websocket_mailbox *mailbox;
+	struct websocket_conn *owner; /* i/o thread only, NULL once closed */
+	size_t backlog; /* bytes waiting or running */
+	unsigned refs;
+	int scheduled;
+	int closed;
+	int stalled; /* the owner stopped reading for the backlog */
+	int resuming; /* resume is in the mailbox */
+	struct reply resume;
+};
+
+struct websocket_mailbox {
+	struct queue replies;
+	struct websocket_workers *workers;
+	void (*work)(struct websocket_job *job);
+	size_t lowwater;
+	unsigned long jobs; /* submitted and not yet done */
+	int signalled;
+	int fd;
+};
+
+static __thread struct worker *current;
+
+static void qinit(struct queue *q) {
+	q->stub = NULL;
+	q->head = q->tail = &q->stub;
+}
+
+static void qpush(struct queue *q, void *node) {
+	void *prev;
+
+	__atomic_store_n((void **) node, NULL, __ATOMIC_RELAXED);
+	prev = __atomic_exchange_n(&q->head, node, __ATOMIC_SEQ_CST);
+	__atomic_store_n((void **) prev, node, __ATOMIC_RELEASE);
+}
+
+/* NULL when empty, or when the push of the next node is only halfway */
+static void *qpop(struct queue *q) {
+	void *tail = q->tail, *next = __atomic_load_n((void **) tail, __ATOMIC_ACQUIRE);
+
+	if (tail == &q->stub) {
+		if (next == NULL)
+			return NULL;
+		q->tail = tail = next;
+		next = __atomic_load_n((void **) next, __ATOMIC_ACQUIRE);
+	}
+
+	if (next != NULL) {
+		q->tail = next;
+		return tail;
+	}
+
+	if (tail != __atomic_load_n(&q->head, __ATOMIC_ACQUIRE))
+		return NULL;
+
+	qpush(q, &q->stub);
+
+	if ((next = __atomic_load_n((void **) tail, __ATOMIC_ACQUIRE)) == NULL)
+		return NULL;
+
+	q->tail = next;
+	return tail;
+}
+
+/* the last pop always leaves the stub at the head; safe from any thread */
+static int qempty(struct queue *q) {
+	return __atomic_load_n(&q->head, __ATOMIC_SEQ_CST) == &q->stub;
+}
+
+/* Work-stealing deque after Chase and Lev, with the orderings of Le et al.:
+   the owner puts and takes at the bottom, thieves steal from the top. */
+static int put(struct worker *w, struct websocket_strand *strand) {
+	long b = __atomic_load_n(&w->bottom, __ATOMIC_RELAXED), t = __atomic_load_n(&w->top, __ATOMIC_ACQUIRE);
+
+	if (b - t >= DEQUE)
+		return -1;
+
+	__atomic_store_n(&w->deque[b & (DEQUE - 1)], strand, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	__atomic_store_n(&w->bottom, b + 1, __ATOMIC_RELAXED);
+	return 0;
+}
+
+static struct websocket_strand *take(struct worker *w) {
+	struct websocket_strand *strand = NULL;
+	long b = __atomic_load_n(&w->bottom, __ATOMIC_RELAXED) - 1, t;
+
+	__atomic_store_n(&w->bottom, b, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	t = __atomic_load_n(&w->top, __ATOMIC_RELAXED);
+
+	if (t <= b) {
+		strand = __atomic_load_n(&w->deque[b & (DEQUE - 1)], __ATOMIC_RELAXED);
+		if (t != b)
+			return strand;
+		/* the last one: race the thieves for it */
+		if (!__atomic_compare_exchange_n(&w->top, &t, t + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+			strand = NULL;
+	}
+
+	__atomic_store_n(&w->bottom, b + 1, __ATOMIC_RELAXED);
+	return strand;
+}
+
+static struct websocket_strand *steal(struct worker *w) {
+	struct websocket_strand *strand;
+	long t = __atomic_load_n(&w->top, __ATOMIC_ACQUIRE), b;
+
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	b = __atomic_load_n(&w->bottom, __ATOMIC_ACQUIRE);
+
+	if (t >= b)
+		return NULL;
+
+	strand = __atomic_load_n(&w->deque[t & (DEQUE - 1)], __ATOMIC_RELAXED);
+	if (!__atomic_compare_exchange_n(&w->top, &t, t + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+		return NULL;
+
+	return strand;
+}
+
+static void wake(struct websocket_workers *workers) {
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	if (__atomic_load_n(&workers->sleepers, __ATOMIC_RELAXED) > 0)
+		sem_post(&workers->wake);
+}
+
+/* from a worker onto its own deque, from anywhere else onto the shared queue */
+static void schedule(struct websocket_workers *workers, struct websocket_strand *strand) {
+	if (current == NULL || current->workers != workers || put(current, strand) < 0)
+		qpush(&workers->shared, strand);
+
+	wake(workers);
+}
+
+/* move a run of the shared queue to the deque, where idle workers can steal it */
+static struct websocket_strand *grab(struct worker *self) {
+	struct websocket_workers *workers = self->workers;
+	struct websocket_strand *strand, *next;
+	unsigned n = 0;
+
+	if (qempty(&workers->shared) || __atomic_exchange_n(&workers->grabbing, 1, __ATOMIC_ACQUIRE))
+		return NULL;
+
+	/* only called with the deque empty, so every put fits */
+	if ((strand = qpop(&workers->shared)) != NULL)
+		for (n = 1; n < GRAB && (next = qpop(&workers->shared)) != NULL; ++n)
+			put(self, next);
+
+	__atomic_store_n(&workers->grabbing, 0, __ATOMIC_RELEASE);
+
+	if (n > 1)
+		wake(workers);
+
+	return strand;
+}
+
+static struct websocket_strand *find(struct worker *self) {
+	struct websocket_workers *workers = self->workers;
+	struct websocket_strand *strand;
+	unsigned i, start;
+
+	if ((strand = take(self)) != NULL || (strand = grab(self)) != NULL)
+		return strand;
+
+	self->seed ^= self->seed << 13;
+	self->seed ^= self->seed >> 17;
+	self->seed ^= self->seed << 5;
+
+	for (i = 0, start = self->seed % workers->count; i < workers->count; ++i)
+		if (&workers->workers[(start + i) % workers->count] != self &&
+				(strand = steal(&workers->workers[(start + i) % workers->count])) != NULL)
+			return strand;
+
+	return NULL;
+}
+
+static void retain(struct websocket_strand *strand) {
+	__atomic_add_fetch(&strand->refs, 1, __ATOMIC_RELAXED);
+}
+
+static void release(struct websocket_strand *strand) {
+	if (__atomic_sub_fetch(&strand->refs, 1, __ATOMIC_ACQ_REL) == 0)
+		free(strand);
+}
+
+static void post(struct websocket_strand *strand, struct reply *reply) {
+	struct websocket_mailbox *mailbox = strand->mailbox;
+	uint64_t one = 1;
+	ssize_t n;
+
+	retain(strand);
+	reply->strand = strand;
+	qpush(&mailbox->replies, reply);
+
+	/* one wakeup until the i/o thread has looked */
+	if (!__atomic_exchange_n(&mailbox->signalled, 1, __ATOMIC_ACQ_REL)) {
+		n = write(mailbox->fd, &one, sizeof one);
+		(void) n;
+	}
+}
+
+static size_t cost(const struct websocket_job *job) {
+	return sizeof *job + job->len;
+}
+
+static void finish(struct websocket_job *job) {
+	struct websocket_strand *strand = job->strand;
+	struct websocket_mailbox *mailbox = strand->mailbox;
+
+	if (__atomic_sub_fetch(&strand->backlog, cost(job), __ATOMIC_SEQ_CST) <= mailbox->lowwater &&
+			__atomic_exchange_n(&strand->stalled, 0, __ATOMIC_SEQ_CST) &&
+			!__atomic_exchange_n(&strand->resuming, 1, __ATOMIC_ACQ_REL))
+		post(strand, &strand->resume);
+
+	free(job);
+	release(strand);
+
+	/* last: the mailbox may go once this reaches zero */
+	__atomic_sub_fetch(&mailbox->jobs, 1, __ATOMIC_RELEASE);
+}
+
+static void run(struct worker *self, struct websocket_strand *strand) {
+	struct websocket_job *job;
+	unsigned n;
+
+	for (n = 0; n < BATCH && (job = qpop(&strand->jobs)) != NULL; ++n) {
+		if (!__atomic_load_n(&strand->closed, __ATOMIC_RELAXED))
+			strand->mailbox->work(job);
+		finish(job);
+	}
+
+	/* still scheduled; go to the back so one busy connection cannot hog a worker */
+	if (n == BATCH) {
+		qpush(&self->workers->shared, strand);
+		wake(self->workers);
+		return;
+	}
+
+	__atomic_store_n(&strand->scheduled, 0, __ATOMIC_SEQ_CST);
+
+	/* a message that came in after the last pop would otherwise wait forever */
+	if (!qempty(&strand->jobs) && !__atomic_exchange_n(&strand->scheduled, 1, __ATOMIC_SEQ_CST))
+		schedule(self->workers, strand);
+	else
+		release(strand);
+}
+
+static void *loop(void *arg) {
+	struct worker *self = arg;
+	struct websocket_workers *workers = self->workers;
+	struct websocket_strand *strand;
+
+	current = self;
+
+	for (;;) {
+		if ((strand = find(self)) == NULL) {
+			/* announce the sleep before the last look, so a push either sees it or is seen */
+			__atomic_add_fetch(&workers->sleepers, 1, __ATOMIC_SEQ_CST);
+			if ((strand = find(self)) == NULL && !__atomic_load_n(&workers->stop, __ATOMIC_SEQ_CST))
+				sem_wait(&workers->wake);
+			__atomic_sub_fetch(&workers->sleepers, 1, __ATOMIC_SEQ_CST);
+
+			if (strand == NULL && __atomic_load_n(&workers->stop, __ATOMIC_ACQUIRE))
+				break;
+		}
+
+		if (strand != NULL)
+			run(self, strand);
+	}
+
+	return NULL;
+}
+
+static void stop(struct websocket_workers *workers, unsigned started) {
+	unsigned i;
+
+	__atomic_store_n(&workers->stop, 1, __ATOMIC_SEQ_CST);
+
+	for (i = 0; i < started; ++i)
+		sem_post(&workers->wake);
+	for (i = 0; i < started; ++i)
+		pthread_join(workers->workers[i].thread, NULL);
+
+	sem_destroy(&workers->wake);
+	free(workers);
+}
+
+struct websocket_workers *websocket_workers_create(unsigned nthreads) {
+	struct websocket_workers *workers;
+	long n;
+	unsigned i;
+
+	if (nthreads == 0)
+		nthreads = (n = sysconf(_SC_NPROCESSORS_ONLN)) > 0 ? (unsigned) n : 1;
+
+	if ((workers = calloc(1, sizeof *workers + nthreads * sizeof *workers->workers)) == NULL)
+		return NULL;
+
+	if (sem_init(&workers->wake, 0, 0) < 0)
+		return free(workers), NULL;
+
+	qinit(&workers->shared);
+	workers->count = nthreads;
+
+	for (i = 0; i < nthreads; ++i) {
+		workers->workers[i].workers = workers;
+		workers->workers[i].seed = i + 1;
+	}
+
+	for (i = 0; i < nthreads; ++i)
+		if (pthread_create(&workers->workers[i].thread, NULL, &loop, &workers->workers[i]) != 0)
+			return stop(workers, i), NULL;
+
+	return workers;
+}
+
+void websocket_workers_destroy(struct websocket_workers *workers) {
+	stop(workers, workers->count);
+}
+
+int websocket_job_reply(struct websocket_job *job, unsigned char op, const void *src, size_t len) {
+	struct reply *reply;
+
+	if (__atomic_load_n(&job->strand->closed, __ATOMIC_RELAXED))
+		return WEBSOCKET_DATA_ERROR;
+
+	if ((reply = malloc(sizeof *reply)) == NULL)
+		return WEBSOCKET_NO_BUFFER_SPACE;
+
+	if ((reply->shared = websocket_shared_create(op, src, len)) == NULL)
+		return free(reply), WEBSOCKET_NO_BUFFER_SPACE;
+
+	reply->kind = _WEBSOCKET_REPLY_SEND;
+	post(job->strand, reply);
+	return 0;
+}
+
+int websocket_job_close(struct websocket_job *job) {
+	struct reply *reply;
+
+	if ((reply = malloc(sizeof *reply)) == NULL)
+		return WEBSOCKET_NO_BUFFER_SPACE;
+
+	reply->shared = NULL;
+	reply->kind = _WEBSOCKET_REPLY_CLOSE;
+	post(job->strand, reply);
+	return 0;
+}
+
+struct websocket_mailbox *_websocket_mailbox_create(
+		struct websocket_workers *workers, void (*work)(struct websocket_job *job), size_t lowwater) {
+	struct websocket_mailbox *mailbox;
+
+	if ((mailbox = calloc(1, sizeof *mailbox)) == NULL)
+		return NULL;
+
+	if ((mailbox->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)
+		return free(mailbox), NULL;
+
+	qinit(&mailbox->replies);
+	mailbox->workers = workers;
+	mailbox->work = work;
+	mailbox->lowwater = lowwater;
+	return mailbox;
+}
+
+/* Every strand is closed by now, so queued messages are skipped; only wait
+   for the ones running. */
+void _websocket_mailbox_destroy(struct websocket_mailbox *mailbox) {
+	struct websocket_conn *owner;
+	struct websocket_shared *shared;
+	struct timespec ts = {0, 1000000};
+
+	while (__atomic_load_n(&mailbox->jobs, __ATOMIC_ACQUIRE) > 0)
+		nanosleep(&ts, NULL);
+
+	while (_websocket_mailbox_pop(mailbox, &owner, &shared) != 0)
+		if (shared != NULL)
+			websocket_shared_release(shared);
+
+	close(mailbox->fd);
+	free(mailbox);
+}
+
+int _websocket_mailbox_fd(const struct websocket_mailbox *mailbox) {
+	return mailbox->fd;
+}
+
+int _websocket_mailbox_pop(
+		struct websocket_mailbox *mailbox, struct websocket_conn **owner, struct websocket_shared **shared) {
+	struct websocket_strand *strand;
+	struct reply *reply;
+	uint64_t count;
+	ssize_t n;
+	int kind;
+
+	/* rearm before the last look, so a reply pushed after it signals again */
+	while ((reply = qpop(&mailbox->replies)) == NULL) {
+		if (!__atomic_exchange_n(&mailbox->signalled, 0, __ATOMIC_ACQ_REL))
+			return 0;
+		n = read(mailbox->fd, &count, sizeof count);
+		(void) n;
+	}
+
+	strand = reply->strand;
+	*owner = strand->owner;
+	*shared = reply->shared;
+	kind = reply->kind;
+
+	if (reply == &strand->resume)
+		__atomic_store_n(&strand->resuming, 0, __ATOMIC_RELEASE);
+	else
+		free(reply);
+
+	release(strand);
+	return kind;
+}
+
+struct websocket_strand *_websocket_strand_create(struct websocket_mailbox *mailbox, struct websocket_conn *owner) {
+	struct websocket_strand *strand;
+
+	if ((strand = calloc(1, sizeof *strand)) == NULL)
+		return NULL;
+
+	qinit(&strand->jobs);
+	strand->mailbox = mailbox;
+	strand->owner = owner;
+	strand->refs = 1;
+	strand->resume.kind = _WEBSOCKET_REPLY_RESUME;
+	return strand;
+}
+
+void _websocket_strand_close(struct websocket_strand *strand) {
+	strand->owner = NULL;
+	__atomic_store_n(&strand->closed, 1, __ATOMIC_RELAXED);
+	release(strand);
+}
+
+/* Whether the owner should stop reading. A stall is ended by a resume reply
+   once the backlog is down to lowwater; checking again after the flag is up
+   means either this sees the drop or the worker sees the flag. */
+int _websocket_strand_full(struct websocket_strand *strand, size_t highwater) {
+	if (__atomic_load_n(&strand->backlog, __ATOMIC_SEQ_CST) < highwater)
+		return 0;
+
+	__atomic_store_n(&strand->stalled, 1, __ATOMIC_SEQ_CST);
+
+	if (__atomic_load_n(&strand->backlog, __ATOMIC_SEQ_CST) > strand->mailbox->lowwater)
+		return 1;
+
+	__atomic_store_n(&strand->stalled, 0, __ATOMIC_SEQ_CST);
+	return 0;
+}
+
+void _websocket_strand_submit(struct websocket_strand *strand, struct websocket_job *job) {
+	struct websocket_mailbox *mailbox = strand->mailbox;
+
+	job->strand = strand;
+	retain(strand);
+	__atomic_add_fetch(&strand->backlog, cost(job), __ATOMIC_SEQ_CST);
+	__atomic_add_fetch(&mailbox->jobs, 1, __ATOMIC_RELAXED);
+	qpush(&strand->jobs, job);
+
+	/* the scheduled strand holds a reference of its own */
+	if (!__atomic_exchange_n(&strand->scheduled, 1, __ATOMIC_SEQ_CST)) {
+		retain(strand);
+		schedule(mailbox->workers, strand);
+	}
+}
+
+#endif /* __linux__ */
@@ -21,18 +21,47 @@
    THE SOFTWARE.
  */
 
+#ifndef _nofeatures
+# if __linux__
+#  define _GNU_SOURCE 1
+# endif
+#endif /* _nofeatures */
+
 #include "aw-websocket.h"
 #include "aw-base64.h"
 #include "aw-fiber.h"
 #include "aw-sha1.h"
 
+#if __SSE2__
+# include <emmintrin.h>
+#endif
+#if __GNUC__ && (__x86_64__ || __i386__)
+# include <immintrin.h>
+# define _websocket_x86 1
+#endif
+#if _websocket_x86
+# include <cpuid.h>
+#endif
+#if __ARM_NEON
+# include <arm_neon.h>
+#endif
+#include <stdint.h>
 #include <string.h>
+#if WEBSOCKET_STATS
+# if _WIN32
+#  include <windows.h>
+# else
+#  include <time.h>
+# endif
+#endif
 
 #define WEBSOCKET_GUID "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
 #define WEBSOCKET_VERSION "Sec-WebSocket-Version: "
 #define WEBSOCKET_KEY "Sec-WebSocket-Key: "
 #define WEBSOCKET_PROTOCOL "Sec-WebSocket-Protocol: "
 #define WEBSOCKET_ACCEPT "Sec-WebSocket-Accept: "
+#define WEBSOCKET_EXTENSIONS "Sec-WebSocket-Extensions: "
+#define WEBSOCKET_PERMESSAGE_DEFLATE "permessage-deflate"
 #define WEBSOCKET_REQUEST \
 	"GET HTTP/1.1\r\n" \
 	"Connection: Upgrade\r\n" \
@@ -42,16 +71,122 @@
 	"Connection: Upgrade\r\n" \
 	"Upgrade: websocket\r\n"
 
-ssize_t websocket_readrequest(const void *src, size_t len) {
-	const char *end;
+static ssize_t parseextension(
+	const char *p, const char *end, struct websocket_deflate_params *params);
+
+static const struct {
+	const char *name;
+	size_t len;
+} fieldnames[WEBSOCKET_FIELD_COUNT] = {
+	{"upgrade", 7},
+	{"connection", 10},
+	{"sec-websocket-key", 17},
+	{"sec-websocket-version", 21},
+	{"sec-websocket-protocol", 22},
+	{"sec-websocket-extensions", 24},
+	{"sec-websocket-accept", 20}
+};
+
+static const char *findlf(const char *p, const char *end) {
+#if __SSE2__
+	__m128i lf = _mm_set1_epi8('\n');
+	int m;
+
+	for (; end - p >= 16; p += 16)
+		if ((m = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) p), lf))) != 0)
+			return p + __builtin_ctz(m);
+#endif
+	return memchr(p, '\n', end - p);
+}
 
-	if (strncmp((char *) src, "GET", 3) != 0)
-		return WEBSOCKET_DATA_ERROR;
+static int fieldeq(const char *p, size_t n, const char *name, size_t len) {
+	size_t i;
 
-	if ((end = strnstr((char *) src, "\r\n\r\n", len)) == NULL)
-		return WEBSOCKET_DATA_ERROR;
+	if (n != len)
+		return 0;
+
+	for (i = 0; i < n; ++i)
+		if ((p[i] >= 'A' && p[i] <= 'Z' ? p[i] + ('a' - 'A') : p[i]) != name[i])
+			return 0;
+
+	return 1;
+}
+
+ssize_t websocket_readhttp(struct websocket_http *http, const void *src, size_t len) {
+	const char *base = src, *p, *q, *lf, *end = base + len;
+	struct websocket_field *field;
+	size_t i;
+
+	if (len > 0xffff)
+		end = base + 0xffff;
+
+	for (p = base + http->offset; (lf = findlf(p, end)) != NULL; p = lf + 1) {
+		q = lf - (lf > p && lf[-1] == '\r');
+
+		if (http->offset == 0 && http->linelen == 0) {
+			if (q == p)
+				return WEBSOCKET_DATA_ERROR;
+			http->linelen = (unsigned short) (q - p);
+		} else if (q == p) {
+			http->offset = (unsigned short) (lf + 1 - base);
+			return lf + 1 - base;
+		} else {
+			if (http->count == WEBSOCKET_MAXFIELDS)
+				return WEBSOCKET_DATA_ERROR;
+
+			field = &http->fields[http->count];
+			field->name = (unsigned short) (p - base);
+
+			while (p < q && *p != ':')
+				++p;
+			if (p == q)
+				return WEBSOCKET_DATA_ERROR;
+
+			field->namelen = (unsigned short) (p - base - field->name);
+
+			for (++p; p < q && (*p == ' ' || *p == '\t'); ++p)
+				;
+			while (q > p && (q[-1] == ' ' || q[-1] == '\t'))
+				--q;
+
+			field->value = (unsigned short) (p - base);
+			field->valuelen = (unsigned short) (q - p);
+
+			for (i = 0; i < WEBSOCKET_FIELD_COUNT; ++i)
+				if (http->known[i] == 0 &&
+						fieldeq(base + field->name, field->namelen, fieldnames[i].name, fieldnames[i].len)) {
+					http->known[i] = http->count + 1;
+					break;
+				}
+
+			++http->count;
+		}
+
+		http->offset = (unsigned short) (lf + 1 - base);
+	}
+
+	return end < base + len ? WEBSOCKET_DATA_ERROR : WEBSOCKET_NO_DATA;
+}
+
+static const char *fieldvalue(
+		const struct websocket_http *http, const void *src, int field, size_t *len) {
+	const struct websocket_field *f;
+
+	if (http->known[field] == 0)
+		return NULL;
+
+	f = &http->fields[http->known[field] - 1];
+	*len = f->valuelen;
+	return (const char *) src + f->value;
+}
+
+ssize_t websocket_readrequest(const void *src, size_t len) {
+	struct websocket_http http = {0};
+
+	if (len < 3 || strncmp((char *) src, "GET", 3) != 0)
+		return len < 3 ? WEBSOCKET_NO_DATA : WEBSOCKET_DATA_ERROR;
 
-	return (end + 4) - (char *) src;
+	return websocket_readhttp(&http, src, len);
 }
 
 ssize_t websocket_writerequest(
@@ -126,61 +261,101 @@ static ssize_t acceptnonce(
 	return acceptkey(h, buf, off, size, (char *) buf + off, base64len(WEBSOCKET_NONCESIZE));
 }
 
-ssize_t websocket_readresponse(
-		const void *src, size_t len, const unsigned char nonce[static WEBSOCKET_NONCESIZE]) {
+/* check a parsed response accepts the key sent as nonce */
+static ssize_t checkresponse(
+		const struct websocket_http *http, const void *src,
+		const unsigned char nonce[static WEBSOCKET_NONCESIZE]) {
 	ssize_t off;
-	const char *end = (const char *) src + len, *rp, *ep;
+	const char *rp;
 	unsigned char h[SHA1_SIZE];
 	char buf[64];
+	size_t n;
 
-	if ((rp = strnstr((char *) src, WEBSOCKET_ACCEPT, end - (char *) src)) == NULL ||
-			(ep = strnstr(rp, "\r\n", end - rp)) == NULL)
+	/* nothing but a switch of protocols upgrades, whatever the fields say */
+	if (http->linelen < 12 || memcmp(src, "HTTP/1.1 101", 12) != 0 ||
+			(http->linelen > 12 && ((const char *) src)[12] != ' '))
+		return WEBSOCKET_DATA_ERROR;
+
+	if ((rp = fieldvalue(http, src, WEBSOCKET_FIELD_ACCEPT, &n)) == NULL)
 		return WEBSOCKET_DATA_ERROR;
 
 	if ((off = acceptnonce(h, buf, 0, sizeof buf, nonce)) < 0)
 		return off;
 
-	if ((end = strnstr((char *) src, "\r\n\r\n", len)) == NULL)
+	if (n != base64len(sizeof h))
 		return WEBSOCKET_DATA_ERROR;
 
-	return (end + 4) - (char *) src;
+	base64(buf, sizeof buf, h, sizeof h);
+
+	if (memcmp(buf, rp, n) != 0)
+		return WEBSOCKET_DATA_ERROR;
+
+	return 0;
 }
 
-ssize_t websocket_writeresponse(void *dst, size_t size, const void *src, size_t len) {
+ssize_t websocket_readresponse(
+		const void *src, size_t len, const unsigned char nonce[static WEBSOCKET_NONCESIZE]) {
+	struct websocket_http http = {0};
+	ssize_t err;
+
+	if ((err = websocket_readhttp(&http, src, len)) < 0)
+		return err;
+
+	if (checkresponse(&http, src, nonce) < 0)
+		return WEBSOCKET_DATA_ERROR;
+
+	return err;
+}
+
+/* accept is a precomputed digest of the key, or NULL to hash it here */
+static ssize_t writeresponse(
+		void *dst, size_t size, const void *src, const struct websocket_http *http,
+		struct websocket_deflate *deflate, const unsigned char *accept) {
 	ssize_t off = 0;
-	const char *end = (const char *) src + len, *rp, *ep;
+	const char *rp;
+	struct websocket_deflate_params offer;
 	unsigned char h[SHA1_SIZE];
+	size_t n;
 
-	if ((rp = strnstr((char *) src, WEBSOCKET_VERSION, end - (char *) src)) == NULL ||
-			strncmp(rp + sizeof WEBSOCKET_VERSION - 1, "13\r\n", 4) != 0)
+	if ((rp = fieldvalue(http, src, WEBSOCKET_FIELD_VERSION, &n)) == NULL ||
+			n != 2 || strncmp(rp, "13", 2) != 0)
 		return WEBSOCKET_UNSUPPORTED_VERSION;
 
 	if ((off = websocket_writedata(dst, off, size, WEBSOCKET_RESPONSE, sizeof WEBSOCKET_RESPONSE - 1)) < 0)
 		return off;
 
-	if ((rp = strnstr((char *) src, WEBSOCKET_PROTOCOL, end - (char *) src)) != NULL) {
-		rp += sizeof WEBSOCKET_PROTOCOL - 1;
-
-		if ((ep = strnstr(rp, "\r\n", end - rp)) == NULL)
-			return WEBSOCKET_DATA_ERROR;
-
+	if ((rp = fieldvalue(http, src, WEBSOCKET_FIELD_PROTOCOL, &n)) != NULL) {
 		if ((off = websocket_writedata(dst, off, size, WEBSOCKET_PROTOCOL, sizeof WEBSOCKET_PROTOCOL - 1)) < 0)
 			return off;
 
-		if ((off = websocket_writedata(dst, off, size, rp, ep - rp)) < 0)
+		if ((off = websocket_writedata(dst, off, size, rp, n)) < 0)
 			return off;
 
 		if ((off = websocket_writedata(dst, off, size, "\r\n", 2)) < 0)
 			return off;
 	}
 
-	if ((rp = strnstr((char *) src, WEBSOCKET_KEY, end - (char *) src)) == NULL ||
-			(ep = strnstr(rp, "\r\n", end - rp)) == NULL)
-		return WEBSOCKET_DATA_ERROR;
+	if (deflate != NULL) {
+		deflate->enabled =
+			(rp = fieldvalue(http, src, WEBSOCKET_FIELD_EXTENSIONS, &n)) != NULL &&
+			parseextension(rp, rp + n, &offer) == 0 &&
+			websocket_deflate_negotiate(&offer, &deflate->prefs, &deflate->params) == 0;
+
+		if (deflate->enabled) {
+			if ((off = websocket_writeextension(dst, off, size, &deflate->params)) < 0)
+				return off;
+
+			if ((off = websocket_writedata(dst, off, size, "\r\n", 2)) < 0)
+				return off;
+		}
+	}
 
-	rp += sizeof WEBSOCKET_KEY - 1;
+	if ((rp = fieldvalue(http, src, WEBSOCKET_FIELD_KEY, &n)) == NULL)
+		return WEBSOCKET_DATA_ERROR;
 
-	if ((off = acceptkey(h, dst, off, size, rp, ep - rp)) < 0)
+	if (accept != NULL)
+		memcpy(h, accept, sizeof h);
+	else if ((off = acceptkey(h, dst, off, size, rp, n)) < 0)
 		return off;
 
 	if ((off = websocket_writedata(dst, off, size, WEBSOCKET_ACCEPT, sizeof WEBSOCKET_ACCEPT - 1)) < 0)
@@ -197,6 +372,583 @@ ssize_t websocket_writeresponse(void *dst, size_t size, const void *src, size_t
 	return off;
 }
 
+ssize_t websocket_writeresponse(void *dst, size_t size, const void *src, size_t len) {
+	struct websocket_http http = {0};
+	ssize_t err;
+
+	if ((err = websocket_readhttp(&http, src, len)) < 0)
+		return err;
+
+	return writeresponse(dst, size, src, &http, NULL, NULL);
+}
+
+/* Keys are 24 base64 characters (RFC 6455 4.1), so key plus guid is 60 bytes and
+   hashes as two blocks: the first differs only in words 0..5, the second is all padding. */
+
+#define KEYSIZE (24)
+#define HASHLANES (4)
+
+enum {
+	HASH_SCALAR,
+	HASH_SSE2,
+	HASH_SHANI
+};
+
+/* Kernels in effect, resolved on first use and read on every call from any
+   thread; websocket_kernel stores the hash kernel before the mask kernel. */
+#if __GNUC__
+# define loadkernel(p) __atomic_load_n(p, __ATOMIC_ACQUIRE)
+# define storekernel(p, k) __atomic_store_n(p, k, __ATOMIC_RELEASE)
+#elif _MSC_VER
+# define loadkernel(p) (*(volatile int *) (p))
+# define storekernel(p, k) (*(volatile int *) (p) = (k))
+#endif
+
+static int hashkernel = -1;
+
+static int hashing(void) {
+	int kernel;
+
+	if ((kernel = loadkernel(&hashkernel)) < 0) {
+		websocket_kernel(WEBSOCKET_KERNEL_AUTO);
+		kernel = loadkernel(&hashkernel);
+	}
+
+	return kernel;
+}
+
+static const uint32_t sha1init[5] = {
+	0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0
+};
+
+static void sha1block(unsigned char block[64], const char *key) {
+	memcpy(block, key, KEYSIZE);
+	memcpy(block + KEYSIZE, WEBSOCKET_GUID, sizeof WEBSOCKET_GUID - 1);
+	memset(block + 60, 0, 4);
+	block[60] = 0x80;
+}
+
+static void sha1digest(unsigned char h[SHA1_SIZE], const uint32_t s[5]) {
+	int i;
+
+	for (i = 0; i < 5; ++i) {
+		h[i * 4 + 0] = (unsigned char) (s[i] >> 24);
+		h[i * 4 + 1] = (unsigned char) (s[i] >> 16);
+		h[i * 4 + 2] = (unsigned char) (s[i] >> 8);
+		h[i * 4 + 3] = (unsigned char) s[i];
+	}
+}
+
+static uint32_t load32be(const unsigned char *p) {
+	return (uint32_t) p[0] << 24 | (uint32_t) p[1] << 16 | (uint32_t) p[2] << 8 | p[3];
+}
+
+#if __SSE2__
+# define rol4(x, n) _mm_or_si128(_mm_slli_epi32(x, n), _mm_srli_epi32(x, 32 - (n)))
+
+static void sha1x4(__m128i s[5], const __m128i in[16]) {
+	__m128i w[16], a = s[0], b = s[1], c = s[2], d = s[3], e = s[4], f, k, t;
+	int i;
+
+	for (i = 0; i < 80; ++i) {
+		if (i < 16)
+			w[i] = in[i];
+		else
+			w[i & 15] = rol4(_mm_xor_si128(
+				_mm_xor_si128(w[(i - 3) & 15], w[(i - 8) & 15]),
+				_mm_xor_si128(w[(i - 14) & 15], w[i & 15])), 1);
+
+		if (i < 20) {
+			f = _mm_or_si128(_mm_and_si128(b, c), _mm_andnot_si128(b, d));
+			k = _mm_set1_epi32(0x5a827999);
+		} else if (i < 40) {
+			f = _mm_xor_si128(_mm_xor_si128(b, c), d);
+			k = _mm_set1_epi32(0x6ed9eba1);
+		} else if (i < 60) {
+			f = _mm_or_si128(_mm_and_si128(b, c), _mm_and_si128(d, _mm_or_si128(b, c)));
+			k = _mm_set1_epi32((int) 0x8f1bbcdc);
+		} else {
+			f = _mm_xor_si128(_mm_xor_si128(b, c), d);
+			k = _mm_set1_epi32((int) 0xca62c1d6);
+		}
+
+		t = _mm_add_epi32(_mm_add_epi32(rol4(a, 5), f), _mm_add_epi32(_mm_add_epi32(e, k), w[i & 15]));
+		e = d;
+		d = c;
+		c = rol4(b, 30);
+		b = a;
+		a = t;
+	}
+
+	s[0] = _mm_add_epi32(s[0], a);
+	s[1] = _mm_add_epi32(s[1], b);
+	s[2] = _mm_add_epi32(s[2], c);
+	s[3] = _mm_add_epi32(s[3], d);
+	s[4] = _mm_add_epi32(s[4], e);
+}
+
+static void hashsse2(unsigned char (*h)[SHA1_SIZE], const char *const *keys, size_t n) {
+	unsigned char block[HASHLANES][64];
+	uint32_t lanes[5][HASHLANES];
+	__m128i s[5], w[16];
+	size_t i, j;
+	int k;
+
+	for (i = 0; i < n; i += HASHLANES) {
+		for (j = 0; j < HASHLANES; ++j)
+			sha1block(block[j], keys[i + j < n ? i + j : i]);
+
+		for (k = 0; k < 16; ++k)
+			w[k] = _mm_set_epi32(
+				(int) load32be(block[3] + k * 4), (int) load32be(block[2] + k * 4),
+				(int) load32be(block[1] + k * 4), (int) load32be(block[0] + k * 4));
+
+		for (k = 0; k < 5; ++k)
+			s[k] = _mm_set1_epi32((int) sha1init[k]);
+
+		sha1x4(s, w);
+
+		for (k = 0; k < 15; ++k)
+			w[k] = _mm_setzero_si128();
+		w[15] = _mm_set1_epi32(60 * 8);
+
+		sha1x4(s, w);
+
+		for (k = 0; k < 5; ++k)
+			_mm_storeu_si128((__m128i *) lanes[k], s[k]);
+
+		for (j = 0; j < HASHLANES && i + j < n; ++j) {
+			uint32_t d[5] = {lanes[0][j], lanes[1][j], lanes[2][j], lanes[3][j], lanes[4][j]};
+			sha1digest(h[i + j], d);
+		}
+	}
+}
+#endif
+
+#if _websocket_x86
+__attribute__((target("sha,ssse3,sse4.1")))
+static void sha1ni(uint32_t state[5], const unsigned char *p, size_t nblocks) {
+	const __m128i shuf = _mm_set_epi64x(0x0001020304050607ll, 0x08090a0b0c0d0e0fll);
+	__m128i abcd, abcd0, e0, e0save, e1, m0, m1, m2, m3;
+
+	abcd = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *) state), 0x1b);
+	e0 = _mm_set_epi32((int) state[4], 0, 0, 0);
+
+# define rounds4(ea, eb, ma, f) \
+	ea = _mm_sha1nexte_epu32(ea, ma); \
+	eb = abcd; \
+	abcd = _mm_sha1rnds4_epu32(abcd, ea, f)
+# define schedule(ma, mb, mc, md) \
+	mb = _mm_sha1msg2_epu32(mb, ma); \
+	md = _mm_sha1msg1_epu32(md, ma); \
+	mc = _mm_xor_si128(mc, ma)
+
+	for (; nblocks > 0; --nblocks, p += 64) {
+		abcd0 = abcd;
+		e0save = e0;
+
+		m0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (p + 0)), shuf);
+		m1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (p + 16)), shuf);
+		m2 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (p + 32)), shuf);
+		m3 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (p + 48)), shuf);
+
+		e0 = _mm_add_epi32(e0, m0);
+		e1 = abcd;
+		abcd = _mm_sha1rnds4_epu32(abcd, e0, 0);
+
+		rounds4(e1, e0, m1, 0);
+		m0 = _mm_sha1msg1_epu32(m0, m1);
+		rounds4(e0, e1, m2, 0);
+		m1 = _mm_sha1msg1_epu32(m1, m2);
+		m0 = _mm_xor_si128(m0, m2);
+		rounds4(e1, e0, m3, 0); schedule(m3, m0, m1, m2);
+		rounds4(e0, e1, m0, 0); schedule(m0, m1, m2, m3);
+		rounds4(e1, e0, m1, 1); schedule(m1, m2, m3, m0);
+		rounds4(e0, e1, m2, 1); schedule(m2, m3, m0, m1);
+		rounds4(e1, e0, m3, 1); schedule(m3, m0, m1, m2);
+		rounds4(e0, e1, m0, 1); schedule(m0, m1, m2, m3);
+		rounds4(e1, e0, m1, 1); schedule(m1, m2, m3, m0);
+		rounds4(e0, e1, m2, 2); schedule(m2, m3, m0, m1);
+		rounds4(e1, e0, m3, 2); schedule(m3, m0, m1, m2);
+		rounds4(e0, e1, m0, 2); schedule(m0, m1, m2, m3);
+		rounds4(e1, e0, m1, 2); schedule(m1, m2, m3, m0);
+		rounds4(e0, e1, m2, 2); schedule(m2, m3, m0, m1);
+		rounds4(e1, e0, m3, 3); schedule(m3, m0, m1, m2);
+		rounds4(e0, e1, m0, 3); schedule(m0, m1, m2, m3);
+		rounds4(e1, e0, m1, 3);
+		m2 = _mm_sha1msg2_epu32(m2, m1);
+		m3 = _mm_xor_si128(m3, m1);
+		rounds4(e0, e1, m2, 3);
+		m3 = _mm_sha1msg2_epu32(m3, m2);
+		rounds4(e1, e0, m3, 3);
+
+		e0 = _mm_sha1nexte_epu32(e0, e0save);
+		abcd = _mm_add_epi32(abcd, abcd0);
+	}
+
+# undef rounds4
+# undef schedule
+
+	_mm_storeu_si128((__m128i *) state, _mm_shuffle_epi32(abcd, 0x1b));
+	state[4] = (uint32_t) _mm_extract_epi32(e0, 3);
+}
+
+static void hashshani(unsigned char (*h)[SHA1_SIZE], const char *const *keys, size_t n) {
+	unsigned char block[128] = {0};
+	uint32_t s[5];
+	size_t i;
+
+	block[126] = (60 * 8) >> 8;
+	block[127] = (60 * 8) & 0xff;
+
+	for (i = 0; i < n; ++i) {
+		sha1block(block, keys[i]);
+		memcpy(s, sha1init, sizeof s);
+		sha1ni(s, block, 2);
+		sha1digest(h[i], s);
+	}
+}
+
+static int hasshani(void) {
+	unsigned a, b, c, d;
+
+	return __get_cpuid_count(7, 0, &a, &b, &c, &d) && (b >> 29 & 1) != 0;
+}
+#endif
+
+static void hashkeys(unsigned char (*h)[SHA1_SIZE], const char *const *keys, size_t n) {
+	unsigned char block[64];
+	size_t i;
+
+	switch (hashing()) {
+#if _websocket_x86
+	case HASH_SHANI:
+		hashshani(h, keys, n);
+		break;
+#endif
+#if __SSE2__
+	case HASH_SSE2:
+		hashsse2(h, keys, n);
+		break;
+#endif
+	default:
+		for (i = 0; i < n; ++i) {
+			sha1block(block, keys[i]);
+			sha1(h[i], block, 60);
+		}
+	}
+}
+
+size_t websocket_writeresponses(struct websocket_upgrade *upgrades, size_t count) {
+	struct websocket_http http[HASHLANES];
+	unsigned char h[HASHLANES][SHA1_SIZE];
+	const char *keys[HASHLANES], *key;
+	struct websocket_upgrade *up;
+	size_t i, j, n, done = 0, len;
+	int hashed[HASHLANES];
+
+	for (i = 0; i < count; i += HASHLANES) {
+		for (n = 0, j = 0; j < HASHLANES && i + j < count; ++j) {
+			up = &upgrades[i + j];
+			http[j] = (struct websocket_http) {0};
+			hashed[j] = -1;
+
+			if ((up->result = websocket_readhttp(&http[j], up->src, up->len)) < 0)
+				continue;
+
+			/* odd-sized keys take the single request path below */
+			if ((key = fieldvalue(&http[j], up->src, WEBSOCKET_FIELD_KEY, &len)) != NULL && len == KEYSIZE)
+				hashed[j] = (int) n, keys[n++] = key;
+		}
+
+		hashkeys(h, keys, n);
+
+		for (j = 0; j < HASHLANES && i + j < count; ++j) {
+			up = &upgrades[i + j];
+
+			if (up->result < 0)
+				continue;
+
+			up->result = writeresponse(
+				up->dst, up->size, up->src, &http[j], NULL, hashed[j] >= 0 ? h[hashed[j]] : NULL);
+			done += up->result >= 0;
+		}
+	}
+
+	return done;
+}
+
+static ssize_t writeparam(void *dst, ssize_t off, size_t size, const char *name, unsigned bits) {
+	char num[3];
+
+	if ((off = websocket_writedata(dst, off, size, "; ", 2)) < 0)
+		return off;
+
+	if ((off = websocket_writedata(dst, off, size, name, strlen(name))) < 0)
+		return off;
+
+	if (bits == 0)
+		return off;
+
+	num[0] = '=';
+	num[1] = bits < 10 ? '0' + bits : '1';
+	num[2] = '0' + bits % 10;
+
+	return websocket_writedata(dst, off, size, num, bits < 10 ? 2 : 3);
+}
+
+ssize_t websocket_writeextension(
+		void *dst, size_t off, size_t size, const struct websocket_deflate_params *params) {
+	ssize_t err = off;
+
+	if ((err = websocket_writedata(dst, err, size, WEBSOCKET_EXTENSIONS, sizeof WEBSOCKET_EXTENSIONS - 1)) < 0)
+		return err;
+
+	if ((err = websocket_writedata(
+			dst, err, size, WEBSOCKET_PERMESSAGE_DEFLATE, sizeof WEBSOCKET_PERMESSAGE_DEFLATE - 1)) < 0)
+		return err;
+
+	if (params->server_no_context_takeover)
+		if ((err = writeparam(dst, err, size, "server_no_context_takeover", 0)) < 0)
+			return err;
+
+	if (params->client_no_context_takeover)
+		if ((err = writeparam(dst, err, size, "client_no_context_takeover", 0)) < 0)
+			return err;
+
+	if (params->server_max_window_bits)
+		if ((err = writeparam(dst, err, size, "server_max_window_bits", params->server_max_window_bits)) < 0)
+			return err;
+
+	if (params->client_max_window_bits)
+		if ((err = writeparam(dst, err, size, "client_max_window_bits", params->client_max_window_bits)) < 0)
+			return err;
+
+	return err;
+}
+
+static const char *skipspace(const char *p, const char *end) {
+	while (p < end && (*p == ' ' || *p == '\t'))
+		++p;
+
+	return p;
+}
+
+static int matchtoken(const char *p, const char *end, const char *token) {
+	size_t n = strlen(token);
+	return (size_t) (end - p) >= n && strncmp(p, token, n) == 0 &&
+		(p + n == end || p[n] == ' ' || p[n] == '\t' || p[n] == ';' || p[n] == ',' || p[n] == '=');
+}
+
+static int parsebits(const char *p, const char *end, unsigned char *bits) {
+	unsigned n = 0;
+
+	p = skipspace(p, end);
+
+	if (p == end || *p != '=')
+		return *bits = 15, 0;
+
+	p = skipspace(p + 1, end);
+	p += p < end && *p == '"';
+
+	while (p < end && *p >= '0' && *p <= '9')
+		n = n * 10 + (*p++ - '0');
+
+	if (n < 8 || n > 15)
+		return -1;
+
+	return *bits = (unsigned char) n, 0;
+}
+
+/* Parse one comma separated offer; returns the end of it or NULL if unusable. */
+static const char *parseoffer(
+		const char *p, const char *end, struct websocket_deflate_params *params) {
+	const char *q;
+	int ok;
+
+	memset(params, 0, sizeof *params);
+	p = skipspace(p, end);
+	ok = matchtoken(p, end, WEBSOCKET_PERMESSAGE_DEFLATE);
+
+	for (q = p; q < end && *q != ';' && *q != ','; ++q)
+		;
+
+	while (q < end && *q == ';') {
+		p = skipspace(q + 1, end);
+
+		if (matchtoken(p, end, "server_no_context_takeover"))
+			params->server_no_context_takeover = 1;
+		else if (matchtoken(p, end, "client_no_context_takeover"))
+			params->client_no_context_takeover = 1;
+		else if (matchtoken(p, end, "server_max_window_bits"))
+			ok &= parsebits(p + sizeof "server_max_window_bits" - 1, end, &params->server_max_window_bits) == 0;
+		else if (matchtoken(p, end, "client_max_window_bits"))
+			ok &= parsebits(p + sizeof "client_max_window_bits" - 1, end, &params->client_max_window_bits) == 0;
+		else
+			ok = 0;
+
+		for (q = p; q < end && *q != ';' && *q != ','; ++q)
+			;
+	}
+
+	return ok ? q : NULL;
+}
+
+static ssize_t parseextension(
+		const char *p, const char *end, struct websocket_deflate_params *params) {
+	const char *q;
+
+	for (; p < end; p = q + 1) {
+		if (parseoffer(p, end, params) != NULL)
+			return 0;
+
+		if ((q = memchr(p, ',', end - p)) == NULL)
+			break;
+	}
+
+	return WEBSOCKET_DATA_ERROR;
+}
+
+ssize_t websocket_readextension(
+		const void *src, size_t len, struct websocket_deflate_params *params) {
+	struct websocket_http http = {0};
+	const char *rp;
+	ssize_t err;
+	size_t n;
+
+	if ((err = websocket_readhttp(&http, src, len)) < 0)
+		return err;
+
+	if ((rp = fieldvalue(&http, src, WEBSOCKET_FIELD_EXTENSIONS, &n)) == NULL)
+		return WEBSOCKET_DATA_ERROR;
+
+	return parseextension(rp, rp + n, params);
+}
+
+ssize_t websocket_deflate_negotiate(
+		const struct websocket_deflate_params *offer, const struct websocket_deflate_params *prefs,
+		struct websocket_deflate_params *params) {
+	unsigned bits = prefs->server_max_window_bits ? prefs->server_max_window_bits : 15;
+
+	if (offer->server_max_window_bits && offer->server_max_window_bits < bits)
+		bits = offer->server_max_window_bits;
+
+	/* zlib cannot produce raw deflate with a 256 byte window */
+	if (bits < 9)
+		return WEBSOCKET_DATA_ERROR;
+
+	params->server_no_context_takeover =
+		offer->server_no_context_takeover | prefs->server_no_context_takeover;
+	params->client_no_context_takeover =
+		offer->client_no_context_takeover | prefs->client_no_context_takeover;
+	params->server_max_window_bits =
+		bits < 15 || offer->server_max_window_bits ? (unsigned char) bits : 0;
+	params->client_max_window_bits =
+		offer->client_max_window_bits && prefs->client_max_window_bits &&
+		prefs->client_max_window_bits < offer->client_max_window_bits ?
+			prefs->client_max_window_bits : 0;
+
+	return 0;
+}
+
+#if WEBSOCKET_STATS
+# if _MSC_VER
+#  define _websocket_threadlocal __declspec(thread)
+# else
+#  define _websocket_threadlocal __thread
+# endif
+
+static _websocket_threadlocal struct websocket_stats threadstats;
+
+static unsigned bucket(unsigned long long n) {
+	unsigned b = 0;
+
+	while (n != 0 && b < WEBSOCKET_STATS_BUCKETS - 1)
+		n >>= 1, ++b;
+
+	return b;
+}
+
+static unsigned long long nanotime(void) {
+# if _WIN32
+	LARGE_INTEGER t, f;
+
+	QueryPerformanceCounter(&t);
+	QueryPerformanceFrequency(&f);
+	return (unsigned long long) (t.QuadPart / f.QuadPart * 1000000000 +
+		t.QuadPart % f.QuadPart * 1000000000 / f.QuadPart);
+# else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long) ts.tv_sec * 1000000000 + ts.tv_nsec;
+# endif
+}
+
+static void countframe(struct websocket_stats *stats, const struct websocket_frame *frame) {
+	unsigned op = frame->header[0] & WEBSOCKET_OPCODE;
+
+	stats->framesin[op]++;
+	stats->bytesin[op] += frame->length;
+	stats->framesize[bucket(frame->length)]++;
+
+	if (frame->header[1] & WEBSOCKET_MASK)
+		stats->masked += frame->length;
+}
+
+static void countout(const struct websocket_frame *frame) {
+	threadstats.framesout[frame->header[0] & WEBSOCKET_OPCODE]++;
+	threadstats.bytesout[frame->header[0] & WEBSOCKET_OPCODE] += frame->length;
+
+	if (frame->header[1] & WEBSOCKET_MASK)
+		threadstats.masked += frame->length;
+}
+
+static void countcall(struct websocket_stats *stats, unsigned long long ns) {
+	stats->handlertime[bucket(ns)]++;
+}
+
+static void countresult(struct websocket_stats *stats, int handshake, int upgraded, int error) {
+	stats->yields[-error & 7]++;
+
+	if (upgraded)
+		stats->handshakes++;
+	else if (handshake && error != WEBSOCKET_NO_DATA && error != WEBSOCKET_NO_BUFFER_SPACE)
+		stats->handshakeerrors[-error & 7]++;
+}
+
+# define count(state, f, ...) \
+	(f(&threadstats, __VA_ARGS__), (state)->stats != NULL ? f((state)->stats, __VA_ARGS__) : (void) 0)
+#else
+# define count(state, f, ...) ((void) 0)
+# define countout(frame) ((void) 0)
+#endif
+
+void websocket_stats_snapshot(struct websocket_stats *stats) {
+#if WEBSOCKET_STATS
+	*stats = threadstats;
+#else
+	memset(stats, 0, sizeof *stats);
+#endif
+}
+
+void websocket_stats_merge(struct websocket_stats *dst, const struct websocket_stats *src) {
+	unsigned long long *d = (unsigned long long *) dst;
+	const unsigned long long *s = (const unsigned long long *) src;
+	size_t i;
+
+	for (i = 0; i < sizeof *dst / sizeof *d; ++i)
+		d[i] += s[i];
+}
+
+void _websocket_countout(const struct websocket_frame *frame) {
+#if WEBSOCKET_STATS
+	countout(frame);
+#else
+	(void) frame;
+#endif
+}
+
 ssize_t websocket_writeframe(void *dst, size_t size, struct websocket_frame *frame) {
 	ssize_t off = 0;
 	unsigned char len[8];
@@ -233,6 +985,7 @@ ssize_t websocket_writeframe(void *dst, size_t size, struct websocket_frame *fra
 		if ((off = websocket_writedata(dst, off, size, frame->mask, sizeof frame->mask)) < 0)
 			return off;
 
+	countout(frame);
 	return off;
 }
 
@@ -268,13 +1021,510 @@ ssize_t websocket_readframe(const void *src, size_t len, struct websocket_frame
 	return off;
 }
 
-ssize_t websocket_maskdata(void *p, size_t n, const struct websocket_frame *frame, size_t off) {
+ssize_t websocket_readframes(
+		const void *src, size_t len, struct websocket_framedesc *descs, size_t max) {
+	const unsigned char *p = src;
+	unsigned long long length;
+	size_t off = 0, n, head;
+
+	for (n = 0; n < max && len - off >= 2; ++n) {
+		head = 2 + (p[off + 1] & WEBSOCKET_MASK ? 4 : 0);
+		length = p[off + 1] & WEBSOCKET_LENGTH;
+
+		if (length == 126) {
+			if (len - off < head + 2)
+				break;
+			length = (unsigned long long) p[off + 2] << 0x08 | p[off + 3];
+			head += 2;
+		} else if (length == 127) {
+			if (len - off < head + 8)
+				break;
+			length =
+				(unsigned long long) p[off + 2] << 0x38 | (unsigned long long) p[off + 3] << 0x30 |
+				(unsigned long long) p[off + 4] << 0x28 | (unsigned long long) p[off + 5] << 0x20 |
+				(unsigned long long) p[off + 6] << 0x18 | (unsigned long long) p[off + 7] << 0x10 |
+				(unsigned long long) p[off + 8] << 0x08 | (unsigned long long) p[off + 9];
+			head += 8;
+		}
+
+		if (len - off < head || length > len - off - head)
+			break;
+
+		descs[n].frame.length = length;
+		descs[n].frame.header[0] = p[off];
+		descs[n].frame.header[1] = p[off + 1];
+		if (p[off + 1] & WEBSOCKET_MASK)
+			memcpy(descs[n].frame.mask, p + off + head - 4, 4);
+		descs[n].offset = off + head;
+		descs[n].opcode = p[off] & WEBSOCKET_OPCODE;
+		descs[n].fin = (p[off] & WEBSOCKET_FIN) != 0;
+		descs[n].rsv = (p[off] & (WEBSOCKET_RSV1 | WEBSOCKET_RSV2 | WEBSOCKET_RSV3)) >> 4;
+		descs[n].masked = (p[off + 1] & WEBSOCKET_MASK) != 0;
+
+		off += head + length;
+	}
+
+	return n;
+}
+
+static void maskbytes(
+		unsigned char *dst, const unsigned char *src, size_t n, const unsigned char mask[4],
+		size_t off) {
+	size_t i;
+
+	for (i = 0; i < n; ++i)
+		dst[i] = src[i] ^ mask[(off + i) & 3];
+}
+
+static uint32_t maskkey(const unsigned char mask[4], size_t off) {
+	unsigned char m[4];
+	uint32_t k;
+
+	m[0] = mask[(off + 0) & 3];
+	m[1] = mask[(off + 1) & 3];
+	m[2] = mask[(off + 2) & 3];
+	m[3] = mask[(off + 3) & 3];
+
+	memcpy(&k, m, sizeof k);
+	return k;
+}
+
+static size_t maskscalar(unsigned char *dst, const unsigned char *src, size_t n, uint32_t k) {
+	uint64_t k2 = (uint64_t) k << 32 | k, w;
+	size_t i;
+
+	for (i = 0; i + 8 <= n; i += 8) {
+		memcpy(&w, src + i, sizeof w);
+		w ^= k2;
+		memcpy(dst + i, &w, sizeof w);
+	}
+
+	return i;
+}
+
+#if __SSE2__
+static size_t masksse2(unsigned char *dst, const unsigned char *src, size_t n, uint32_t k) {
+	__m128i k4 = _mm_set1_epi32((int) k);
+	size_t i;
+
+	for (i = 0; i + 64 <= n; i += 64) {
+		const __m128i *s = (const __m128i *) (src + i);
+		__m128i *d = (__m128i *) (dst + i);
+		_mm_store_si128(d + 0, _mm_xor_si128(_mm_loadu_si128(s + 0), k4));
+		_mm_store_si128(d + 1, _mm_xor_si128(_mm_loadu_si128(s + 1), k4));
+		_mm_store_si128(d + 2, _mm_xor_si128(_mm_loadu_si128(s + 2), k4));
+		_mm_store_si128(d + 3, _mm_xor_si128(_mm_loadu_si128(s + 3), k4));
+	}
+
+	for (; i + 16 <= n; i += 16)
+		_mm_store_si128(
+			(__m128i *) (dst + i),
+			_mm_xor_si128(_mm_loadu_si128((const __m128i *) (src + i)), k4));
+
+	return i;
+}
+#endif
+
+#if _websocket_x86
+__attribute__((target("avx2")))
+static size_t maskavx2(unsigned char *dst, const unsigned char *src, size_t n, uint32_t k) {
+	__m256i k8 = _mm256_set1_epi32((int) k);
+	size_t i;
+
+	for (i = 0; i + 64 <= n; i += 64) {
+		const __m256i *s = (const __m256i *) (src + i);
+		__m256i *d = (__m256i *) (dst + i);
+		_mm256_store_si256(d + 0, _mm256_xor_si256(_mm256_loadu_si256(s + 0), k8));
+		_mm256_store_si256(d + 1, _mm256_xor_si256(_mm256_loadu_si256(s + 1), k8));
+	}
+
+	for (; i + 32 <= n; i += 32)
+		_mm256_store_si256(
+			(__m256i *) (dst + i),
+			_mm256_xor_si256(_mm256_loadu_si256((const __m256i *) (src + i)), k8));
+
+	return i;
+}
+#endif
+
+#if __ARM_NEON
+static size_t maskneon(unsigned char *dst, const unsigned char *src, size_t n, uint32_t k) {
+	uint8x16_t k4 = vreinterpretq_u8_u32(vdupq_n_u32(k));
+	size_t i;
+
+	for (i = 0; i + 64 <= n; i += 64) {
+		uint8x16x4_t v = vld1q_u8_x4(src + i);
+		v.val[0] = veorq_u8(v.val[0], k4);
+		v.val[1] = veorq_u8(v.val[1], k4);
+		v.val[2] = veorq_u8(v.val[2], k4);
+		v.val[3] = veorq_u8(v.val[3], k4);
+		vst1q_u8_x4(dst + i, v);
+	}
+
+	for (; i + 16 <= n; i += 16)
+		vst1q_u8(dst + i, veorq_u8(vld1q_u8(src + i), k4));
+
+	return i;
+}
+#endif
+
+static int maskkernel = WEBSOCKET_KERNEL_AUTO;
+
+static int masking(void) {
+	int kernel = loadkernel(&maskkernel);
+
+	return kernel != WEBSOCKET_KERNEL_AUTO ? kernel : websocket_kernel(WEBSOCKET_KERNEL_AUTO);
+}
+
+int websocket_kernel(int kernel) {
+	int hash;
+
+	if (kernel == WEBSOCKET_KERNEL_AUTO) {
+#if __ARM_NEON
+		kernel = WEBSOCKET_KERNEL_NEON;
+#elif _websocket_x86
+		kernel = __builtin_cpu_supports("avx2") ? WEBSOCKET_KERNEL_AVX2 : WEBSOCKET_KERNEL_SSE2;
+#else
+		kernel = WEBSOCKET_KERNEL_SCALAR;
+#endif
+	}
+
+#if _websocket_x86
+	if (kernel == WEBSOCKET_KERNEL_AVX2 && !__builtin_cpu_supports("avx2"))
+		kernel = WEBSOCKET_KERNEL_SSE2;
+#else
+	if (kernel == WEBSOCKET_KERNEL_AVX2)
+		kernel = WEBSOCKET_KERNEL_SCALAR;
+#endif
+#if !__SSE2__
+	if (kernel == WEBSOCKET_KERNEL_SSE2)
+		kernel = WEBSOCKET_KERNEL_SCALAR;
+#endif
+#if !__ARM_NEON
+	if (kernel == WEBSOCKET_KERNEL_NEON)
+		kernel = WEBSOCKET_KERNEL_SCALAR;
+#endif
+
+	/* handshake hashing follows along: sse2 hashes four keys per pass, avx2 machines use sha-ni if present */
+	hash = kernel == WEBSOCKET_KERNEL_SSE2 ? HASH_SSE2 : HASH_SCALAR;
+#if _websocket_x86
+	if (kernel == WEBSOCKET_KERNEL_AVX2)
+		hash = hasshani() ? HASH_SHANI : HASH_SSE2;
+#endif
+
+	storekernel(&hashkernel, hash);
+	storekernel(&maskkernel, kernel);
+	return kernel;
+}
+
+static void maskcopy(
+		unsigned char *dst, const unsigned char *src, size_t n, const unsigned char mask[4],
+		size_t off) {
+	size_t i, head;
+	int kernel = masking();
+
+	/* bring dst to a 32 byte boundary so the vector loops can use aligned stores */
+	if ((head = -(uintptr_t) dst & 31) > n)
+		head = n;
+
+	maskbytes(dst, src, head, mask, off);
+	dst += head;
+	src += head;
+	n -= head;
+	off += head;
+
+	switch (kernel) {
+#if __SSE2__
+	case WEBSOCKET_KERNEL_SSE2:
+		i = masksse2(dst, src, n, maskkey(mask, off));
+		break;
+#endif
+#if _websocket_x86
+	case WEBSOCKET_KERNEL_AVX2:
+		i = maskavx2(dst, src, n, maskkey(mask, off));
+		break;
+#endif
+#if __ARM_NEON
+	case WEBSOCKET_KERNEL_NEON:
+		i = maskneon(dst, src, n, maskkey(mask, off));
+		break;
+#endif
+	default:
+		i = maskscalar(dst, src, n, maskkey(mask, off));
+		break;
+	}
+
+	maskbytes(dst + i, src + i, n - i, mask, off + i);
+}
+
+/* UTF-8 is checked with a small dfa over byte classes: 0 accepts, 8 rejects, 1..3 wait
+   for that many continuation bytes and 4..7 restrict the range of the next one. The
+   scalar and sse2 loops only run the dfa for blocks that are not plain ascii. */
+
+static const unsigned char utf8class[256] = {
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+	2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2,
+	3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3,
+	3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3,
+	11, 11, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+	4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+	5, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 7, 6, 6,
+	8, 9, 9, 9, 10, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11,
+};
+
+static const unsigned char utf8next[9 * 12] = {
+	0, 8, 8, 8, 1, 4, 2, 5, 6, 3, 7, 8,
+	8, 0, 0, 0, 8, 8, 8, 8, 8, 8, 8, 8,
+	8, 1, 1, 1, 8, 8, 8, 8, 8, 8, 8, 8,
+	8, 2, 2, 2, 8, 8, 8, 8, 8, 8, 8, 8,
+	8, 8, 8, 1, 8, 8, 8, 8, 8, 8, 8, 8,
+	8, 1, 1, 8, 8, 8, 8, 8, 8, 8, 8, 8,
+	8, 8, 2, 2, 8, 8, 8, 8, 8, 8, 8, 8,
+	8, 2, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8,
+	8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8
+};
+
+static unsigned utf8bytes(unsigned state, const unsigned char *p, size_t n) {
 	size_t i;
 
+	for (i = 0; i < n; ++i)
+		if (state != 0 || p[i] >= 0x80)
+			state = utf8next[state * 12 + utf8class[p[i]]];
+
+	return state;
+}
+
+static size_t utf8scalar(
+		unsigned char *dst, const unsigned char *src, size_t n, uint32_t k, unsigned *state) {
+	uint64_t k2 = (uint64_t) k << 32 | k, w;
+	size_t i;
+
+	for (i = 0; i + 8 <= n; i += 8) {
+		memcpy(&w, src + i, sizeof w);
+		w ^= k2;
+		memcpy(dst + i, &w, sizeof w);
+
+		if ((w & 0x8080808080808080ull) != 0 || *state != 0)
+			*state = utf8bytes(*state, dst + i, 8);
+	}
+
+	return i;
+}
+
+#if __SSE2__
+static size_t utf8sse2(
+		unsigned char *dst, const unsigned char *src, size_t n, uint32_t k, unsigned *state) {
+	__m128i k4 = _mm_set1_epi32((int) k), a, b;
+	size_t i;
+
+	for (i = 0; i + 32 <= n; i += 32) {
+		a = _mm_xor_si128(_mm_loadu_si128((const __m128i *) (src + i)), k4);
+		b = _mm_xor_si128(_mm_loadu_si128((const __m128i *) (src + i + 16)), k4);
+		_mm_storeu_si128((__m128i *) (dst + i), a);
+		_mm_storeu_si128((__m128i *) (dst + i + 16), b);
+
+		if (_mm_movemask_epi8(_mm_or_si128(a, b)) != 0 || *state != 0)
+			*state = utf8bytes(*state, dst + i, 32);
+	}
+
+	return i;
+}
+#endif
+
+#if _websocket_x86
+/* The avx2 kernel is a full vector validator after Keiser and Lemire, "Validating UTF-8
+   In Less Than One Instruction Per Byte": three nibble lookups classify every byte pair,
+   and the third and fourth bytes of long sequences are checked with saturating subtracts. */
+
+# define TOO_SHORT (1 << 0)
+# define TOO_LONG (1 << 1)
+# define OVERLONG_3 (1 << 2)
+# define TOO_LARGE (1 << 3)
+# define SURROGATE (1 << 4)
+# define OVERLONG_2 (1 << 5)
+# define TOO_LARGE_1000 (1 << 6)
+# define OVERLONG_4 (1 << 6)
+# define TWO_CONTS (1 << 7)
+# define CARRY (TOO_SHORT | TOO_LONG | TWO_CONTS)
+
+static const unsigned char utf8byte1high[16] = {
+	TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG,
+	TWO_CONTS, TWO_CONTS, TWO_CONTS, TWO_CONTS,
+	TOO_SHORT | OVERLONG_2,
+	TOO_SHORT,
+	TOO_SHORT | OVERLONG_3 | SURROGATE,
+	TOO_SHORT | TOO_LARGE | TOO_LARGE_1000 | OVERLONG_4
+};
+
+static const unsigned char utf8byte1low[16] = {
+	CARRY | OVERLONG_3 | OVERLONG_2 | OVERLONG_4,
+	CARRY | OVERLONG_2,
+	CARRY,
+	CARRY,
+	CARRY | TOO_LARGE,
+	CARRY | TOO_LARGE | TOO_LARGE_1000,
+	CARRY | TOO_LARGE | TOO_LARGE_1000,
+	CARRY | TOO_LARGE | TOO_LARGE_1000,
+	CARRY | TOO_LARGE | TOO_LARGE_1000,
+	CARRY | TOO_LARGE | TOO_LARGE_1000,
+	CARRY | TOO_LARGE | TOO_LARGE_1000,
+	CARRY | TOO_LARGE | TOO_LARGE_1000,
+	CARRY | TOO_LARGE | TOO_LARGE_1000,
+	CARRY | TOO_LARGE | TOO_LARGE_1000 | SURROGATE,
+	CARRY | TOO_LARGE | TOO_LARGE_1000,
+	CARRY | TOO_LARGE | TOO_LARGE_1000
+};
+
+static const unsigned char utf8byte2high[16] = {
+	TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT,
+	TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE_1000 | OVERLONG_4,
+	TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE,
+	TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE,
+	TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE,
+	TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT
+};
+
+# undef TOO_SHORT
+# undef TOO_LONG
+# undef OVERLONG_3
+# undef TOO_LARGE
+# undef SURROGATE
+# undef OVERLONG_2
+# undef TOO_LARGE_1000
+# undef OVERLONG_4
+# undef TWO_CONTS
+# undef CARRY
+
+__attribute__((target("avx2")))
+static size_t utf8avx2(
+		unsigned char *dst, const unsigned char *src, size_t n, uint32_t k, unsigned *state) {
+	const __m256i k8 = _mm256_set1_epi32((int) k), lo = _mm256_set1_epi8(0x0f);
+	const __m256i t1h = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *) utf8byte1high));
+	const __m256i t1l = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *) utf8byte1low));
+	const __m256i t2h = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *) utf8byte2high));
+	const __m256i last = _mm256_setr_epi8(
+		-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+		-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 0xef, 0xdf, 0xbf);
+	__m256i in, prev = _mm256_setzero_si256(), err = prev, incomplete = prev, p, p1, p2, p3, sc;
+	size_t i, j;
+
+	/* the vector state starts on a character boundary */
+	if (*state != 0)
+		return 0;
+
+	for (i = 0; i + 32 <= n; i += 32) {
+		in = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *) (src + i)), k8);
+		_mm256_storeu_si256((__m256i *) (dst + i), in);
+
+		if (_mm256_movemask_epi8(in) == 0) {
+			err = _mm256_or_si256(err, incomplete);
+			incomplete = _mm256_setzero_si256();
+		} else {
+			p = _mm256_permute2x128_si256(prev, in, 0x21);
+			p1 = _mm256_alignr_epi8(in, p, 15);
+			p2 = _mm256_alignr_epi8(in, p, 14);
+			p3 = _mm256_alignr_epi8(in, p, 13);
+
+			sc = _mm256_and_si256(
+				_mm256_and_si256(
+					_mm256_shuffle_epi8(t1h, _mm256_and_si256(_mm256_srli_epi16(p1, 4), lo)),
+					_mm256_shuffle_epi8(t1l, _mm256_and_si256(p1, lo))),
+				_mm256_shuffle_epi8(t2h, _mm256_and_si256(_mm256_srli_epi16(in, 4), lo)));
+
+			err = _mm256_or_si256(err, _mm256_xor_si256(sc, _mm256_and_si256(
+				_mm256_or_si256(
+					_mm256_subs_epu8(p2, _mm256_set1_epi8((char) (0xe0 - 0x80))),
+					_mm256_subs_epu8(p3, _mm256_set1_epi8((char) (0xf0 - 0x80)))),
+				_mm256_set1_epi8((char) 0x80))));
+
+			incomplete = _mm256_subs_epu8(in, last);
+		}
+
+		prev = in;
+	}
+
+	if (!_mm256_testz_si256(err, err))
+		*state = WEBSOCKET_UTF8_REJECT;
+	else if (!_mm256_testz_si256(incomplete, incomplete)) {
+		/* hand the unfinished sequence back to the dfa */
+		for (j = i - 1; (dst[j] & 0xc0) == 0x80; --j)
+			;
+		*state = utf8bytes(0, dst + j, i - j);
+	}
+
+	return i;
+}
+#endif
+
+static unsigned maskutf8(
+		unsigned char *dst, const unsigned char *src, size_t n, const unsigned char mask[4],
+		size_t off, unsigned state) {
+	size_t i;
+	int kernel = masking();
+
+	/* finish a character left open by the previous call so the kernels start on a boundary */
+	for (i = 0; i < n && state != WEBSOCKET_UTF8_ACCEPT && state != WEBSOCKET_UTF8_REJECT; ++i) {
+		dst[i] = src[i] ^ mask[(off + i) & 3];
+		state = utf8next[state * 12 + utf8class[dst[i]]];
+	}
+
+	dst += i;
+	src += i;
+	n -= i;
+	off += i;
+
+	switch (kernel) {
+#if __SSE2__
+	case WEBSOCKET_KERNEL_SSE2:
+		i = utf8sse2(dst, src, n, maskkey(mask, off), &state);
+		break;
+#endif
+#if _websocket_x86
+	case WEBSOCKET_KERNEL_AVX2:
+		i = utf8avx2(dst, src, n, maskkey(mask, off), &state);
+		break;
+#endif
+	default:
+		i = utf8scalar(dst, src, n, maskkey(mask, off), &state);
+		break;
+	}
+
+	maskbytes(dst + i, src + i, n - i, mask, off + i);
+	return utf8bytes(state, dst + i, n - i);
+}
+
+ssize_t websocket_unmaskutf8(
+		void *dst, const void *src, size_t n, const struct websocket_frame *frame, size_t off,
+		unsigned char *utf8) {
+	static const unsigned char zero[4];
+
+	*utf8 = (unsigned char) maskutf8(
+		dst, src, n, (frame->header[1] & WEBSOCKET_MASK) ? frame->mask : zero, off, *utf8);
+
+	return *utf8 != WEBSOCKET_UTF8_REJECT ? (ssize_t) n : WEBSOCKET_DATA_ERROR;
+}
+
+ssize_t websocket_maskdata(void *p, size_t n, const struct websocket_frame *frame, size_t off) {
 	if (frame->header[1] & WEBSOCKET_MASK)
-		for (i = 0; i < n; ++i)
-			((unsigned char *) p)[i] =
-				((unsigned char *) p)[i] ^ frame->mask[off + i & 3];
+		maskcopy(p, p, n, frame->mask, off);
+
+	return n;
+}
+
+ssize_t websocket_unmaskcopy(
+		void *dst, const void *src, size_t n, const struct websocket_frame *frame, size_t off) {
+	if (frame->header[1] & WEBSOCKET_MASK)
+		maskcopy(dst, src, n, frame->mask, off);
+	else
+		memcpy(dst, src, n);
 
 	return n;
 }
@@ -295,71 +1545,188 @@ ssize_t websocket_writedata(void *dst, size_t off, size_t size, const void *src,
 	return off += len;
 }
 
-struct websocket_result websocket_update(
+static ssize_t call(
+		struct websocket_state *state, websocket_handler_t handler,
+		int op, void *dst, size_t size, const void *src, size_t len, void *userdata) {
+#if WEBSOCKET_STATS
+	unsigned long long t = nanotime();
+	ssize_t err = handler(op, dst, size, src, len, userdata);
+
+	count(state, countcall, nanotime() - t);
+	return err;
+#else
+	(void) state;
+	return handler(op, dst, size, src, len, userdata);
+#endif
+}
+
+/* Inline decoding in the role of the state when a whole header is there; the
+   general reader takes short input and the frames it refuses for their mask bit,
+   which are judged below. */
+static ssize_t readframe(
+		const struct websocket_state *state, const unsigned char *src, size_t len,
+		struct websocket_frame *frame) {
+	ssize_t err;
+
+	if (len >= WEBSOCKET_FRAMEMAX && (err = state->client != NULL ?
+			websocket_readframe_client(src, frame) : websocket_readframe_server(src, frame)) >= 0)
+		return err;
+
+	return websocket_readframe(src, len, frame);
+}
+
+/* Control frames going back out. A server replies plain, so its header drops the
+   mask bit the peer's kept in state->frame for unmasking the payload on its way
+   through; a client has put a key of its own there and masks with that. */
+static ssize_t reply(struct websocket_state *state, unsigned char *dst, size_t size) {
+	struct websocket_frame frame = state->frame;
+
+	if (state->client == NULL)
+		frame.header[1] &= ~WEBSOCKET_MASK;
+
+	return websocket_writeframe(dst, size, &frame);
+}
+
+static void echo(struct websocket_state *state, unsigned char *dst, const unsigned char *src, size_t n) {
+	websocket_unmaskcopy(dst, src, n, &state->frame, state->offset);
+}
+
+/* RSV1 marks the first frame of a compressed data message, once deflate is on */
+static int rsv1allowed(const struct websocket_state *state) {
+	if (!(state->frame.header[0] & WEBSOCKET_RSV1))
+		return 1;
+
+#if WEBSOCKET_DEFLATE
+	return state->deflate != NULL && state->deflate->enabled &&
+		(state->frame.header[0] & WEBSOCKET_OPCODE) != WEBSOCKET_CONTINUATION &&
+		(state->frame.header[0] & WEBSOCKET_OPCODE) < WEBSOCKET_CLOSE;
+#else
+	return 0;
+#endif
+}
+
+/* the caller's parse state, or a fresh one that lives as long as this call */
+static struct websocket_http *parsehttp(struct websocket_state *state, struct websocket_http *scratch) {
+	if (state->http != NULL)
+		return state->http;
+
+	*scratch = (struct websocket_http) {0};
+	return scratch;
+}
+
+static struct websocket_result update(
 		struct websocket_state *state, void *dst, size_t size, const void *src, size_t len,
 		websocket_handler_t handler, void *userdata) {
+	struct websocket_http scratch, *http = state->http;
 	size_t dstoff = 0, srcoff = 0;
 	ssize_t err;
+	unsigned char *buf;
 
 	coroutine_begin(state->co);
 
-        while ((err = websocket_writeresponse(
-			(unsigned char *) dst + dstoff, size - dstoff,
-			(const unsigned char *) src + srcoff, len - srcoff)) < 0)
-		coroutine_yield(state->co, (struct websocket_result) {dstoff, srcoff, err});
-	dstoff += err;
-
-	while ((err = websocket_readrequest((const unsigned char *) src + srcoff, len - srcoff)) < 0)
-		coroutine_yield(state->co, (struct websocket_result) {dstoff, srcoff, err});
-	srcoff += err;
+	if (!state->upgraded && state->client != NULL) {
+		while ((err = websocket_writerequest(
+				(unsigned char *) dst + dstoff, size - dstoff, state->client->nonce,
+				state->client->uri, state->client->fields, state->client->count)) < 0)
+			coroutine_yield(state->co, (struct websocket_result) {dstoff, srcoff, err});
+		dstoff += err;
+		while ((err = websocket_readhttp(
+				http = parsehttp(state, &scratch), (const unsigned char *) src + srcoff, len - srcoff)) < 0)
+			coroutine_yield(state->co, (struct websocket_result) {dstoff, srcoff, err});
+		if (checkresponse(http, (const unsigned char *) src + srcoff, state->client->nonce) < 0)
+			for (;;)
+				coroutine_yield(
+					state->co, (struct websocket_result) {dstoff, srcoff, WEBSOCKET_DATA_ERROR});
+		srcoff += err;
+		state->http = NULL;
+		state->upgraded = 1;
+	} else if (!state->upgraded) {
+		while ((err = websocket_readhttp(
+				http = parsehttp(state, &scratch), (const unsigned char *) src + srcoff, len - srcoff)) < 0)
+			coroutine_yield(state->co, (struct websocket_result) {dstoff, srcoff, err});
+		state->count = err;
+
+		/* scratch is gone after a yield: parse again from what the caller still holds */
+		while ((http == NULL && (err = websocket_readhttp(
+				http = parsehttp(state, &scratch), (const unsigned char *) src + srcoff, len - srcoff)) < 0) ||
+#if WEBSOCKET_DEFLATE
+				(err = writeresponse(
+					(unsigned char *) dst + dstoff, size - dstoff,
+					(const unsigned char *) src + srcoff, http, state->deflate, NULL)) < 0)
+#else
+				(err = writeresponse(
+					(unsigned char *) dst + dstoff, size - dstoff,
+					(const unsigned char *) src + srcoff, http, NULL, NULL)) < 0)
+#endif
+			coroutine_yield(state->co, (struct websocket_result) {dstoff, srcoff, err});
+		dstoff += err;
+		srcoff += state->count;
+		state->http = NULL;
+		state->upgraded = 1;
+	}
 
-	for (int loop = 1; loop;) {
-		while ((err = websocket_readframe(
-				(const unsigned char *) src + srcoff, len - srcoff, &state->frame)) < 0)
+	do {
+		state->idle = !state->fragmented;
+		while ((err = readframe(
+				state, (const unsigned char *) src + srcoff, len - srcoff, &state->frame)) < 0)
 			coroutine_yield(state->co, (struct websocket_result) {dstoff, srcoff, err});
 		srcoff += err;
 		state->offset = 0;
+		state->idle = 0;
+		count(state, countframe, &state->frame);
 
-		switch (state->frame.header[0] & WEBSOCKET_OPCODE) {
-		case WEBSOCKET_CLOSE:
-			while ((err = websocket_writeframe(
-					(unsigned char *) dst + dstoff, size - dstoff, &state->frame)) < 0)
-				coroutine_yield(state->co, (struct websocket_result) {dstoff, srcoff, err});
-			dstoff += err;
-			while (state->frame.length - state->offset > len - srcoff) {
-				state->offset += len - srcoff;
-				srcoff = len;
+		/* servers never mask, clients always do */
+		if ((state->client != NULL) == !!(state->frame.header[1] & WEBSOCKET_MASK))
+			for (;;)
 				coroutine_yield(
-					state->co, (struct websocket_result) {dstoff, srcoff, WEBSOCKET_NO_DATA});
+					state->co, (struct websocket_result) {dstoff, srcoff, WEBSOCKET_DATA_ERROR});
+
+		/* a control frame is one frame, short enough to answer in one */
+		if ((state->frame.header[0] & WEBSOCKET_OPCODE) >= WEBSOCKET_CLOSE &&
+				(state->frame.length > 125 || !(state->frame.header[0] & WEBSOCKET_FIN)))
+			for (;;)
+				coroutine_yield(
+					state->co, (struct websocket_result) {dstoff, srcoff, WEBSOCKET_DATA_ERROR});
+
+		if (!rsv1allowed(state))
+			for (;;)
+				coroutine_yield(
+					state->co, (struct websocket_result) {dstoff, srcoff, WEBSOCKET_DATA_ERROR});
+
+		/* no switch here: coroutine_yield expands to case labels of its own */
+		if ((state->frame.header[0] & WEBSOCKET_OPCODE) == WEBSOCKET_PING ||
+				(state->frame.header[0] & WEBSOCKET_OPCODE) == WEBSOCKET_CLOSE) {
+			/* the status of a close goes back along with it */
+			if ((state->frame.header[0] & WEBSOCKET_OPCODE) == WEBSOCKET_PING) {
+				state->frame.header[0] &= ~WEBSOCKET_PING;
+				state->frame.header[0] |= WEBSOCKET_FIN | WEBSOCKET_PONG;
 			}
-			srcoff += state->frame.length - state->offset;
-			loop = 0;
-			break;
-		case WEBSOCKET_PING:
-			state->frame.header[0] &= ~WEBSOCKET_PING;
-			state->frame.header[0] |= WEBSOCKET_FIN | WEBSOCKET_PONG;
-			while ((err = websocket_writeframe(
-					(unsigned char *) dst + dstoff, size - dstoff, &state->frame)) < 0)
+			if (state->client != NULL) {
+				state->frame.header[1] |= WEBSOCKET_MASK;
+				websocket_random_bytes(
+					&state->client->random, state->frame.mask, sizeof state->frame.mask);
+			}
+			while ((err = reply(state, (unsigned char *) dst + dstoff, size - dstoff)) < 0)
 				coroutine_yield(
 					state->co, (struct websocket_result) {dstoff, srcoff, err});
 			dstoff += err;
-			while (state->frame.length - state->offset > len - srcoff) {
-				memcpy(
-					(unsigned char *) dst + dstoff, (const unsigned char *) src + srcoff,
-					len - srcoff);
-				dstoff += len - srcoff;
-				state->offset += len - srcoff;
-				srcoff = len;
-				coroutine_yield(
-					state->co, (struct websocket_result) {dstoff, srcoff, WEBSOCKET_NO_DATA});
+			while (state->offset < state->frame.length) {
+				while (srcoff == len || dstoff == size)
+					coroutine_yield(
+						state->co, (struct websocket_result) {dstoff, srcoff,
+							dstoff == size ? WEBSOCKET_NO_BUFFER_SPACE : WEBSOCKET_NO_DATA});
+				if ((state->count = state->frame.length - state->offset) > len - srcoff)
+					state->count = len - srcoff;
+				if (state->count > size - dstoff)
+					state->count = size - dstoff;
+				echo(
+					state, (unsigned char *) dst + dstoff, (const unsigned char *) src + srcoff,
+					state->count);
+				dstoff += state->count;
+				srcoff += state->count;
+				state->offset += state->count;
 			}
-			memcpy(
-				(unsigned char *) dst + dstoff, (const unsigned char *) src + srcoff,
-				state->frame.length - state->offset);
-			dstoff += state->frame.length - state->offset;
-			srcoff += state->frame.length - state->offset;
-			break;
-		case WEBSOCKET_PONG:
+		} else if ((state->frame.header[0] & WEBSOCKET_OPCODE) == WEBSOCKET_PONG) {
 			while (state->frame.length - state->offset > len - srcoff) {
 				state->offset += len - srcoff;
 				srcoff = len;
@@ -367,62 +1734,239 @@ struct websocket_result websocket_update(
 					state->co, (struct websocket_result) {dstoff, srcoff, WEBSOCKET_NO_DATA});
 			}
 			srcoff += state->frame.length - state->offset;
-			break;
-		case WEBSOCKET_CONTINUATION:
-		case WEBSOCKET_TEXT:
-		case WEBSOCKET_BINARY:
-			while (state->frame.length - state->offset > len - srcoff) {
-				websocket_maskdata(
-					(unsigned char *) src + srcoff, len - srcoff, &state->frame, state->offset);
+		} else if ((state->frame.header[0] & WEBSOCKET_OPCODE) == WEBSOCKET_CONTINUATION ||
+				(state->frame.header[0] & WEBSOCKET_OPCODE) == WEBSOCKET_TEXT ||
+				(state->frame.header[0] & WEBSOCKET_OPCODE) == WEBSOCKET_BINARY) {
+			/* a continuation needs a message in progress and nothing else may interrupt one */
+			if (state->assembly != NULL &&
+					((state->frame.header[0] & WEBSOCKET_OPCODE) == WEBSOCKET_CONTINUATION) !=
+					(state->assembly->opcode != 0))
+				for (;;)
+					coroutine_yield(
+						state->co, (struct websocket_result) {dstoff, srcoff, WEBSOCKET_DATA_ERROR});
+			if (state->assembly != NULL &&
+					(state->frame.header[0] & WEBSOCKET_OPCODE) != WEBSOCKET_CONTINUATION)
+				state->assembly->opcode = state->frame.header[0] & WEBSOCKET_OPCODE;
+			if ((state->frame.header[0] & WEBSOCKET_OPCODE) != WEBSOCKET_CONTINUATION) {
+				state->text = (state->frame.header[0] & WEBSOCKET_OPCODE) == WEBSOCKET_TEXT;
+				state->utf8 = WEBSOCKET_UTF8_ACCEPT;
+			}
+			state->fragmented = !(state->frame.header[0] & WEBSOCKET_FIN);
+#if WEBSOCKET_DEFLATE
+			if (state->deflate != NULL &&
+					(state->frame.header[0] & WEBSOCKET_OPCODE) != WEBSOCKET_CONTINUATION)
+				state->deflate->message =
+					state->deflate->enabled && (state->frame.header[0] & WEBSOCKET_RSV1);
+			if (state->deflate != NULL && state->deflate->message) {
+				do {
+					while (srcoff == len && state->offset < state->frame.length)
+						coroutine_yield(
+							state->co, (struct websocket_result) {dstoff, srcoff, WEBSOCKET_NO_DATA});
+					while ((buf = _websocket_inflatebuf(state->deflate, &state->count)) == NULL)
+						coroutine_yield(
+							state->co, (struct websocket_result) {dstoff, srcoff, WEBSOCKET_NO_BUFFER_SPACE});
+					if (state->count > state->frame.length - state->offset)
+						state->count = state->frame.length - state->offset;
+					if (state->count > len - srcoff)
+						state->count = len - srcoff;
+					websocket_unmaskcopy(
+						buf, (const unsigned char *) src + srcoff, state->count,
+						&state->frame, state->offset);
+					state->offset += state->count;
+					srcoff += state->count;
+					_websocket_inflateinput(
+						state->deflate, state->count,
+						state->offset == state->frame.length && (state->frame.header[0] & WEBSOCKET_FIN));
+					while ((err = _websocket_inflate(state->deflate)) != 0) {
+						if (state->text)
+							state->utf8 = (unsigned char) utf8bytes(
+								state->utf8, state->deflate->out, state->deflate->outlen);
+						if (err < 0 || state->utf8 == WEBSOCKET_UTF8_REJECT)
+							for (;;)
+								coroutine_yield(
+									state->co, (struct websocket_result) {dstoff, srcoff, WEBSOCKET_DATA_ERROR});
+						if (state->assembly != NULL) {
+							while ((err = _websocket_reserve(
+									state->assembly, state->deflate->outlen)) == WEBSOCKET_NO_BUFFER_SPACE)
+								coroutine_yield(
+									state->co, (struct websocket_result) {dstoff, srcoff, err});
+							if (err < 0)
+								for (;;)
+									coroutine_yield(
+										state->co, (struct websocket_result) {dstoff, srcoff, WEBSOCKET_DATA_ERROR});
+							memcpy(
+								state->assembly->buf + state->assembly->len,
+								state->deflate->out, state->deflate->outlen);
+							state->assembly->len += state->deflate->outlen;
+						} else if (handler != NULL) {
+							while ((err = call(
+									state, handler, (state->frame.header[0] & WEBSOCKET_OPCODE),
+									(unsigned char *) dst + dstoff, size - dstoff,
+									state->deflate->out, state->deflate->outlen, userdata)) < 0)
+								coroutine_yield(
+									state->co, (struct websocket_result) {dstoff, srcoff, err});
+							dstoff += err;
+						}
+					}
+				} while (state->offset < state->frame.length);
+			} else
+#endif
+			{
+				if (state->assembly != NULL) {
+					while ((err = _websocket_reserve(
+							state->assembly, state->frame.length)) == WEBSOCKET_NO_BUFFER_SPACE)
+						coroutine_yield(state->co, (struct websocket_result) {dstoff, srcoff, err});
+					if (err < 0)
+						for (;;)
+							coroutine_yield(
+								state->co, (struct websocket_result) {dstoff, srcoff, WEBSOCKET_DATA_ERROR});
+				}
+				do {
+					while (srcoff == len && state->offset < state->frame.length)
+						coroutine_yield(
+							state->co, (struct websocket_result) {dstoff, srcoff, WEBSOCKET_NO_DATA});
+					if ((state->count = state->frame.length - state->offset) > len - srcoff)
+						state->count = len - srcoff;
+					if (state->assembly != NULL)
+						buf = state->assembly->buf + state->assembly->len;
+					else if (state->data != NULL) {
+						if (state->count > state->datasize)
+							state->count = state->datasize;
+						buf = state->data;
+					} else
+						buf = (unsigned char *) src + srcoff;
+					if (state->text) {
+						if (websocket_unmaskutf8(
+								buf, (const unsigned char *) src + srcoff, state->count,
+								&state->frame, state->offset, &state->utf8) < 0)
+							for (;;)
+								coroutine_yield(
+									state->co, (struct websocket_result) {dstoff, srcoff, WEBSOCKET_DATA_ERROR});
+					} else if (buf != (const unsigned char *) src + srcoff)
+						websocket_unmaskcopy(
+							buf, (const unsigned char *) src + srcoff, state->count,
+							&state->frame, state->offset);
+					else
+						websocket_maskdata(buf, state->count, &state->frame, state->offset);
+					if (state->assembly != NULL)
+						state->assembly->len += state->count;
+					if (handler != NULL && state->assembly == NULL) {
+						while ((err = call(
+								state, handler, (state->frame.header[0] & WEBSOCKET_OPCODE),
+								(unsigned char *) dst + dstoff, size - dstoff,
+								state->data != NULL ? state->data : (const unsigned char *) src + srcoff,
+								state->count, userdata)) < 0)
+							coroutine_yield(
+								state->co, (struct websocket_result) {dstoff, srcoff, err});
+						dstoff += err;
+					}
+					state->offset += state->count;
+					srcoff += state->count;
+				} while (state->offset < state->frame.length);
+			}
+			if (state->text && (state->frame.header[0] & WEBSOCKET_FIN) &&
+					state->utf8 != WEBSOCKET_UTF8_ACCEPT)
+				for (;;)
+					coroutine_yield(
+						state->co, (struct websocket_result) {dstoff, srcoff, WEBSOCKET_DATA_ERROR});
+			if (state->assembly != NULL && (state->frame.header[0] & WEBSOCKET_FIN)) {
 				if (handler != NULL) {
-					while ((err = handler((state->frame.header[0] & WEBSOCKET_OPCODE),
+					while ((err = call(
+							state, handler, state->assembly->opcode,
 							(unsigned char *) dst + dstoff, size - dstoff,
-							(const unsigned char *) src + srcoff, len - srcoff,
-							userdata)) < 0)
+							state->assembly->buf, state->assembly->len, userdata)) < 0)
 						coroutine_yield(
 							state->co, (struct websocket_result) {dstoff, srcoff, err});
 					dstoff += err;
 				}
-				state->offset += len - srcoff;
-				srcoff = len;
-				coroutine_yield(
-					state->co, (struct websocket_result) {dstoff, srcoff, WEBSOCKET_NO_DATA});
-			}
-			websocket_maskdata(
-				(unsigned char *) src + srcoff, state->frame.length - state->offset,
-				&state->frame, state->offset);
-			if (handler != NULL) {
-				while ((err = handler((state->frame.header[0] & WEBSOCKET_OPCODE),
-						(unsigned char *) dst + dstoff, size - dstoff,
-						(const unsigned char *) src + srcoff,
-						state->frame.length - state->offset, userdata)) < 0)
-					coroutine_yield(
-						state->co, (struct websocket_result) {dstoff, srcoff, err});
-				dstoff += err;
+				websocket_assembly_release(state->assembly);
 			}
-			srcoff += state->frame.length - state->offset;
-			break;
 		}
-	}
+	} while ((state->frame.header[0] & WEBSOCKET_OPCODE) != WEBSOCKET_CLOSE);
 
 	coroutine_end(state->co);
 	return (struct websocket_result) {dstoff, srcoff, 0};
 }
 
+struct websocket_result websocket_update(
+		struct websocket_state *state, void *dst, size_t size, const void *src, size_t len,
+		websocket_handler_t handler, void *userdata) {
+#if WEBSOCKET_STATS
+	int handshake = !state->upgraded;
+	struct websocket_result r = update(state, dst, size, src, len, handler, userdata);
+
+	count(state, countresult, handshake, handshake && state->upgraded, r.error);
+	return r;
+#else
+	return update(state, dst, size, src, len, handler, userdata);
+#endif
+}
+
 ssize_t websocket_message(
 		unsigned char op, unsigned char mask[4], void *dst, size_t size,
 		const void *src, size_t len) {
 	struct websocket_frame frame = {len, {op, (mask != NULL ? WEBSOCKET_MASK : 0)}};
-	ssize_t off1, off2;
-	if ((off1 = websocket_writeframe(dst, size, &frame)) < 0)
-		return off1;
-	if (mask != NULL)
-		if ((off1 = websocket_writedata(dst, off1, size, mask, 4)) < 0)
-			return off1;
-	if ((off2 = websocket_writedata(dst, off1, size, src, len)) < 0)
-		return off2;
+	ssize_t off;
 	if (mask != NULL)
-		websocket_maskdata((unsigned char *) dst + off1, off2 - off1, &frame, 0);
-	return off2;
+		memcpy(frame.mask, mask, sizeof frame.mask);
+	if (size >= WEBSOCKET_FRAMEMAX) {
+		off = mask != NULL ?
+			websocket_writeframe_client(dst, &frame) : websocket_writeframe_server(dst, &frame);
+		countout(&frame);
+	} else if ((off = websocket_writeframe(dst, size, &frame)) < 0)
+		return off;
+	if (size - off < len)
+		return WEBSOCKET_NO_BUFFER_SPACE;
+	websocket_unmaskcopy((unsigned char *) dst + off, src, len, &frame, 0);
+	return off + len;
 }
 
+#if !_WIN32
+ssize_t websocket_messagev(
+		unsigned char op, void *dst, size_t size, const void *src, size_t len, struct iovec iov[2]) {
+	struct websocket_frame frame = {len, {op, 0}};
+	ssize_t off;
+
+	if ((off = websocket_writeframe(dst, size, &frame)) < 0)
+		return off;
+
+	iov[0].iov_base = dst;
+	iov[0].iov_len = off;
+	iov[1].iov_base = (void *) src;
+	iov[1].iov_len = len;
+
+	return off + len;
+}
+
+ssize_t websocket_messagesv(
+		const unsigned char *ops, void *dst, size_t size, const struct iovec *src, size_t count,
+		struct iovec *iov) {
+	struct websocket_frame frame;
+	size_t i, off = 0, n = 0;
+	ssize_t err;
+
+	for (i = 0; i < count; ++i) {
+		frame.length = src[i].iov_len;
+		frame.header[0] = ops[i];
+		frame.header[1] = 0;
+
+		if ((err = websocket_writeframe((unsigned char *) dst + off, size - off, &frame)) < 0)
+			return err;
+
+		/* headers of empty messages merge into the previous header entry */
+		if (n > 0 && (unsigned char *) iov[n - 1].iov_base + iov[n - 1].iov_len == (unsigned char *) dst + off)
+			iov[n - 1].iov_len += err;
+		else {
+			iov[n].iov_base = (unsigned char *) dst + off;
+			iov[n++].iov_len = err;
+		}
+
+		off += err;
+
+		if (src[i].iov_len > 0)
+			iov[n++] = src[i];
+	}
+
+	return n;
+}
+#endif
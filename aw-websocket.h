@@ -25,6 +25,13 @@
 #define AW_WEBSOCKET_H
 
 #include <sys/types.h>
+#if !_WIN32
+# include <sys/uio.h>
+#endif
+#include <string.h>
+#if _MSC_VER
+# include <stdlib.h>
+#endif
 
 #if __GNUC__
 # define _websocket_alwaysinline inline __attribute__((always_inline))
@@ -32,6 +39,18 @@
 # define _websocket_alwaysinline __forceinline
 #endif
 
+/* network order from an unaligned load, and back */
+#if __GNUC__ && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+# define _websocket_be16(x) ((unsigned short) (x))
+# define _websocket_be64(x) ((unsigned long long) (x))
+#elif __GNUC__
+# define _websocket_be16(x) __builtin_bswap16(x)
+# define _websocket_be64(x) __builtin_bswap64(x)
+#elif _MSC_VER
+# define _websocket_be16(x) _byteswap_ushort(x)
+# define _websocket_be64(x) _byteswap_uint64(x)
+#endif
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -62,7 +81,8 @@ enum {
 	WEBSOCKET_NO_DATA = -1,
 	WEBSOCKET_NO_BUFFER_SPACE = -2,
 	WEBSOCKET_UNSUPPORTED_VERSION = -3,
-	WEBSOCKET_DATA_ERROR = -4
+	WEBSOCKET_DATA_ERROR = -4,
+	WEBSOCKET_IO_ERROR = -5 /* see errno */
 };
 
 struct websocket_result {
@@ -73,6 +93,40 @@ struct websocket_result {
 
 /* Low-level nuts and bolts api */
 
+/* HTTP upgrade parsing; offsets are relative to the start of the message */
+
+enum {
+	WEBSOCKET_FIELD_UPGRADE,
+	WEBSOCKET_FIELD_CONNECTION,
+	WEBSOCKET_FIELD_KEY,
+	WEBSOCKET_FIELD_VERSION,
+	WEBSOCKET_FIELD_PROTOCOL,
+	WEBSOCKET_FIELD_EXTENSIONS,
+	WEBSOCKET_FIELD_ACCEPT,
+	WEBSOCKET_FIELD_COUNT
+};
+
+#define WEBSOCKET_MAXFIELDS (32)
+
+struct websocket_field {
+	unsigned short name;
+	unsigned short namelen;
+	unsigned short value;
+	unsigned short valuelen;
+};
+
+/* Resumable: call again with the same bytes plus more until it stops
+   returning WEBSOCKET_NO_DATA; scanning picks up where it left off. */
+struct websocket_http {
+	unsigned short offset;
+	unsigned short linelen;
+	unsigned char count;
+	unsigned char known[WEBSOCKET_FIELD_COUNT]; /* index + 1 into fields, 0 when absent */
+	struct websocket_field fields[WEBSOCKET_MAXFIELDS];
+};
+
+ssize_t websocket_readhttp(struct websocket_http *http, const void *src, size_t len);
+
 struct websocket_frame {
 	unsigned long long length;
 	unsigned char header[2];
@@ -88,22 +142,339 @@ ssize_t websocket_readresponse(
 	const void *src, size_t len, const unsigned char nonce[static WEBSOCKET_NONCESIZE]);
 ssize_t websocket_writeresponse(void *dst, size_t size, const void *src, size_t len);
 
+/* Answers many upgrade requests at once, hashing their keys several at a time.
+   Each result is set as websocket_writeresponse would return it; returns the
+   number of responses written. */
+struct websocket_upgrade {
+	const void *src;
+	size_t len;
+	void *dst;
+	size_t size;
+	ssize_t result;
+};
+
+size_t websocket_writeresponses(struct websocket_upgrade *upgrades, size_t count);
+
 ssize_t websocket_writeframe(void *dst, size_t size, struct websocket_frame *frame);
 ssize_t websocket_readframe(const void *src, size_t len, struct websocket_frame *frame);
 
+/* Inline header coding for when at least WEBSOCKET_FRAMEMAX bytes are there to
+   read or write; take websocket_readframe/websocket_writeframe otherwise. Each
+   field is one unaligned load or store. The role is fixed per call site, so
+   the mask branches fold away: a server reads masked frames and writes plain
+   ones, a client the other way round. Reading a frame whose mask bit does not
+   match the role gives WEBSOCKET_DATA_ERROR; frame is still filled in except
+   for the mask, so a lenient caller can fall back to websocket_readframe.
+   Being inline, they count nothing in the stats. */
+#define WEBSOCKET_FRAMEMAX (14)
+
+_websocket_alwaysinline
+ssize_t _websocket_readframe(const void *src, struct websocket_frame *frame, int masked) {
+	const unsigned char *p = (const unsigned char *) src;
+	unsigned long long len64;
+	unsigned short len16;
+	size_t off = 2;
+
+	frame->header[0] = p[0];
+	frame->header[1] = p[1];
+	frame->length = p[1] & WEBSOCKET_LENGTH;
+
+	if (frame->length == 126) {
+		memcpy(&len16, p + 2, 2);
+		frame->length = _websocket_be16(len16);
+		off = 4;
+	} else if (frame->length == 127) {
+		memcpy(&len64, p + 2, 8);
+		frame->length = _websocket_be64(len64);
+		off = 10;
+	}
+
+	if (!(p[1] & WEBSOCKET_MASK) != !masked)
+		return WEBSOCKET_DATA_ERROR;
+
+	if (masked) {
+		memcpy(frame->mask, p + off, 4);
+		off += 4;
+	}
+
+	return off;
+}
+
+_websocket_alwaysinline
+ssize_t _websocket_writeframe(void *dst, const struct websocket_frame *frame, int masked) {
+	unsigned char *p = (unsigned char *) dst;
+	unsigned long long len64;
+	unsigned short len16;
+	size_t off = 2;
+
+	p[0] = frame->header[0];
+
+	if (frame->length < 126)
+		p[1] = (unsigned char) frame->length;
+	else if (frame->length < 0x10000) {
+		p[1] = 126;
+		len16 = _websocket_be16((unsigned short) frame->length);
+		memcpy(p + 2, &len16, 2);
+		off = 4;
+	} else {
+		p[1] = 127;
+		len64 = _websocket_be64(frame->length);
+		memcpy(p + 2, &len64, 8);
+		off = 10;
+	}
+
+	if (masked) {
+		p[1] |= WEBSOCKET_MASK;
+		memcpy(p + off, frame->mask, 4);
+		off += 4;
+	}
+
+	return off;
+}
+
+_websocket_alwaysinline
+ssize_t websocket_readframe_server(const void *src, struct websocket_frame *frame) {
+	return _websocket_readframe(src, frame, 1);
+}
+
+_websocket_alwaysinline
+ssize_t websocket_readframe_client(const void *src, struct websocket_frame *frame) {
+	return _websocket_readframe(src, frame, 0);
+}
+
+_websocket_alwaysinline
+ssize_t websocket_writeframe_server(void *dst, const struct websocket_frame *frame) {
+	return _websocket_writeframe(dst, frame, 0);
+}
+
+_websocket_alwaysinline
+ssize_t websocket_writeframe_client(void *dst, const struct websocket_frame *frame) {
+	return _websocket_writeframe(dst, frame, 1);
+}
+
+/* One complete frame found by websocket_readframes; frame can be passed
+   straight to websocket_maskdata/websocket_unmaskcopy for the payload. */
+struct websocket_framedesc {
+	struct websocket_frame frame;
+	size_t offset;
+	unsigned char opcode;
+	unsigned char fin;
+	unsigned char rsv;
+	unsigned char masked;
+};
+
+ssize_t websocket_readframes(
+	const void *src, size_t len, struct websocket_framedesc *descs, size_t max);
+
 ssize_t websocket_maskdata(void *p, size_t n, const struct websocket_frame *frame, size_t off);
+ssize_t websocket_unmaskcopy(
+	void *dst, const void *src, size_t n, const struct websocket_frame *frame, size_t off);
+
+#define WEBSOCKET_UTF8_ACCEPT (0)
+#define WEBSOCKET_UTF8_REJECT (8)
+
+/* Unmask like websocket_unmaskcopy (dst may equal src) while validating the bytes
+   as UTF-8. utf8 carries the decoder state across calls and should be back at
+   WEBSOCKET_UTF8_ACCEPT at the end of a message. */
+ssize_t websocket_unmaskutf8(
+	void *dst, const void *src, size_t n, const struct websocket_frame *frame, size_t off,
+	unsigned char *utf8);
+
 ssize_t websocket_readdata(void *dst, size_t len, const void *src, size_t off, size_t size);
 ssize_t websocket_writedata(void *dst, size_t off, size_t size, const void *src, size_t len);
 
+/* kernels */
+enum {
+	WEBSOCKET_KERNEL_AUTO,
+	WEBSOCKET_KERNEL_SCALAR,
+	WEBSOCKET_KERNEL_SSE2,
+	WEBSOCKET_KERNEL_AVX2,
+	WEBSOCKET_KERNEL_NEON
+};
+
+/* Select the vector kernel used for masking and batch handshakes; AUTO probes the cpu.
+   Unsupported kernels fall back, and the kernel in effect is returned. */
+int websocket_kernel(int kernel);
+
+/* permessage-deflate (RFC 7692); negotiation is always available, compression
+   needs the library built with WEBSOCKET_DEFLATE and linked with zlib */
+
+struct websocket_deflate_params {
+	unsigned char server_no_context_takeover;
+	unsigned char client_no_context_takeover;
+	unsigned char server_max_window_bits; /* 0 when absent, else 8..15 */
+	unsigned char client_max_window_bits;
+};
+
+struct websocket_deflate_pool;
+struct websocket_deflate_slot;
+
+/* Per connection; streams are borrowed from the pool and only held across
+   messages when context takeover is in effect for that direction. */
+struct websocket_deflate {
+	struct websocket_deflate_pool *pool;
+	struct websocket_deflate_slot *inflater;
+	struct websocket_deflate_slot *deflater;
+	struct websocket_deflate_params prefs;
+	struct websocket_deflate_params params;
+	const unsigned char *out;
+	size_t outlen;
+	unsigned char server;
+	unsigned char enabled;
+	unsigned char message;
+};
+
+ssize_t websocket_writeextension(
+	void *dst, size_t off, size_t size, const struct websocket_deflate_params *params);
+ssize_t websocket_readextension(
+	const void *src, size_t len, struct websocket_deflate_params *params);
+ssize_t websocket_deflate_negotiate(
+	const struct websocket_deflate_params *offer, const struct websocket_deflate_params *prefs,
+	struct websocket_deflate_params *params);
+
+struct websocket_deflate_pool *websocket_deflate_pool_create(int level, int memlevel, size_t bufsize);
+void websocket_deflate_pool_destroy(struct websocket_deflate_pool *pool);
+
+void websocket_deflate_init(
+	struct websocket_deflate *ctx, struct websocket_deflate_pool *pool,
+	const struct websocket_deflate_params *prefs, int server);
+void websocket_deflate_release(struct websocket_deflate *ctx);
+
+ssize_t websocket_deflate_message(
+	struct websocket_deflate *ctx, unsigned char op, unsigned char mask[4],
+	void *dst, size_t size, const void *src, size_t len);
+
+/* used by websocket_update */
+void *_websocket_inflatebuf(struct websocket_deflate *ctx, size_t *size);
+void _websocket_inflateinput(struct websocket_deflate *ctx, size_t n, int final);
+ssize_t _websocket_inflate(struct websocket_deflate *ctx);
+
+/* Message reassembly: fragments are collected in buffers borrowed from the
+   pool, which go back to it once the message has been handed over. */
+
+struct websocket_pool;
+
+struct websocket_pool *websocket_pool_create(void);
+void websocket_pool_destroy(struct websocket_pool *pool);
+
+struct websocket_assembly {
+	struct websocket_pool *pool;
+	unsigned char *buf;
+	size_t len;
+	size_t size;
+	size_t maxsize;
+	unsigned char opcode;
+};
+
+void websocket_assembly_init(
+	struct websocket_assembly *assembly, struct websocket_pool *pool, size_t maxsize);
+void websocket_assembly_release(struct websocket_assembly *assembly);
+
+/* used by websocket_update */
+int _websocket_reserve(struct websocket_assembly *assembly, size_t n);
+
+/* Counters kept when the library is built with WEBSOCKET_STATS, and compiled out
+   otherwise. Each thread counts into its own set without atomics; snapshot copies
+   the calling thread's and merge adds one set to another, to total threads or
+   connections. Histogram bucket n counts values below 2^n, the last everything
+   above. Errors are indexed by their negated WEBSOCKET_* code. */
+#define WEBSOCKET_STATS_BUCKETS (32)
+
+struct websocket_stats {
+	unsigned long long framesin[16]; /* by opcode */
+	unsigned long long bytesin[16];
+	unsigned long long framesout[16];
+	unsigned long long bytesout[16];
+	unsigned long long masked; /* payload bytes masked or unmasked */
+	unsigned long long yields[8]; /* websocket_update returns by error, [0] at close */
+	unsigned long long handshakes;
+	unsigned long long handshakeerrors[8];
+	unsigned long long framesize[WEBSOCKET_STATS_BUCKETS]; /* received payload bytes */
+	unsigned long long handlertime[WEBSOCKET_STATS_BUCKETS]; /* nanoseconds per call */
+};
+
+void websocket_stats_snapshot(struct websocket_stats *stats);
+void websocket_stats_merge(struct websocket_stats *dst, const struct websocket_stats *src);
+
+/* used by the engine for the headers it writes with the inline coders */
+void _websocket_countout(const struct websocket_frame *frame);
+
+/* Client side: frames a client sends must be masked with a fresh, unpredictable
+   key each (RFC 6455 10.3). The generator is ChaCha20 keyed once from the OS, so
+   a mask costs no system call. Not locked; keep one per connection or thread. */
+struct websocket_random {
+	unsigned char key[32];
+	unsigned long long counter;
+	unsigned char buf[64];
+	unsigned used;
+};
+
+int websocket_random_init(struct websocket_random *random);
+void websocket_random_bytes(struct websocket_random *random, void *dst, size_t len);
+
+/* websocket_message with a key from random, masked as the payload is copied */
+ssize_t websocket_clientmessage(
+	struct websocket_random *random, unsigned char op, void *dst, size_t size,
+	const void *src, size_t len);
+
+/* Set as websocket_state.client for websocket_update to play the client: it writes
+   the request, checks the response against nonce, and masks the frames it sends.
+   Initialization seeds random and draws the nonce from it; uri and fields are
+   used as given, as by websocket_writerequest. */
+struct websocket_client {
+	struct websocket_random random;
+	unsigned char nonce[WEBSOCKET_NONCESIZE];
+	const char *uri;
+	const char **fields;
+	size_t count;
+};
+
+int websocket_client_init(
+	struct websocket_client *client, const char *uri, const char *fields[], size_t count);
+
 /* High-level state machine api */
 
 typedef ssize_t (*websocket_handler_t)(
 	int op, void *dst, size_t size, const void *src, size_t len, void *userdata);
 
 struct websocket_state {
-	size_t offset;
 	struct websocket_frame frame;
+	size_t offset;
+	size_t count;
 	unsigned short co;
+	unsigned char text;
+	unsigned char utf8;
+	unsigned char fragmented;
+	/* Set while waiting for a frame outside a fragmented message, once upgraded:
+	   the points where a server may put frames of its own on the wire. */
+	unsigned char idle;
+	unsigned char upgraded; /* handshake over, or never wanted */
+
+	/* Handshake-only parse state, cleared once the upgrade has been answered;
+	   the caller owns it and may hand it to the next connection from there.
+	   Without it the request is parsed again on every call until complete. */
+	struct websocket_http *http;
+
+	/* When set, payload is unmasked into data (at most datasize bytes at a time)
+	   and handed to the handler from there; src is then never written. */
+	void *data;
+	size_t datasize;
+
+	/* When set, permessage-deflate is negotiated during the handshake and
+	   compressed messages are inflated before they reach the handler. */
+	struct websocket_deflate *deflate;
+
+	/* When set, fragments are reassembled and the handler sees each message
+	   once, whole, with the opcode of its first frame. */
+	struct websocket_assembly *assembly;
+
+	/* When set, the connection is the client end; send with websocket_clientmessage
+	   and client->random from the handler too. */
+	struct websocket_client *client;
+
+	/* When set, what websocket_update counts for this connection is added here
+	   as well as to the thread's stats; frames written are only counted there. */
+	struct websocket_stats *stats;
 };
 
 _websocket_alwaysinline
@@ -111,6 +482,18 @@ void websocket_state_init(struct websocket_state *state) {
 	*state = (struct websocket_state) {0};
 }
 
+/* Keeps the handshake parse in http between calls, so a request that trickles in
+   is read once; NULL skips the handshake for a connection already upgraded. */
+_websocket_alwaysinline
+void websocket_state_init_http(struct websocket_state *state, struct websocket_http *http) {
+	*state = (struct websocket_state) {0};
+	state->http = http;
+	state->upgraded = http == NULL;
+
+	if (http)
+		*http = (struct websocket_http) {0};
+}
+
 struct websocket_result websocket_update(
 	struct websocket_state *state, void *dst, size_t size, const void *src, size_t len,
 	websocket_handler_t handler, void *userdata);
@@ -119,6 +502,362 @@ ssize_t websocket_message(
 	unsigned char op, unsigned char mask[4], void *dst, size_t size,
 	const void *src, size_t len);
 
+#if !_WIN32
+/* Unmasked messages for writev/sendmsg: only the header is written to dst,
+   iov points at it and at the caller's payload, which is never copied. */
+ssize_t websocket_messagev(
+	unsigned char op, void *dst, size_t size, const void *src, size_t len, struct iovec iov[2]);
+
+/* Encode count messages; headers are packed into dst and iov needs room for
+   2 * count entries. Returns the number of iov entries used. */
+ssize_t websocket_messagesv(
+	const unsigned char *ops, void *dst, size_t size, const struct iovec *src, size_t count,
+	struct iovec *iov);
+#endif
+
+/* Hierarchical timing wheel for many timers at coarse resolution: time is in
+   ticks of the caller's choosing and expiry is accurate to one tick. Timers are
+   intrusive, adding and cancelling are O(1) whatever the number pending, and a
+   timer further out than 2^24 ticks is clamped to that. */
+#define WEBSOCKET_WHEEL_BITS (6)
+#define WEBSOCKET_WHEEL_LEVELS (4)
+
+struct websocket_timer {
+	struct websocket_timer *next;
+	struct websocket_timer **pprev;
+	unsigned expires;
+};
+
+struct websocket_wheel {
+	unsigned now;
+	size_t count;
+	struct websocket_timer *slots[WEBSOCKET_WHEEL_LEVELS][1 << WEBSOCKET_WHEEL_BITS];
+};
+
+void websocket_wheel_init(struct websocket_wheel *wheel, unsigned now);
+void websocket_wheel_add(struct websocket_wheel *wheel, struct websocket_timer *timer, unsigned expires);
+
+/* Move time forward to now and return every timer that expired on the way,
+   linked through next and no longer pending, for the caller to run in one pass. */
+struct websocket_timer *websocket_wheel_advance(struct websocket_wheel *wheel, unsigned now);
+
+_websocket_alwaysinline
+int websocket_timer_pending(const struct websocket_timer *timer) {
+	return timer->pprev != 0;
+}
+
+_websocket_alwaysinline
+void websocket_wheel_cancel(struct websocket_wheel *wheel, struct websocket_timer *timer) {
+	if (timer->pprev) {
+		if ((*timer->pprev = timer->next))
+			timer->next->pprev = timer->pprev;
+		timer->pprev = 0;
+		wheel->count--;
+	}
+}
+
+#if __linux__
+/* Receive ring mapped twice back to back, so the buffered bytes are contiguous even
+   where they wrap: websocket_ring_data can go straight to websocket_update or
+   websocket_readframe as src, and consumed bytes are never moved. The size is
+   rounded up to whole pages; a frame only has to fit if it is parsed whole. */
+struct websocket_ring {
+	unsigned char *base;
+	size_t size;
+	size_t head;
+	size_t tail;
+};
+
+int websocket_ring_init(struct websocket_ring *ring, size_t size);
+void websocket_ring_release(struct websocket_ring *ring);
+
+/* buffered bytes start here */
+_websocket_alwaysinline
+unsigned char *websocket_ring_data(const struct websocket_ring *ring) {
+	return ring->base + ring->head;
+}
+
+_websocket_alwaysinline
+size_t websocket_ring_len(const struct websocket_ring *ring) {
+	return ring->tail - ring->head;
+}
+
+/* free space to receive into starts here */
+_websocket_alwaysinline
+unsigned char *websocket_ring_space(const struct websocket_ring *ring) {
+	return ring->base + ring->tail;
+}
+
+_websocket_alwaysinline
+size_t websocket_ring_avail(const struct websocket_ring *ring) {
+	return ring->size - (ring->tail - ring->head);
+}
+
+_websocket_alwaysinline
+void websocket_ring_produce(struct websocket_ring *ring, size_t n) {
+	ring->tail += n;
+}
+
+_websocket_alwaysinline
+void websocket_ring_consume(struct websocket_ring *ring, size_t n) {
+	if ((ring->head += n) >= ring->size) {
+		ring->head -= ring->size;
+		ring->tail -= ring->size;
+	}
+}
+
+/* Connection engine: an io_uring or edge-triggered epoll loop that owns every
+   connection and drives it through websocket_update. Not locked; run one server
+   per thread. */
+
+struct websocket_server;
+struct websocket_conn;
+struct websocket_uring;
+
+/* A frame encoded once and shared by reference; server frames are unmasked, so
+   the bytes are the same on every socket. Freed when the last holder lets go. */
+struct websocket_shared;
+
+struct websocket_shared *websocket_shared_create(unsigned char op, const void *src, size_t len);
+void websocket_shared_retain(struct websocket_shared *shared, unsigned n);
+void websocket_shared_release(struct websocket_shared *shared);
+
+/* Worker threads for handlers too slow to run on an i/o thread. Each worker has
+   a deque of its own and steals from the others' when it runs dry; i/o threads
+   hand work over without taking locks and never wait for the pool. One pool can
+   serve every server in the process. nthreads 0 runs one per processor; destroy
+   the pool after the servers that use it have been released. */
+struct websocket_workers;
+
+struct websocket_workers *websocket_workers_create(unsigned nthreads);
+void websocket_workers_destroy(struct websocket_workers *workers);
+
+/* A whole message, copied off its connection for params.work and valid until
+   work returns. A connection's messages are worked on one at a time, in the
+   order they arrived, though not always by the same thread. */
+struct websocket_job {
+	struct websocket_job *next; /* private */
+	struct websocket_strand *strand; /* private */
+	void *userdata; /* the connection's, when the message arrived */
+	unsigned id; /* the connection's */
+	unsigned char op; /* of the first frame */
+	unsigned char *data;
+	size_t len;
+};
+
+/* From work: queue a message or a close for the job's connection. Replies are
+   sent in the order they are made, once the connection's i/o thread gets to
+   them, and dropped if the connection has gone by then. */
+int websocket_job_reply(struct websocket_job *job, unsigned char op, const void *src, size_t len);
+int websocket_job_close(struct websocket_job *job);
+
+/* used by the connection engine */
+struct websocket_strand;
+struct websocket_mailbox;
+
+#define _WEBSOCKET_REPLY_SEND (1)
+#define _WEBSOCKET_REPLY_CLOSE (2)
+#define _WEBSOCKET_REPLY_RESUME (3)
+
+struct websocket_mailbox *_websocket_mailbox_create(
+	struct websocket_workers *workers, void (*work)(struct websocket_job *job), size_t lowwater);
+void _websocket_mailbox_destroy(struct websocket_mailbox *mailbox);
+int _websocket_mailbox_fd(const struct websocket_mailbox *mailbox);
+int _websocket_mailbox_pop(
+	struct websocket_mailbox *mailbox, struct websocket_conn **owner, struct websocket_shared **shared);
+struct websocket_strand *_websocket_strand_create(struct websocket_mailbox *mailbox, struct websocket_conn *owner);
+void _websocket_strand_close(struct websocket_strand *strand);
+int _websocket_strand_full(struct websocket_strand *strand, size_t highwater);
+void _websocket_strand_submit(struct websocket_strand *strand, struct websocket_job *job);
+
+/* Records come from slabs and keep their id for life. The first cache line holds
+   what every event touches; in, out and state.http are borrowed from the server
+   only while in use, so an idle connection costs its record and nothing more.
+   That is 280 bytes on LP64, 96 of them the parser state: it stays inline since
+   websocket_update reads it on every event, and its hooks are public fields. */
+struct websocket_conn {
+	int fd;
+	unsigned char closing;
+	unsigned char queued;
+	unsigned char sending; /* io_uring */
+	unsigned char armed; /* io_uring */
+	unsigned inoff;
+	unsigned inlen;
+	unsigned outoff;
+	unsigned outlen;
+	unsigned char *in;
+	unsigned char *out;
+	struct websocket_conn *next;
+	struct websocket_server *server;
+	unsigned inflight; /* io_uring */
+	unsigned short bufindex; /* io_uring */
+	unsigned char paused; /* reading stopped at the high watermark */
+	unsigned char cork;
+
+	struct websocket_state state;
+	struct websocket_shared **queue;
+	size_t qbytes; /* queue depth, counting what is left of the first frame */
+	size_t qoff;
+	unsigned qhead;
+	unsigned qcount;
+	unsigned qsize;
+	unsigned id;
+	unsigned index; /* in server->conns, moves as others close */
+	struct websocket_timer timer; /* the one deadline pending, if any */
+	unsigned seen; /* tick input last arrived */
+	unsigned char deadline;
+	unsigned char qsending; /* io_uring: queued frames in flight */
+	struct websocket_strand *strand; /* with work, made for the first message */
+	unsigned corkat; /* microsecond clock, when corked output has to go */
+	/* io_uring backend */
+	int held;
+	int heldtail;
+	unsigned heldoff;
+	void *qmsg; /* the sendmsg of the queued frames in flight */
+	void *userdata;
+};
+
+#define WEBSOCKET_SERVER_EPOLL (1) /* never try io_uring */
+#define WEBSOCKET_SERVER_EVICT (2) /* close connections over maxqueue instead of dropping */
+
+/* The handler is called with the connection as userdata. Zero sizes pick defaults.
+
+   Output the socket does not take at once is queued per connection. Once the queue
+   reaches highwater the connection stops reading at the next message boundary and
+   pressure is called with paused set; it is called again with paused clear when
+   the queue has drained to lowwater. Messages that would take a queue past maxqueue
+   (0 for no limit) are dropped, or the connection is closed with EVICT.
+
+   Deadlines are in milliseconds, rounded up to whole ticks, and zero turns one
+   off. A connection is dropped when its handshake takes longer than handshake,
+   or when it still has output left linger after it started closing. After
+   pinginterval without input a ping is sent; a connection that stays silent for
+   pongtimeout more (pinginterval when zero) is dropped.
+
+   With work set the handler is not called. Each message is reassembled, up to
+   maxmessage bytes (1 MiB when zero), and handed to work on workers; replies
+   come back through websocket_job_reply. A connection stops reading while more
+   than highwater of its messages wait for the workers, until lowwater.
+
+   Messages queued with websocket_conn_send, websocket_broadcast and
+   websocket_conn_sendfile are cut into frames of fragsize payload bytes (64 KiB
+   when zero). Pings and pongs overtake queued data at the next frame boundary,
+   and pings are answered from input while queued data holds up the parser, so
+   keepalive only waits for the frames already being written, however much is
+   queued. A close, sent or from websocket_conn_close, goes out behind every
+   message already taken and nothing more is taken after it; only
+   websocket_conn_abort, or EVICT, drops queued frames not yet started.
+
+   With corkus set, output queued from outside the handler is held back so that
+   more can join it in one write: until corkbytes (outsize when zero) are waiting,
+   or for corkus microseconds at most. Input, control frames, closing and
+   websocket_conn_flush send it at once. */
+struct websocket_server_params {
+	websocket_handler_t handler;
+	void (*work)(struct websocket_job *job);
+	struct websocket_workers *workers;
+	void (*open)(struct websocket_conn *conn);
+	void (*close)(struct websocket_conn *conn);
+	void (*pressure)(struct websocket_conn *conn, int paused);
+	size_t insize;
+	size_t outsize;
+	size_t highwater;
+	size_t lowwater;
+	size_t maxqueue;
+	size_t maxmessage;
+	size_t fragsize;
+	size_t corkbytes;
+	unsigned corkus;
+	unsigned tick;
+	unsigned handshake;
+	unsigned linger;
+	unsigned pinginterval;
+	unsigned pongtimeout;
+	unsigned flags;
+};
+
+struct websocket_server {
+	int epfd;
+	int lfd;
+	struct websocket_server_params params;
+	struct websocket_conn **conns;
+	size_t count;
+	size_t capacity;
+	struct websocket_conn *pending;
+	struct websocket_conn *corked;
+	unsigned corkdue; /* the first corked connection's corkat */
+	struct websocket_uring *uring;
+	void *events;
+	void *userdata;
+	struct websocket_conn **slabs;
+	unsigned nslabs;
+	struct websocket_conn *freeconns;
+	void *freein;
+	void *freeout;
+	void *freehttp;
+	/* output queues */
+	size_t qbytes; /* queued on every connection together */
+	size_t npaused; /* connections at their high watermark */
+	unsigned long long ndropped; /* messages refused at maxqueue */
+	unsigned long long nevicted; /* connections closed at maxqueue */
+	unsigned long long nsends; /* write system calls, or sends on the ring */
+	struct websocket_wheel wheel; /* one timer per connection, in ticks */
+	/* with work */
+	struct websocket_mailbox *mailbox;
+	struct websocket_pool *pool; /* reassembly buffers */
+};
+
+/* lfd is a listening socket, or -1 to only serve adopted connections. Uses io_uring
+   where the kernel supports it and epoll otherwise; with io_uring, init and poll
+   must run on the same thread and SIGPIPE must be ignored. */
+int websocket_server_init(
+	struct websocket_server *server, int lfd, const struct websocket_server_params *params);
+void websocket_server_release(struct websocket_server *server);
+
+/* Take over a connected socket; the server closes it when done. */
+int websocket_server_adopt(struct websocket_server *server, int fd);
+
+/* The live connection with the given id, which never changes while it is open. */
+struct websocket_conn *websocket_server_conn(struct websocket_server *server, unsigned id);
+
+/* Wait at most timeout ms (-1 blocks) and service whatever is ready.
+   Returns the number of events handled. */
+int websocket_server_poll(struct websocket_server *server, int timeout);
+
+/* Queue a message and flush it before the next wait. Use dst instead from inside
+   the handler, which owns the output buffer while it runs. Messages that do not
+   fit the output buffer go on the queue, subject to maxqueue. */
+ssize_t websocket_conn_send(struct websocket_conn *conn, unsigned char op, const void *src, size_t len);
+
+/* Close once what is queued has gone out; sends are refused from here. */
+void websocket_conn_close(struct websocket_conn *conn);
+
+/* Close without waiting: queued frames not yet started are dropped, and only
+   the ones partly written are finished so the peer never sees half a frame. */
+void websocket_conn_abort(struct websocket_conn *conn);
+
+/* Send what is queued at the next poll, corked or not. */
+void websocket_conn_flush(struct websocket_conn *conn);
+
+/* Queue a reference to shared, sent between messages once the connection is
+   upgraded. Messages from websocket_conn_send keep their order with these. */
+int websocket_conn_sendshared(struct websocket_conn *conn, struct websocket_shared *shared);
+
+/* Queue len bytes of fd from off as one message of type op, in fragments of
+   params.fragsize. Only frame headers are written here; the payload goes from
+   the file to the socket with sendfile, so fd must support it and keep its size
+   until sent. fd is duplicated and may be closed on return. The message is
+   queued whole or not at all; returns the bytes it takes on the wire. */
+ssize_t websocket_conn_sendfile(struct websocket_conn *conn, unsigned char op, int fd, off_t off, size_t len);
+
+/* Encode once, fragmented by the params of server, and queue on every connection
+   of it; returns how many took it. Connections of other servers are passed over.
+   A message is queued on a connection whole or not at all. */
+size_t websocket_broadcast(
+	struct websocket_server *server, struct websocket_conn *const *conns, size_t count,
+	unsigned char op, const void *src, size_t len);
+#endif
+
 #ifdef __cplusplus
 } /* extern "C" */
 #endif
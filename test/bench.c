@@ -0,0 +1,710 @@
+
+#ifndef _nofeatures
+# if _WIN32
+#  define WIN32_LEAN_AND_MEAN 1
+# elif __linux__
+#  define _BSD_SOURCE 1
+#  define _DEFAULT_SOURCE 1
+#  define _POSIX_C_SOURCE 200809L
+#  define _SVID_SOURCE 1
+# elif __APPLE__
+#  define _DARWIN_C_SOURCE 1
+# endif
+#endif /* _nofeatures */
+
+#include "aw-websocket.h"
+#if __GNUC__ && (__x86_64__ || __i386__)
+# include <x86intrin.h>
+# define cycles() __rdtsc()
+#else
+# define cycles() 0ull
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAXRESULTS (64)
+#define RUNS (5)
+
+typedef void (bench_fn)(void *ctx, unsigned long long iters);
+
+struct result {
+	char name[64];
+	double ns;
+	double gbs;
+};
+
+static struct result results[MAXRESULTS];
+static size_t nresults;
+static double mintime = 1e8;
+
+static const char *kernel_names[] = {
+	"auto", "scalar", "sse2", "avx2", "neon"
+};
+
+static const char request[] =
+	"GET /chat HTTP/1.1\r\n"
+	"Host: server.example.com\r\n"
+	"Upgrade: websocket\r\n"
+	"Connection: Upgrade\r\n"
+	"Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+	"Origin: http://example.com\r\n"
+	"Sec-WebSocket-Protocol: chat, superchat\r\n"
+	"Sec-WebSocket-Version: 13\r\n"
+	"\r\n";
+
+static unsigned char mask[4] = {0x37, 0xfa, 0x21, 0x3d};
+
+static double now(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* Calibrate so one run takes at least mintime, then keep the best of RUNS. */
+static void run(const char *name, bench_fn *fn, void *ctx, size_t bytes) {
+	struct result *r;
+	unsigned long long iters = 1, c, best_c = 0;
+	double t, best = 0.;
+	int i;
+
+	for (;;) {
+		t = now();
+		fn(ctx, iters);
+		if ((t = now() - t) >= mintime / 10)
+			break;
+		iters *= 2;
+	}
+
+	iters = (unsigned long long) (iters * (mintime / t)) + 1;
+
+	for (i = 0; i < RUNS; ++i) {
+		t = now();
+		c = cycles();
+		fn(ctx, iters);
+		c = cycles() - c;
+		t = now() - t;
+
+		if (i == 0 || t < best)
+			best = t, best_c = c;
+	}
+
+	if (nresults == MAXRESULTS)
+		return;
+
+	r = &results[nresults++];
+	snprintf(r->name, sizeof r->name, "%s", name);
+	r->ns = best / iters;
+	r->gbs = bytes ? (double) bytes * iters / best : 0.;
+
+	printf("%-32s %12.2f ns/op %12.0f op/s", r->name, r->ns, 1e9 / r->ns);
+	if (bytes)
+		printf(" %8.2f GB/s", r->gbs);
+	if (bytes && best_c)
+		printf(" %6.2f B/cycle", (double) bytes * iters / best_c);
+	printf("\n");
+}
+
+struct mask_ctx {
+	struct websocket_frame frame;
+	unsigned char *p;
+	size_t n;
+};
+
+static void bench_mask(void *ctx, unsigned long long iters) {
+	struct mask_ctx *m = ctx;
+	unsigned long long i;
+
+	for (i = 0; i < iters; ++i)
+		websocket_maskdata(m->p, m->n, &m->frame, i);
+}
+
+struct utf8_ctx {
+	struct websocket_frame frame;
+	unsigned char *dst;
+	const unsigned char *src;
+	size_t n;
+};
+
+static void bench_unmaskcopy(void *ctx, unsigned long long iters) {
+	struct utf8_ctx *u = ctx;
+	unsigned long long i;
+
+	for (i = 0; i < iters; ++i)
+		websocket_unmaskcopy(u->dst, u->src, u->n, &u->frame, 0);
+}
+
+static void bench_unmaskutf8(void *ctx, unsigned long long iters) {
+	struct utf8_ctx *u = ctx;
+	unsigned long long i;
+	unsigned char state;
+
+	for (i = 0; i < iters; ++i) {
+		state = WEBSOCKET_UTF8_ACCEPT;
+		websocket_unmaskutf8(u->dst, u->src, u->n, &u->frame, 0, &state);
+	}
+}
+
+/* ascii text, or text where every eighth character is a two byte one */
+static void setup_text(unsigned char *p, size_t n, int mixed, const unsigned char mask[4]) {
+	size_t i;
+
+	for (i = 0; i < n; ++i)
+		p[i] = (unsigned char) ('a' + i % 26);
+
+	if (mixed)
+		for (i = 0; i + 1 < n; i += 8) {
+			p[i] = 0xc3;
+			p[i + 1] = 0xa9;
+		}
+
+	for (i = 0; i < n; ++i)
+		p[i] ^= mask[i & 3];
+}
+
+struct frame_ctx {
+	struct websocket_frame frame;
+	unsigned char buf[16];
+	size_t len;
+};
+
+static void bench_writeframe(void *ctx, unsigned long long iters) {
+	struct frame_ctx *f = ctx;
+	struct websocket_frame frame;
+	unsigned long long i;
+
+	for (i = 0; i < iters; ++i) {
+		frame = f->frame;
+		websocket_writeframe(f->buf, sizeof f->buf, &frame);
+	}
+}
+
+static void bench_readframe(void *ctx, unsigned long long iters) {
+	struct frame_ctx *f = ctx;
+	unsigned long long i;
+
+	for (i = 0; i < iters; ++i)
+		websocket_readframe(f->buf, f->len, &f->frame);
+}
+
+static void bench_writeframe_inline(void *ctx, unsigned long long iters) {
+	struct frame_ctx *f = ctx;
+	unsigned long long i;
+
+	for (i = 0; i < iters; ++i)
+		websocket_writeframe_client(f->buf, &f->frame);
+}
+
+static void bench_readframe_inline(void *ctx, unsigned long long iters) {
+	struct frame_ctx *f = ctx;
+	unsigned long long i;
+
+	for (i = 0; i < iters; ++i)
+		websocket_readframe_server(f->buf, &f->frame);
+}
+
+struct frames_ctx {
+	unsigned char *src;
+	size_t len;
+	struct websocket_framedesc descs[256];
+};
+
+static void bench_readframes(void *ctx, unsigned long long iters) {
+	struct frames_ctx *f = ctx;
+	unsigned long long i;
+	size_t off, n;
+
+	for (i = 0; i < iters; ++i)
+		for (off = 0; (n = websocket_readframes(f->src + off, f->len - off, f->descs, 256)) > 0;)
+			off = off + f->descs[n - 1].offset + f->descs[n - 1].frame.length;
+}
+
+static void bench_readframe_loop(void *ctx, unsigned long long iters) {
+	struct frames_ctx *f = ctx;
+	struct websocket_frame frame;
+	unsigned long long i;
+	ssize_t err;
+	size_t off;
+
+	for (i = 0; i < iters; ++i)
+		for (off = 0; (err = websocket_readframe(f->src + off, f->len - off, &frame)) >= 0;)
+			off += err + frame.length;
+}
+
+struct message_ctx {
+	unsigned char *dst;
+	size_t size;
+	const unsigned char *src;
+	size_t len;
+	unsigned char *mask;
+	struct websocket_random random;
+};
+
+static void bench_message(void *ctx, unsigned long long iters) {
+	struct message_ctx *m = ctx;
+	unsigned long long i;
+
+	for (i = 0; i < iters; ++i)
+		websocket_message(WEBSOCKET_FIN | WEBSOCKET_BINARY, m->mask, m->dst, m->size, m->src, m->len);
+}
+
+static void bench_clientmessage(void *ctx, unsigned long long iters) {
+	struct message_ctx *m = ctx;
+	unsigned long long i;
+
+	for (i = 0; i < iters; ++i)
+		websocket_clientmessage(&m->random, WEBSOCKET_FIN | WEBSOCKET_BINARY, m->dst, m->size, m->src, m->len);
+}
+
+static void bench_messagev(void *ctx, unsigned long long iters) {
+	struct message_ctx *m = ctx;
+	struct iovec iov[2];
+	unsigned long long i;
+
+	for (i = 0; i < iters; ++i)
+		websocket_messagev(WEBSOCKET_FIN | WEBSOCKET_BINARY, m->dst, m->size, m->src, m->len, iov);
+}
+
+static void bench_writeresponse(void *ctx, unsigned long long iters) {
+	unsigned char buf[512];
+	unsigned long long i;
+
+	(void) ctx;
+
+	for (i = 0; i < iters; ++i)
+		websocket_writeresponse(buf, sizeof buf, request, sizeof request - 1);
+}
+
+#define UPGRADES (64)
+
+struct upgrade_ctx {
+	struct websocket_upgrade upgrades[UPGRADES];
+	char requests[UPGRADES][512];
+	unsigned char responses[UPGRADES][256];
+};
+
+/* one iteration is one handshake, so op/s reads as handshakes per second */
+static void bench_handshake(void *ctx, unsigned long long iters) {
+	struct upgrade_ctx *u = ctx;
+	unsigned long long i;
+	size_t j;
+
+	for (i = 0; i < iters; ++i) {
+		j = i % UPGRADES;
+		websocket_writeresponse(
+			u->responses[j], sizeof u->responses[j], u->requests[j], u->upgrades[j].len);
+	}
+}
+
+static void bench_handshakes(void *ctx, unsigned long long iters) {
+	struct upgrade_ctx *u = ctx;
+	unsigned long long i;
+
+	for (i = 0; i < iters; i += UPGRADES)
+		websocket_writeresponses(u->upgrades, UPGRADES);
+}
+
+static void setup_upgrades(struct upgrade_ctx *u) {
+	int n;
+	size_t i;
+
+	for (i = 0; i < UPGRADES; ++i) {
+		/* the last key is not 24 characters and takes the single request path */
+		n = snprintf(u->requests[i], sizeof u->requests[i],
+			"GET /chat HTTP/1.1\r\n"
+			"Host: server.example.com\r\n"
+			"Upgrade: websocket\r\n"
+			"Connection: Upgrade\r\n"
+			"Sec-WebSocket-Key: dGhlIHNhbXBsZSBu%06zu%s\r\n"
+			"Sec-WebSocket-Version: 13\r\n"
+			"\r\n", i, i + 1 < UPGRADES ? "==" : "AAAAAA==");
+
+		u->upgrades[i].src = u->requests[i];
+		u->upgrades[i].len = n;
+		u->upgrades[i].dst = u->responses[i];
+		u->upgrades[i].size = sizeof u->responses[i];
+	}
+}
+
+/* Every hashing kernel must produce byte for byte what websocket_writeresponse does. */
+static int check_upgrades(struct upgrade_ctx *u) {
+	unsigned char buf[256];
+	ssize_t n;
+	size_t i;
+	int k;
+
+	for (k = WEBSOCKET_KERNEL_SCALAR; k <= WEBSOCKET_KERNEL_NEON; ++k) {
+		if (websocket_kernel(k) != k)
+			continue;
+
+		if (websocket_writeresponses(u->upgrades, UPGRADES) != UPGRADES)
+			return fprintf(stderr, "writeresponses/%s: failed\n", kernel_names[k]), -1;
+
+		for (i = 0; i < UPGRADES; ++i) {
+			n = websocket_writeresponse(buf, sizeof buf, u->requests[i], u->upgrades[i].len);
+
+			if (n != u->upgrades[i].result || memcmp(buf, u->responses[i], n) != 0)
+				return fprintf(stderr, "writeresponses/%s: mismatch at %zu\n", kernel_names[k], i), -1;
+		}
+	}
+
+	websocket_kernel(WEBSOCKET_KERNEL_AUTO);
+	return 0;
+}
+
+struct update_ctx {
+	struct websocket_state state;
+	struct websocket_http http;
+	unsigned char *src;
+	size_t len;
+	unsigned char out[256];
+	unsigned char data[16384];
+};
+
+static ssize_t discard(
+		int op, void *dst, size_t size, const void *src, size_t len, void *userdata) {
+	(void) op;
+	(void) dst;
+	(void) size;
+	(void) src;
+	(void) len;
+	(void) userdata;
+	return 0;
+}
+
+static void bench_update(void *ctx, unsigned long long iters) {
+	struct update_ctx *u = ctx;
+	struct websocket_state state;
+	unsigned long long i;
+
+	for (i = 0; i < iters; ++i) {
+		state = u->state;
+		websocket_update(&state, u->out, sizeof u->out, u->src, u->len, &discard, NULL);
+	}
+}
+
+static size_t setup_update(struct update_ctx *u, size_t count, size_t n) {
+	unsigned char *payload;
+	size_t i, size = count * (n + 14);
+	ssize_t err;
+
+	if ((u->src = malloc(size)) == NULL || (payload = calloc(1, n)) == NULL)
+		return fprintf(stderr, "malloc failed\n"), 0;
+
+	for (u->len = 0, i = 0; i < count; ++i) {
+		if ((err = websocket_message(
+				WEBSOCKET_FIN | WEBSOCKET_BINARY, mask, u->src + u->len, size - u->len,
+				payload, n)) < 0)
+			return fprintf(stderr, "websocket_message err=%zd\n", err), 0;
+		u->len += err;
+	}
+
+	/* run the handshake once and start every iteration from the upgraded state */
+	websocket_state_init_http(&u->state, &u->http);
+	u->state.data = u->data;
+	u->state.datasize = sizeof u->data;
+	websocket_update(&u->state, u->out, sizeof u->out, request, sizeof request - 1, &discard, NULL);
+
+	free(payload);
+	return count * n;
+}
+
+#if __linux__
+#define STREAMSIZE (16384)
+#define STREAMREAD (1448)
+
+/* Frames arrive a segment at a time and are parsed whole, as test/ioloop does. */
+struct stream_ctx {
+	const unsigned char *src;
+	size_t len;
+	unsigned char *buf;
+	struct websocket_ring ring;
+	struct websocket_framedesc descs[64];
+};
+
+static size_t stream_parse(struct stream_ctx *s, const unsigned char *p, size_t n) {
+	size_t off = 0, k;
+
+	while ((k = websocket_readframes(p + off, n - off, s->descs, 64)) > 0)
+		off += s->descs[k - 1].offset + s->descs[k - 1].frame.length;
+
+	return off;
+}
+
+static void bench_stream_memmove(void *ctx, unsigned long long iters) {
+	struct stream_ctx *s = ctx;
+	unsigned long long i;
+	size_t srcoff, off, n, k;
+
+	for (i = 0; i < iters; ++i)
+		for (srcoff = 0, off = 0, n = 0; srcoff < s->len; srcoff += k) {
+			memmove(s->buf, s->buf + off, n);
+			k = s->len - srcoff < STREAMREAD ? s->len - srcoff : STREAMREAD;
+			memcpy(s->buf + n, s->src + srcoff, k);
+			n += k;
+			off = stream_parse(s, s->buf, n);
+			n -= off;
+		}
+}
+
+static void bench_stream_ring(void *ctx, unsigned long long iters) {
+	struct stream_ctx *s = ctx;
+	unsigned long long i;
+	size_t srcoff, k;
+
+	for (i = 0; i < iters; ++i)
+		for (srcoff = 0; srcoff < s->len; srcoff += k) {
+			k = s->len - srcoff < STREAMREAD ? s->len - srcoff : STREAMREAD;
+			memcpy(websocket_ring_space(&s->ring), s->src + srcoff, k);
+			websocket_ring_produce(&s->ring, k);
+			websocket_ring_consume(&s->ring,
+				stream_parse(s, websocket_ring_data(&s->ring), websocket_ring_len(&s->ring)));
+		}
+}
+#endif
+
+static int write_json(const char *path) {
+	FILE *f;
+	size_t i;
+
+	if ((f = fopen(path, "w")) == NULL)
+		return fprintf(stderr, "%s: cannot open\n", path), -1;
+
+	fprintf(f, "{\n\t\"results\": [\n");
+	for (i = 0; i < nresults; ++i)
+		fprintf(f, "\t\t{\"name\": \"%s\", \"ns_per_op\": %.3f, \"gb_per_s\": %.3f}%s\n",
+			results[i].name, results[i].ns, results[i].gbs, i + 1 < nresults ? "," : "");
+	fprintf(f, "\t]\n}\n");
+
+	return fclose(f);
+}
+
+static int compare_json(const char *path, double tolerance) {
+	FILE *f;
+	char line[256], name[64];
+	double ns, gbs;
+	int regressions = 0;
+	size_t i;
+
+	if ((f = fopen(path, "r")) == NULL)
+		return fprintf(stderr, "%s: cannot open\n", path), -1;
+
+	while (fgets(line, sizeof line, f) != NULL) {
+		if (sscanf(line, " {\"name\": \"%63[^\"]\", \"ns_per_op\": %lf, \"gb_per_s\": %lf}",
+				name, &ns, &gbs) != 3)
+			continue;
+
+		for (i = 0; i < nresults; ++i)
+			if (strcmp(results[i].name, name) == 0)
+				break;
+
+		if (i == nresults)
+			continue;
+
+		if (results[i].ns > ns * (1. + tolerance)) {
+			printf("REGRESSION %-32s %12.2f -> %12.2f ns/op (%+.1f%%)\n",
+				name, ns, results[i].ns, (results[i].ns / ns - 1.) * 100.);
+			++regressions;
+		}
+	}
+
+	fclose(f);
+	return regressions;
+}
+
+static void usage(const char *argv0) {
+	fprintf(stderr,
+		"usage: %s [-q] [-o results.json] [-c baseline.json] [-t tolerance]\n"
+		"  -q  quick runs (less stable numbers)\n"
+		"  -o  write results as json\n"
+		"  -c  compare against a baseline and exit non-zero on regression\n"
+		"  -t  allowed slowdown as a fraction (default 0.10)\n", argv0);
+	exit(2);
+}
+
+int main(int argc, char *argv[]) {
+	static const size_t mask_sizes[] = {16, 1024, 1024 * 1024};
+	static const unsigned long long frame_lengths[] = {100, 1000, 100000};
+	static const char *frame_names[] = {"7bit", "16bit", "64bit"};
+	const char *output = NULL, *baseline = NULL;
+	double tolerance = .10;
+	char name[64];
+	struct mask_ctx m;
+	struct utf8_ctx t;
+	struct frame_ctx f;
+	struct message_ctx msg;
+	struct frames_ctx fs;
+	struct update_ctx *u;
+	struct upgrade_ctx *up;
+#if __linux__
+	struct stream_ctx *st;
+#endif
+	unsigned char *p;
+	size_t i, n;
+	int k, c, err;
+
+	while ((c = getopt(argc, argv, "qo:c:t:")) != -1)
+		switch (c) {
+		case 'q': mintime = 1e7; break;
+		case 'o': output = optarg; break;
+		case 'c': baseline = optarg; break;
+		case 't': tolerance = atof(optarg); break;
+		default: usage(argv[0]);
+		}
+
+	if ((p = malloc(2 * mask_sizes[2] + 64)) == NULL || (u = malloc(sizeof *u)) == NULL)
+		return fprintf(stderr, "malloc failed\n"), 1;
+
+	memset(p, 0x5a, 2 * mask_sizes[2] + 64);
+
+	for (i = 0; i < sizeof frame_lengths / sizeof frame_lengths[0]; ++i) {
+		memset(&f, 0, sizeof f);
+		f.frame.length = frame_lengths[i];
+		f.frame.header[0] = WEBSOCKET_FIN | WEBSOCKET_BINARY;
+		f.frame.header[1] = WEBSOCKET_MASK;
+		memcpy(f.frame.mask, mask, sizeof mask);
+
+		snprintf(name, sizeof name, "writeframe/%s", frame_names[i]);
+		run(name, &bench_writeframe, &f, 0);
+
+		snprintf(name, sizeof name, "writeframe/inline/%s", frame_names[i]);
+		run(name, &bench_writeframe_inline, &f, 0);
+
+		f.len = websocket_writeframe(f.buf, sizeof f.buf, &f.frame);
+		snprintf(name, sizeof name, "readframe/%s", frame_names[i]);
+		run(name, &bench_readframe, &f, 0);
+
+		snprintf(name, sizeof name, "readframe/inline/%s", frame_names[i]);
+		run(name, &bench_readframe_inline, &f, 0);
+	}
+
+	for (i = 0; i < sizeof mask_sizes / sizeof mask_sizes[0]; ++i)
+		for (k = WEBSOCKET_KERNEL_SCALAR; k <= WEBSOCKET_KERNEL_NEON; ++k) {
+			if (websocket_kernel(k) != k)
+				continue;
+
+			memset(&m, 0, sizeof m);
+			m.frame.header[1] = WEBSOCKET_MASK;
+			memcpy(m.frame.mask, mask, sizeof mask);
+			m.p = p + 1;
+			m.n = mask_sizes[i];
+
+			snprintf(name, sizeof name, "maskdata/%s/%zu", kernel_names[k], mask_sizes[i]);
+			run(name, &bench_mask, &m, m.n);
+		}
+
+	websocket_kernel(WEBSOCKET_KERNEL_AUTO);
+
+	for (c = 0; c < 2; ++c) {
+		memset(&t, 0, sizeof t);
+		t.frame.header[1] = WEBSOCKET_MASK;
+		memcpy(t.frame.mask, mask, sizeof mask);
+		t.dst = p + mask_sizes[2] + 32;
+		t.src = p;
+		t.n = mask_sizes[2];
+		setup_text(p, t.n, c, mask);
+
+		for (k = WEBSOCKET_KERNEL_SCALAR; k <= WEBSOCKET_KERNEL_NEON; ++k) {
+			if (websocket_kernel(k) != k)
+				continue;
+
+			snprintf(name, sizeof name, "unmaskcopy/%s/%s", c ? "mixed" : "ascii", kernel_names[k]);
+			run(name, &bench_unmaskcopy, &t, t.n);
+			snprintf(name, sizeof name, "unmaskutf8/%s/%s", c ? "mixed" : "ascii", kernel_names[k]);
+			run(name, &bench_unmaskutf8, &t, t.n);
+		}
+	}
+
+	websocket_kernel(WEBSOCKET_KERNEL_AUTO);
+	memset(p, 0x5a, 2 * mask_sizes[2] + 64);
+
+	if (websocket_random_init(&msg.random) < 0)
+		return fprintf(stderr, "websocket_random_init failed\n"), 1;
+
+	for (i = 0; i < sizeof mask_sizes / sizeof mask_sizes[0]; ++i) {
+		msg.dst = p + mask_sizes[2] + 32;
+		msg.size = mask_sizes[2] + 32;
+		msg.src = p;
+		msg.len = mask_sizes[i];
+
+		msg.mask = NULL;
+		snprintf(name, sizeof name, "message/%zu", mask_sizes[i]);
+		run(name, &bench_message, &msg, msg.len);
+
+		msg.mask = mask;
+		snprintf(name, sizeof name, "message/masked/%zu", mask_sizes[i]);
+		run(name, &bench_message, &msg, msg.len);
+
+		snprintf(name, sizeof name, "message/client/%zu", mask_sizes[i]);
+		run(name, &bench_clientmessage, &msg, msg.len);
+
+		snprintf(name, sizeof name, "messagev/%zu", mask_sizes[i]);
+		run(name, &bench_messagev, &msg, msg.len);
+	}
+
+	run("writeresponse", &bench_writeresponse, NULL, 0);
+
+	if ((up = malloc(sizeof *up)) == NULL)
+		return fprintf(stderr, "malloc failed\n"), 1;
+	setup_upgrades(up);
+	if (check_upgrades(up) != 0)
+		return 1;
+	run("handshake/single", &bench_handshake, up, 0);
+	for (k = WEBSOCKET_KERNEL_SCALAR; k <= WEBSOCKET_KERNEL_NEON; ++k) {
+		if (websocket_kernel(k) != k)
+			continue;
+		snprintf(name, sizeof name, "handshake/batch/%s", kernel_names[k]);
+		run(name, &bench_handshakes, up, 0);
+	}
+	websocket_kernel(WEBSOCKET_KERNEL_AUTO);
+	free(up);
+
+	if ((n = setup_update(u, 10000, 32)) == 0)
+		return 1;
+	run("update/10000x32", &bench_update, u, n);
+	fs.src = u->src;
+	fs.len = u->len;
+	run("readframe/10000x32", &bench_readframe_loop, &fs, n);
+	run("readframes/10000x32", &bench_readframes, &fs, n);
+	free(u->src);
+
+	if ((n = setup_update(u, 4, 4 * 1024 * 1024)) == 0)
+		return 1;
+	run("update/4x4194304", &bench_update, u, n);
+	free(u->src);
+
+#if __linux__
+	if ((n = setup_update(u, 1000, 1000)) == 0)
+		return 1;
+	if ((st = malloc(sizeof *st)) == NULL || (st->buf = malloc(STREAMSIZE)) == NULL ||
+			websocket_ring_init(&st->ring, STREAMSIZE) < 0)
+		return fprintf(stderr, "stream setup failed\n"), 1;
+	st->src = u->src;
+	st->len = u->len;
+	run("stream/memmove/1000x1000", &bench_stream_memmove, st, n);
+	run("stream/ring/1000x1000", &bench_stream_ring, st, n);
+	websocket_ring_release(&st->ring);
+	free(st->buf);
+	free(st);
+	free(u->src);
+#endif
+
+	free(u);
+	free(p);
+
+	if (output != NULL && write_json(output) != 0)
+		return 1;
+
+	if (baseline != NULL) {
+		if ((err = compare_json(baseline, tolerance)) < 0)
+			return 1;
+		if (err > 0)
+			return printf("%d regression(s) against %s\n", err, baseline), 1;
+		printf("no regressions against %s\n", baseline);
+	}
+
+	return 0;
+}
@@ -0,0 +1,2049 @@
+
+#ifndef _nofeatures
+# if _WIN32
+#  define WIN32_LEAN_AND_MEAN 1
+# elif __linux__
+#  define _BSD_SOURCE 1
+#  define _DEFAULT_SOURCE 1
+#  define _POSIX_C_SOURCE 200809L
+#  define _SVID_SOURCE 1
+# elif __APPLE__
+#  define _DARWIN_C_SOURCE 1
+# endif
+#endif /* _nofeatures */
+
+#include "aw-websocket.h"
+#if WEBSOCKET_DEFLATE
+# include <zlib.h>
+#endif
+#include <stdio.h>
+#include <string.h>
+
+#if __linux__
+# include <sys/socket.h>
+# include <fcntl.h>
+# include <stdlib.h>
+# include <unistd.h>
+#endif
+
+/* Pass/fail checks, self-contained so that make check needs nothing fetched.
+   Each returns 0 or prints what went wrong and returns -1. */
+
+#define PIPESIZE (4096)
+
+/* one direction of an in-memory connection */
+struct pipe {
+	unsigned char buf[PIPESIZE];
+	size_t len;
+};
+
+/* the least a client must send to upgrade */
+static const char upgrade[] =
+	"GET / HTTP/1.1\r\n"
+	"Upgrade: websocket\r\n"
+	"Connection: Upgrade\r\n"
+	"Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+	"Sec-WebSocket-Version: 13\r\n"
+	"\r\n";
+
+/* the server echoes every message */
+static ssize_t server_handler(int op, void *dst, size_t size, const void *src, size_t len, void *userdata) {
+	(void) userdata;
+	return websocket_message(WEBSOCKET_FIN | op, NULL, dst, size, src, len);
+}
+
+/* copy out what an iov array points at */
+static size_t flatten(unsigned char *dst, const struct iovec *iov, size_t n) {
+	size_t i, off = 0;
+
+	for (i = 0; i < n; ++i) {
+		memcpy(dst + off, iov[i].iov_base, iov[i].iov_len);
+		off += iov[i].iov_len;
+	}
+
+	return off;
+}
+
+/* The iovec encoders must put on the wire exactly what websocket_message
+   writes, with the payload left where the caller has it. */
+static int check_messagev(void) {
+	static const size_t lens[] = {0, 1, 0, 0, 125, 126, 65535, 0, 65536, 70000};
+	static const unsigned char ops[] = {
+		WEBSOCKET_FIN | WEBSOCKET_TEXT, WEBSOCKET_BINARY, WEBSOCKET_CONTINUATION,
+		WEBSOCKET_FIN | WEBSOCKET_CONTINUATION, WEBSOCKET_FIN | WEBSOCKET_PING,
+		WEBSOCKET_FIN | WEBSOCKET_BINARY, WEBSOCKET_TEXT, WEBSOCKET_FIN | WEBSOCKET_CONTINUATION,
+		WEBSOCKET_FIN | WEBSOCKET_BINARY, WEBSOCKET_FIN | WEBSOCKET_BINARY,
+	};
+	enum { COUNT = sizeof lens / sizeof lens[0] };
+	static unsigned char payload[70000 + 16], expect[COUNT * (70000 + 14)], got[COUNT * (70000 + 14)];
+	unsigned char headers[COUNT * 14];
+	struct iovec src[COUNT], iov[2 * COUNT];
+	size_t i, j, k, len = 0;
+	ssize_t n, m;
+
+	for (i = 0; i < sizeof payload; ++i)
+		payload[i] = (unsigned char) (i * 7 + 3);
+
+	for (i = 0; i < COUNT; ++i) {
+		src[i].iov_base = payload + i;
+		src[i].iov_len = lens[i];
+
+		if ((n = websocket_message(ops[i], NULL, expect + len, sizeof expect - len, src[i].iov_base, lens[i])) < 0)
+			return fprintf(stderr, "messagev: websocket_message err=%zd\n", n), -1;
+		if ((m = websocket_messagev(ops[i], headers, sizeof headers, src[i].iov_base, lens[i], iov)) != n ||
+				flatten(got, iov, 2) != (size_t) n || memcmp(got, expect + len, n) != 0 ||
+				iov[1].iov_base != src[i].iov_base)
+			return fprintf(stderr, "messagev: message %zu of %zu bytes differs\n", i, lens[i]), -1;
+
+		len += n;
+	}
+
+	/* all at once, the headers of empty ones packed together */
+	if ((n = websocket_messagesv(ops, headers, sizeof headers, src, COUNT, iov)) < 0 || n > 2 * COUNT)
+		return fprintf(stderr, "messagesv: err=%zd\n", n), -1;
+	if (flatten(got, iov, n) != len || memcmp(got, expect, len) != 0)
+		return fprintf(stderr, "messagesv: output differs\n"), -1;
+
+	for (i = 0; i < COUNT; ++i) {
+		for (j = 0, k = 0; j < (size_t) n; ++j)
+			k += iov[j].iov_base == src[i].iov_base && iov[j].iov_len == lens[i];
+		if (lens[i] > 0 && k != 1)
+			return fprintf(stderr, "messagesv: payload %zu was copied\n", i), -1;
+	}
+
+	return 0;
+}
+
+/* Frames of every length encoding, masked and not, cut at every byte: only the
+   frames wholly inside the cut are found, each exactly as it was written. */
+static int check_readframes(void) {
+	static const unsigned long long lengths[] = {0, 1, 125, 126, 300, 65535, 65536, 70000};
+	static unsigned char stream[300000];
+	static const unsigned char mask[4] = {0x12, 0x34, 0x56, 0x78};
+	struct websocket_framedesc descs[16];
+	struct websocket_frame frames[16];
+	size_t ends[16], offsets[16], count, len = 0, cut, i, want;
+	ssize_t n;
+
+	for (count = 0; count < sizeof lengths / sizeof lengths[0]; ++count) {
+		memset(&frames[count], 0, sizeof frames[count]);
+		frames[count].length = lengths[count];
+		frames[count].header[0] = (count & 1 ? WEBSOCKET_FIN : 0) | (count == 0 ? WEBSOCKET_PING : WEBSOCKET_BINARY);
+		if (count & 2) {
+			frames[count].header[1] = WEBSOCKET_MASK;
+			memcpy(frames[count].mask, mask, sizeof mask);
+		}
+
+		if ((n = websocket_writeframe(stream + len, sizeof stream - len, &frames[count])) < 0)
+			return fprintf(stderr, "websocket_writeframe err=%zd\n", n), -1;
+
+		offsets[count] = len + n;
+		memset(stream + offsets[count], (int) count, lengths[count]);
+		ends[count] = len = offsets[count] + lengths[count];
+	}
+
+	for (cut = 0; cut <= len; ++cut) {
+		for (want = 0; want < count && ends[want] <= cut; ++want)
+			;
+
+		if ((n = websocket_readframes(stream, cut, descs, sizeof descs / sizeof descs[0])) != (ssize_t) want)
+			return fprintf(stderr, "readframes: %zd frames in %zu bytes, want %zu\n", n, cut, want), -1;
+
+		for (i = 0; i < want; ++i)
+			if (descs[i].offset != offsets[i] || descs[i].frame.length != frames[i].length ||
+					descs[i].opcode != (frames[i].header[0] & WEBSOCKET_OPCODE) ||
+					descs[i].fin != ((frames[i].header[0] & WEBSOCKET_FIN) != 0) ||
+					descs[i].masked != ((frames[i].header[1] & WEBSOCKET_MASK) != 0) ||
+					(descs[i].masked && memcmp(descs[i].frame.mask, mask, sizeof mask) != 0))
+				return fprintf(stderr, "readframes: frame %zu in %zu bytes\n", i, cut), -1;
+	}
+
+	/* max caps the count, and a length no buffer can hold is never taken */
+	if (websocket_readframes(stream, len, descs, 3) != 3)
+		return fprintf(stderr, "readframes: max not honoured\n"), -1;
+
+	memcpy(stream, "\x82\x7f\x80\x00\x00\x00\x00\x00\x00\x00", 10);
+	if (websocket_readframes(stream, sizeof stream, descs, 1) != 0)
+		return fprintf(stderr, "readframes: took a 2^63 byte frame\n"), -1;
+
+	return 0;
+}
+
+/* The inline coders write what websocket_writeframe writes, and read back what
+   websocket_readframe reads, for each role at every length encoding; a frame
+   masked the wrong way for the role is refused but still read. */
+static int check_inline(void) {
+	static const unsigned long long lengths[] = {0, 125, 126, 65535, 65536, 0x100000005ull};
+	static const unsigned char mask[4] = {0xa1, 0xb2, 0xc3, 0xd4};
+	unsigned char ref[32], buf[32];
+	struct websocket_frame frame, want, got;
+	size_t i;
+	int client;
+	ssize_t n, m;
+
+	for (i = 0; i < sizeof lengths / sizeof lengths[0]; ++i)
+		for (client = 0; client < 2; ++client) {
+			memset(&frame, 0, sizeof frame);
+			frame.length = lengths[i];
+			frame.header[0] = WEBSOCKET_FIN | WEBSOCKET_BINARY;
+			if (client) {
+				frame.header[1] = WEBSOCKET_MASK;
+				memcpy(frame.mask, mask, sizeof mask);
+			}
+
+			memset(ref, 0, sizeof ref);
+			memset(buf, 0, sizeof buf);
+			want = frame;
+			n = websocket_writeframe(ref, sizeof ref, &want);
+			m = client ? websocket_writeframe_client(buf, &frame) : websocket_writeframe_server(buf, &frame);
+			if (n < 0 || m != n || memcmp(buf, ref, sizeof buf) != 0)
+				return fprintf(stderr, "inline: %s writes %llu differently\n",
+					client ? "client" : "server", lengths[i]), -1;
+
+			/* the other end reads it */
+			memset(&want, 0, sizeof want);
+			memset(&got, 0, sizeof got);
+			n = websocket_readframe(ref, n, &want);
+			m = client ? websocket_readframe_server(buf, &got) : websocket_readframe_client(buf, &got);
+			if (n < 0 || m != n || memcmp(&got, &want, sizeof got) != 0 || got.length != lengths[i])
+				return fprintf(stderr, "inline: %s reads %llu differently\n",
+					client ? "server" : "client", lengths[i]), -1;
+
+			/* and its own end refuses it */
+			memset(&got, 0, sizeof got);
+			m = client ? websocket_readframe_client(buf, &got) : websocket_readframe_server(buf, &got);
+			if (m != WEBSOCKET_DATA_ERROR || got.length != lengths[i] || got.header[0] != want.header[0])
+				return fprintf(stderr, "inline: %s took a %s frame\n",
+					client ? "client" : "server", client ? "masked" : "plain"), -1;
+		}
+
+	return 0;
+}
+
+/* A request that arrives a byte at a time parses, and is answered, the same as
+   one that arrives whole; resuming picks up mid-line and mid-field. */
+static int check_handshake_trickle(void) {
+	static const char *requests[] = {
+		"GET /chat HTTP/1.1\r\n"
+		"Host: server.example.com\r\n"
+		"Upgrade: websocket\r\n"
+		"Connection: Upgrade\r\n"
+		"Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+		"Sec-WebSocket-Version: 13\r\n"
+		"\r\n",
+		/* bare line feeds and padded values */
+		"GET / HTTP/1.1\n"
+		"upgrade:\twebsocket \n"
+		"connection:  keep-alive, Upgrade\n"
+		"sec-websocket-key:dGhlIHNhbXBsZSBub25jZQ==\t\n"
+		"sec-websocket-version: 13\n"
+		"\n",
+	};
+	static struct pipe in, out;
+	struct websocket_http whole, http;
+	struct websocket_state state;
+	struct websocket_result r;
+	unsigned char response[256];
+	ssize_t n, len, size;
+	size_t i, cut;
+	int keep;
+
+	for (i = 0; i < sizeof requests / sizeof requests[0]; ++i) {
+		len = (ssize_t) strlen(requests[i]);
+
+		memset(&whole, 0, sizeof whole);
+		if (websocket_readhttp(&whole, requests[i], len) != len)
+			return fprintf(stderr, "handshake %zu: does not parse whole\n", i), -1;
+
+		memset(&http, 0, sizeof http);
+		for (cut = 0; cut < (size_t) len; ++cut)
+			if ((n = websocket_readhttp(&http, requests[i], cut)) != WEBSOCKET_NO_DATA)
+				return fprintf(stderr, "handshake %zu: err=%zd at %zu bytes\n", i, n, cut), -1;
+		if (websocket_readhttp(&http, requests[i], len) != len || memcmp(&http, &whole, sizeof http) != 0)
+			return fprintf(stderr, "handshake %zu: resumed parse differs\n", i), -1;
+
+		if ((size = websocket_writeresponse(response, sizeof response, requests[i], len)) < 0)
+			return fprintf(stderr, "handshake %zu: websocket_writeresponse err=%zd\n", i, size), -1;
+
+		/* and through websocket_update, which hands back nothing until the request is
+		   whole, with the parse kept in http or done again on every call */
+		for (keep = 0; keep < 2; ++keep) {
+			memset(&in, 0, sizeof in);
+			memset(&out, 0, sizeof out);
+			if (keep)
+				websocket_state_init_http(&state, &http);
+			else
+				websocket_state_init(&state);
+
+			for (cut = 0; cut < (size_t) len; ++cut) {
+				in.buf[in.len++] = (unsigned char) requests[i][cut];
+				r = websocket_update(
+					&state, out.buf + out.len, PIPESIZE - out.len, in.buf, in.len, &server_handler, NULL);
+				memmove(in.buf, in.buf + r.srclen, in.len - r.srclen);
+				in.len -= r.srclen;
+				out.len += r.dstlen;
+
+				if (r.error != WEBSOCKET_NO_DATA)
+					return fprintf(stderr, "handshake %zu: update err=%d at %zu bytes\n", i, r.error, cut), -1;
+			}
+
+			if (!state.upgraded || state.http != NULL || in.len != 0 ||
+					out.len != (size_t) size || memcmp(out.buf, response, size) != 0)
+				return fprintf(stderr, "handshake %zu: trickled response differs, keep %d\n", i, keep), -1;
+		}
+
+		/* no room for the response: it comes whole once there is */
+		websocket_state_init(&state);
+		r = websocket_update(&state, out.buf, 16, requests[i], len, &server_handler, NULL);
+		if (r.error != WEBSOCKET_NO_BUFFER_SPACE || r.dstlen != 0 || r.srclen != 0)
+			return fprintf(stderr, "handshake %zu: err=%d with no room\n", i, r.error), -1;
+		r = websocket_update(&state, out.buf, PIPESIZE, requests[i], len, &server_handler, NULL);
+		if (r.error != WEBSOCKET_NO_DATA || r.dstlen != size || r.srclen != len ||
+				memcmp(out.buf, response, size) != 0)
+			return fprintf(stderr, "handshake %zu: response differs after no room\n", i), -1;
+	}
+
+	return 0;
+}
+
+/* what reached the handler with reassembly on */
+struct assembled {
+	int calls;
+	int op;
+	unsigned char msg[256];
+	size_t len;
+};
+
+static ssize_t assembly_handler(int op, void *dst, size_t size, const void *src, size_t len, void *userdata) {
+	struct assembled *a = userdata;
+
+	(void) dst;
+	(void) size;
+
+	if (op >= WEBSOCKET_CLOSE)
+		return 0;
+	if (len > sizeof a->msg)
+		return WEBSOCKET_DATA_ERROR;
+
+	++a->calls;
+	a->op = op;
+	if (len > 0) /* an empty message may come without a buffer */
+		memcpy(a->msg, src, len);
+	a->len = len;
+	return 0;
+}
+
+/* Fragments reach the handler as one message, with pings between them; a message
+   one byte over maxsize, a stray continuation and one message interrupting
+   another are errors. Each stream is fed whole and in small pieces. */
+static int check_assembly(void) {
+	static const struct {
+		const char *name;
+		size_t maxsize;
+		int error;
+		int calls;
+		size_t count;
+		unsigned char ops[6];
+		unsigned char lens[6];
+	} streams[] = {
+		{"fragmented", 64, 0, 1, 4,
+			{WEBSOCKET_TEXT, WEBSOCKET_FIN | WEBSOCKET_PING, WEBSOCKET_CONTINUATION,
+				WEBSOCKET_FIN | WEBSOCKET_CONTINUATION},
+			{3, 1, 4, 5}},
+		{"one frame", 64, 0, 1, 1, {WEBSOCKET_FIN | WEBSOCKET_BINARY}, {64}},
+		{"empty fragments", 64, 0, 1, 3,
+			{WEBSOCKET_BINARY, WEBSOCKET_CONTINUATION, WEBSOCKET_FIN | WEBSOCKET_CONTINUATION},
+			{0, 0, 0}},
+		{"at limit", 64, 0, 1, 2, {WEBSOCKET_BINARY, WEBSOCKET_FIN | WEBSOCKET_CONTINUATION}, {32, 32}},
+		{"two messages", 64, 0, 2, 4,
+			{WEBSOCKET_FIN | WEBSOCKET_TEXT, WEBSOCKET_BINARY, WEBSOCKET_CONTINUATION,
+				WEBSOCKET_FIN | WEBSOCKET_CONTINUATION},
+			{60, 30, 30, 4}},
+		{"over limit", 64, WEBSOCKET_DATA_ERROR, 0, 2,
+			{WEBSOCKET_BINARY, WEBSOCKET_FIN | WEBSOCKET_CONTINUATION}, {32, 33}},
+		{"one frame over", 64, WEBSOCKET_DATA_ERROR, 0, 1, {WEBSOCKET_FIN | WEBSOCKET_BINARY}, {65}},
+		{"stray continuation", 64, WEBSOCKET_DATA_ERROR, 1, 2,
+			{WEBSOCKET_FIN | WEBSOCKET_TEXT, WEBSOCKET_FIN | WEBSOCKET_CONTINUATION}, {2, 2}},
+		{"interrupted", 64, WEBSOCKET_DATA_ERROR, 0, 2,
+			{WEBSOCKET_TEXT, WEBSOCKET_FIN | WEBSOCKET_BINARY}, {4, 4}},
+	};
+	static const size_t chunks[] = {1, 5, PIPESIZE};
+	static unsigned char stream[PIPESIZE], out[PIPESIZE];
+	unsigned char payload[256], expect[256], mask[4] = {0x37, 0xfa, 0x21, 0x3d};
+	struct websocket_pool *pool;
+	struct websocket_assembly assembly;
+	struct websocket_state state;
+	struct websocket_result r;
+	struct assembled got;
+	size_t i, j, k, len, off, avail, expectlen;
+	ssize_t n;
+	int expectop = 0, err = 0;
+
+	if ((pool = websocket_pool_create()) == NULL)
+		return fprintf(stderr, "assembly: init failed\n"), -1;
+
+	for (i = 0; err == 0 && i < sizeof streams / sizeof streams[0]; ++i) {
+		/* the frames, and the last complete message they should make */
+		len = 0;
+		expectlen = 0;
+		for (j = 0; j < streams[i].count; ++j) {
+			for (k = 0; k < streams[i].lens[j]; ++k)
+				payload[k] = (unsigned char) ('a' + (len + k) % 26);
+			if ((n = websocket_message(
+					streams[i].ops[j], mask, stream + len, sizeof stream - len,
+					payload, streams[i].lens[j])) < 0) {
+				websocket_pool_destroy(pool);
+				return fprintf(stderr, "websocket_message err=%zd\n", n), -1;
+			}
+			len += n;
+			if ((streams[i].ops[j] & WEBSOCKET_OPCODE) >= WEBSOCKET_CLOSE)
+				continue;
+			if ((streams[i].ops[j] & WEBSOCKET_OPCODE) != WEBSOCKET_CONTINUATION) {
+				expectop = streams[i].ops[j] & WEBSOCKET_OPCODE;
+				expectlen = 0;
+			}
+			memcpy(expect + expectlen, payload, streams[i].lens[j]);
+			expectlen += streams[i].lens[j];
+		}
+
+		for (j = 0; err == 0 && j < sizeof chunks / sizeof chunks[0]; ++j) {
+			memset(&got, 0, sizeof got);
+			websocket_assembly_init(&assembly, pool, streams[i].maxsize);
+			websocket_state_init_http(&state, NULL);
+			state.assembly = &assembly;
+
+			off = 0;
+			avail = 0;
+			do {
+				avail = avail + chunks[j] < len ? avail + chunks[j] : len;
+				r = websocket_update(&state, out, sizeof out, stream + off, avail - off, &assembly_handler, &got);
+				off += r.srclen;
+			} while (r.error == WEBSOCKET_NO_DATA && avail < len);
+
+			if ((streams[i].error == 0 && (r.error != WEBSOCKET_NO_DATA || off != len)) ||
+					(streams[i].error != 0 && r.error != streams[i].error)) {
+				fprintf(stderr, "assembly %s/%zu: err=%d after %zu of %zu bytes\n",
+					streams[i].name, chunks[j], r.error, off, len);
+				err = -1;
+			} else if (got.calls != streams[i].calls) {
+				fprintf(stderr, "assembly %s/%zu: %d messages\n", streams[i].name, chunks[j], got.calls);
+				err = -1;
+			} else if (streams[i].error == 0 &&
+					(got.op != expectop || got.len != expectlen || memcmp(got.msg, expect, expectlen) != 0)) {
+				fprintf(stderr, "assembly %s/%zu: message differs\n", streams[i].name, chunks[j]);
+				err = -1;
+			}
+
+			websocket_assembly_release(&assembly);
+		}
+	}
+
+	websocket_pool_destroy(pool);
+	return err;
+}
+
+/* Control frames over 125 bytes or without FIN, and RSV1 with no deflate on,
+   are refused before anything goes back, and a pong comes back whole through
+   however small an output. */
+static int check_control(void) {
+	static const struct {
+		unsigned char op;
+		unsigned long long length;
+	} bad[] = {
+		{WEBSOCKET_FIN | WEBSOCKET_PING, 126},
+		{WEBSOCKET_FIN | WEBSOCKET_PING, 1024 * 1024},
+		{WEBSOCKET_FIN | WEBSOCKET_CLOSE, 126},
+		{WEBSOCKET_PING, 4},
+		{WEBSOCKET_FIN | WEBSOCKET_RSV1 | WEBSOCKET_TEXT, 4},
+		{WEBSOCKET_FIN | WEBSOCKET_RSV1 | WEBSOCKET_PING, 4},
+	};
+	/* from the least a frame header may need */
+	static const size_t sizes[] = {14, 15, 31, 200};
+	static unsigned char in[PIPESIZE], out[PIPESIZE];
+	unsigned char payload[125], expect[256], mask[4] = {0x9c, 0x41, 0x0e, 0xd3};
+	struct websocket_frame frame;
+	struct websocket_state state;
+	struct websocket_result r;
+	size_t i, len, off, got;
+	ssize_t n, m;
+
+	for (i = 0; i < sizeof bad / sizeof bad[0]; ++i) {
+		memset(&frame, 0, sizeof frame);
+		frame.header[0] = bad[i].op;
+		frame.header[1] = WEBSOCKET_MASK;
+		frame.length = bad[i].length;
+		memcpy(frame.mask, mask, sizeof mask);
+
+		if ((n = websocket_writeframe(in, sizeof in, &frame)) < 0)
+			return fprintf(stderr, "websocket_writeframe err=%zd\n", n), -1;
+
+		/* as much of the payload as there is room for */
+		len = (size_t) n + (bad[i].length < sizeof in - n ? bad[i].length : sizeof in - n);
+		memset(in + n, 'p', len - n);
+
+		websocket_state_init_http(&state, NULL);
+		r = websocket_update(&state, out, 64, in, len, NULL, NULL);
+
+		if (r.error != WEBSOCKET_DATA_ERROR || r.dstlen != 0)
+			return fprintf(stderr, "control: opcode %02x of %llu bytes err=%d\n",
+				bad[i].op, bad[i].length, r.error), -1;
+	}
+
+	for (i = 0; i < sizeof payload; ++i)
+		payload[i] = (unsigned char) i;
+	n = websocket_message(WEBSOCKET_FIN | WEBSOCKET_PING, mask, in, sizeof in, payload, sizeof payload);
+	m = websocket_message(WEBSOCKET_FIN | WEBSOCKET_PONG, NULL, expect, sizeof expect, payload, sizeof payload);
+
+	for (i = 0; i < sizeof sizes / sizeof sizes[0]; ++i) {
+		websocket_state_init_http(&state, NULL);
+		off = got = 0;
+
+		do {
+			r = websocket_update(&state, out + got, sizes[i], in + off, n - off, NULL, NULL);
+			if ((size_t) r.dstlen > sizes[i])
+				return fprintf(stderr, "control: %zd bytes into %zu\n", r.dstlen, sizes[i]), -1;
+			off += (size_t) r.srclen;
+			got += (size_t) r.dstlen;
+		} while (r.error == WEBSOCKET_NO_BUFFER_SPACE && r.dstlen > 0);
+
+		if (r.error != WEBSOCKET_NO_DATA || off != (size_t) n || got != (size_t) m ||
+				memcmp(out, expect, m) != 0)
+			return fprintf(stderr, "control: pong through %zu bytes err=%d\n", sizes[i], r.error), -1;
+	}
+
+	return 0;
+}
+
+/* deterministic, so a failure repeats */
+static unsigned xorshift(unsigned *x) {
+	*x ^= *x << 13;
+	*x ^= *x >> 17;
+	*x ^= *x << 5;
+	return *x;
+}
+
+/* UTF-8 by the table in Unicode 3.9, independent of the library's dfa:
+   0 for whole characters, 1 for a valid but unfinished last one, 2 for invalid */
+static int utf8ref(const unsigned char *p, size_t n) {
+	size_t i, k, need;
+	unsigned char lo, hi;
+
+	for (i = 0; i < n; i += need + 1) {
+		lo = 0x80;
+		hi = 0xbf;
+		if (p[i] < 0x80)
+			need = 0;
+		else if (p[i] >= 0xc2 && p[i] <= 0xdf)
+			need = 1;
+		else if (p[i] >= 0xe0 && p[i] <= 0xef) {
+			need = 2;
+			lo = p[i] == 0xe0 ? 0xa0 : 0x80;
+			hi = p[i] == 0xed ? 0x9f : 0xbf;
+		} else if (p[i] >= 0xf0 && p[i] <= 0xf4) {
+			need = 3;
+			lo = p[i] == 0xf0 ? 0x90 : 0x80;
+			hi = p[i] == 0xf4 ? 0x8f : 0xbf;
+		} else
+			return 2;
+
+		for (k = 1; k <= need; ++k) {
+			if (i + k == n)
+				return 1;
+			if (p[i + k] < (k == 1 ? lo : 0x80) || p[i + k] > (k == 1 ? hi : 0xbf))
+				return 2;
+		}
+	}
+
+	return 0;
+}
+
+/* mostly valid text with long ascii runs, now and then something invalid:
+   overlongs, surrogates, past U+10FFFF, bytes never used, stray continuations
+   and characters cut short */
+static size_t utf8text(unsigned char *p, size_t size, unsigned *x) {
+	static const char *bad[] = {
+		"\xc0\x80", "\xc1\xbf", "\xe0\x80\x80", "\xe0\x9f\xbf", "\xf0\x80\x80\x80",
+		"\xf0\x8f\xbf\xbf", "\xed\xa0\x80", "\xed\xbf\xbf", "\xf4\x90\x80\x80",
+		"\xf5\x80\x80\x80", "\xff", "\x80", "\xbf", "\xc3", "\xe2\x82", "\xf0\x9f\x98",
+	};
+	const char *b;
+	size_t n = 0, len;
+	unsigned c;
+
+	while (n + 4 <= size && xorshift(x) % 16 != 0) {
+		switch (xorshift(x) % 8) {
+		case 0:
+			/* for the vector loops' ascii path */
+			for (len = xorshift(x) % 96; len > 0 && n < size; --len)
+				p[n++] = (unsigned char) (0x20 + xorshift(x) % 0x5f);
+			continue;
+		case 1:
+			if (xorshift(x) % 4 == 0) {
+				b = bad[xorshift(x) % (sizeof bad / sizeof bad[0])];
+				memcpy(p + n, b, len = strlen(b));
+				n += len;
+				continue;
+			}
+			break;
+		}
+
+		/* a code point of any width, surrogates moved out of the way */
+		switch (xorshift(x) % 4) {
+		case 0: c = xorshift(x) % 0x80; break;
+		case 1: c = 0x80 + xorshift(x) % 0x780; break;
+		case 2: c = 0x800 + xorshift(x) % 0xf800; break;
+		default: c = 0x10000 + xorshift(x) % 0x100000; break;
+		}
+		if (c >= 0xd800 && c <= 0xdfff)
+			c += 0x800;
+
+		if (c < 0x80)
+			p[n++] = (unsigned char) c;
+		else if (c < 0x800) {
+			p[n++] = (unsigned char) (0xc0 | c >> 6);
+			p[n++] = (unsigned char) (0x80 | (c & 0x3f));
+		} else if (c < 0x10000) {
+			p[n++] = (unsigned char) (0xe0 | c >> 12);
+			p[n++] = (unsigned char) (0x80 | (c >> 6 & 0x3f));
+			p[n++] = (unsigned char) (0x80 | (c & 0x3f));
+		} else {
+			p[n++] = (unsigned char) (0xf0 | c >> 18);
+			p[n++] = (unsigned char) (0x80 | (c >> 12 & 0x3f));
+			p[n++] = (unsigned char) (0x80 | (c >> 6 & 0x3f));
+			p[n++] = (unsigned char) (0x80 | (c & 0x3f));
+		}
+	}
+
+	return n;
+}
+
+/* Every kernel that runs here, unmasking into aligned and unaligned buffers and in
+   place, with the text cut into random pieces: each piece must come out unmasked,
+   the verdict after it must agree with the reference and the state carried on must
+   be the one the scalar kernel carries. */
+static int check_utf8(void) {
+	static const int kernels[] = {
+		WEBSOCKET_KERNEL_SCALAR, WEBSOCKET_KERNEL_SSE2, WEBSOCKET_KERNEL_AVX2, WEBSOCKET_KERNEL_NEON,
+	};
+	static unsigned char text[1024], src[1024], buf[1024 + 32];
+	unsigned char states[1024], utf8, *dst;
+	unsigned short cuts[1024];
+	struct websocket_frame frame;
+	size_t i, j, k, n, len, off, pieces;
+	unsigned x = 2463534242u;
+	ssize_t r;
+	int ref, err = 0;
+
+	for (i = 0; err == 0 && i < 4000; ++i) {
+		len = utf8text(text, i % 8 == 0 ? sizeof text : 160, &x);
+
+		memset(&frame, 0, sizeof frame);
+		if (i % 4 != 0) {
+			frame.header[1] = WEBSOCKET_MASK;
+			for (j = 0; j < 4; ++j)
+				frame.mask[j] = (unsigned char) xorshift(&x);
+		}
+		off = xorshift(&x) % 4;
+
+		for (j = 0; j < len; ++j)
+			src[j] = text[j] ^ ((frame.header[1] & WEBSOCKET_MASK) ? frame.mask[(off + j) & 3] : 0);
+
+		/* whole, or in pieces of up to 70 bytes */
+		for (n = 0, pieces = 0; n < len; n += cuts[pieces++])
+			if (i % 3 == 0 || (cuts[pieces] = (unsigned short) (1 + xorshift(&x) % 70)) > len - n)
+				cuts[pieces] = (unsigned short) (len - n);
+
+		for (k = 0; err == 0 && k < sizeof kernels / sizeof kernels[0]; ++k) {
+			if (websocket_kernel(kernels[k]) != kernels[k])
+				continue;
+
+			dst = i % 5 == 0 ? src : buf + xorshift(&x) % 32;
+			if (dst != src)
+				memset(dst, 0, len);
+
+			utf8 = WEBSOCKET_UTF8_ACCEPT;
+			for (j = 0, n = 0; err == 0 && j < pieces; n += cuts[j++]) {
+				r = websocket_unmaskutf8(dst + n, src + n, cuts[j], &frame, off + n, &utf8);
+				ref = utf8ref(text, n + cuts[j]);
+
+				if ((r < 0) != (ref == 2) || (r >= 0 && r != cuts[j]) ||
+						(utf8 == WEBSOCKET_UTF8_ACCEPT) != (ref == 0) ||
+						(utf8 == WEBSOCKET_UTF8_REJECT) != (ref == 2)) {
+					fprintf(stderr, "utf8 kernel %d: text %zu, %zu+%u bytes: state %u, reference %d\n",
+						kernels[k], i, n, cuts[j], utf8, ref);
+					err = -1;
+				} else if (k == 0)
+					states[j] = utf8;
+				else if (utf8 != states[j]) {
+					fprintf(stderr, "utf8 kernel %d: text %zu, %zu+%u bytes: state %u, scalar %u\n",
+						kernels[k], i, n, cuts[j], utf8, states[j]);
+					err = -1;
+				}
+				if (err == 0 && ref != 2 && memcmp(dst + n, text + n, cuts[j]) != 0) {
+					fprintf(stderr, "utf8 kernel %d: text %zu, %zu+%u bytes: not unmasked\n",
+						kernels[k], i, n, cuts[j]);
+					err = -1;
+				}
+				if (ref == 2)
+					break;
+			}
+
+			/* in place leaves the plain text behind; mask it again for the next kernel */
+			if (dst == src)
+				for (j = 0; j < len; ++j)
+					src[j] = text[j] ^ ((frame.header[1] & WEBSOCKET_MASK) ? frame.mask[(off + j) & 3] : 0);
+		}
+	}
+
+	websocket_kernel(WEBSOCKET_KERNEL_AUTO);
+	return err;
+}
+
+/* Timers on either side of every level boundary, past due and past the clamp,
+   from starting points that wrap: each must fire on the tick it is due, after
+   cascading down, and not before; cancelled ones, some cancelled after they
+   cascaded, never fire. */
+static int check_wheel(void) {
+	static const long long deltas[] = {
+		-5, 0, 1, 2, 63, 64, 65, 127, 128, 4095, 4096, 4097, 4160,
+		262143, 262144, 262145, (1 << 24) - 1, 1 << 24, (1 << 24) + 1, 1ll << 31,
+	};
+	static const unsigned starts[] = {
+		0, 1, 63, 64, 4095, 12345678, 0xff000011u, 0xffffffffu - 300000, 0xffffffffu - 100, 0xffffffffu,
+	};
+	static struct {
+		struct websocket_timer timer; /* first, to get back here from the expired list */
+		unsigned due;
+		int cancel; /* 0 never, 1 straight away, 2 the tick before it is due */
+		int fired;
+	} timers[3 * sizeof deltas / sizeof deltas[0]];
+	struct websocket_wheel wheel;
+	struct websocket_timer *t;
+	unsigned start, d, next;
+	size_t i, j, n = sizeof timers / sizeof timers[0];
+
+	for (i = 0; i < sizeof starts / sizeof starts[0]; ++i) {
+		start = starts[i];
+		websocket_wheel_init(&wheel, start);
+
+		for (j = 0; j < n; ++j) {
+			d = deltas[j / 3] < 1 ? 1 : deltas[j / 3] > 1 << 24 ? 1 << 24 : (unsigned) deltas[j / 3];
+			timers[j].due = start + d;
+			timers[j].cancel = (int) (j % 3);
+			timers[j].fired = 0;
+			websocket_wheel_add(&wheel, &timers[j].timer, start + (unsigned) deltas[j / 3]);
+			if (timers[j].cancel == 1)
+				websocket_wheel_cancel(&wheel, &timers[j].timer);
+		}
+
+		/* from one due tick to the next: nothing on the way, then exactly those due */
+		for (d = start; wheel.count != 0; d = next) {
+			for (next = start + (1 << 24), j = 0; j < n; ++j)
+				if (timers[j].due - start > d - start && timers[j].due - start < next - start &&
+						timers[j].cancel != 1)
+					next = timers[j].due;
+
+			if (next - 1 != d && websocket_wheel_advance(&wheel, next - 1) != NULL)
+				return fprintf(stderr, "wheel %u: fired before %u\n", start, next), -1;
+			for (j = 0; j < n; ++j)
+				if (timers[j].due == next && timers[j].cancel == 2)
+					websocket_wheel_cancel(&wheel, &timers[j].timer);
+
+			for (t = websocket_wheel_advance(&wheel, next); t != NULL; t = t->next) {
+				j = (size_t) ((char *) t - (char *) timers) / sizeof timers[0];
+				if (timers[j].due != next || timers[j].cancel != 0 || timers[j].fired++ ||
+						websocket_timer_pending(t))
+					return fprintf(stderr, "wheel %u: timer %zu fired at %u\n", start, j, next), -1;
+			}
+
+			if (next == start + (1 << 24))
+				break;
+		}
+
+		for (j = 0; j < n; ++j)
+			if (timers[j].fired != (timers[j].cancel == 0))
+				return fprintf(stderr, "wheel %u: timer %zu due %u never fired\n", start, j, timers[j].due), -1;
+		if (wheel.count != 0 || websocket_wheel_advance(&wheel, start + (1 << 25)) != NULL)
+			return fprintf(stderr, "wheel %u: timers left over\n", start), -1;
+	}
+
+	return 0;
+}
+
+/* one end: what it parses comes from in, what it writes goes to out */
+struct end {
+	struct websocket_state state;
+	struct websocket_http http;
+	struct websocket_client client;
+	struct pipe *in;
+	struct pipe *out;
+	unsigned char msg[256];
+	size_t msglen;
+	int msgop;
+	int error;
+};
+
+/* the client keeps the last message */
+static ssize_t client_handler(int op, void *dst, size_t size, const void *src, size_t len, void *userdata) {
+	struct end *end = userdata;
+
+	(void) dst;
+	(void) size;
+
+	if (len > sizeof end->msg)
+		return WEBSOCKET_DATA_ERROR;
+
+	memcpy(end->msg, src, len);
+	end->msglen = len;
+	end->msgop = op;
+	return 0;
+}
+
+/* run one end over whatever is waiting for it */
+static void step(struct end *end, websocket_handler_t handler) {
+	struct websocket_result r;
+
+	r = websocket_update(
+		&end->state, end->out->buf + end->out->len, PIPESIZE - end->out->len,
+		end->in->buf, end->in->len, handler, end);
+
+	memmove(end->in->buf, end->in->buf + r.srclen, end->in->len - r.srclen);
+	end->in->len -= r.srclen;
+	end->out->len += r.dstlen;
+	end->error = r.error;
+}
+
+static int send_client(struct end *end, unsigned char op, const void *src, size_t len) {
+	ssize_t n;
+
+	if ((n = websocket_clientmessage(
+			&end->client.random, op, end->out->buf + end->out->len, PIPESIZE - end->out->len,
+			src, len)) < 0)
+		return fprintf(stderr, "websocket_clientmessage err=%zd\n", n), -1;
+
+	end->out->len += n;
+	return 0;
+}
+
+/* a reply from the server must be unmasked and carry the peer's payload in the clear */
+static int check_reply(const struct pipe *p, unsigned char op, const void *payload, size_t len) {
+	struct websocket_frame frame;
+	ssize_t n;
+
+	if ((n = websocket_readframe(p->buf, p->len, &frame)) < 0)
+		return fprintf(stderr, "reply: no frame\n"), -1;
+	if ((frame.header[0] & WEBSOCKET_OPCODE) != op || (frame.header[1] & WEBSOCKET_MASK))
+		return fprintf(stderr, "reply: header %02x %02x\n", frame.header[0], frame.header[1]), -1;
+	if (frame.length != len || p->len != n + len || memcmp(p->buf + n, payload, len) != 0)
+		return fprintf(stderr, "reply: payload\n"), -1;
+
+	return 0;
+}
+
+/* The library's client against the library's server, through the handshake,
+   a ping, an echoed message and a close with a status. */
+static int check_roundtrip(void) {
+	static struct pipe up, down;
+	static struct end server, client;
+	static const unsigned char status[] = {0x03, 0xe8, 'b', 'y', 'e'};
+
+	memset(&up, 0, sizeof up);
+	memset(&down, 0, sizeof down);
+	memset(&server, 0, sizeof server);
+	memset(&client, 0, sizeof client);
+
+	websocket_state_init_http(&server.state, &server.http);
+	server.in = &up;
+	server.out = &down;
+
+	websocket_state_init_http(&client.state, &client.http);
+	if (websocket_client_init(&client.client, "/chat", NULL, 0) < 0)
+		return fprintf(stderr, "websocket_client_init failed\n"), -1;
+	client.state.client = &client.client;
+	client.in = &down;
+	client.out = &up;
+
+	step(&client, &client_handler);
+	step(&server, &server_handler);
+	step(&client, &client_handler);
+	if (client.state.http != NULL || server.state.http != NULL || down.len != 0)
+		return fprintf(stderr, "handshake: not upgraded\n"), -1;
+
+	if (send_client(&client, WEBSOCKET_FIN | WEBSOCKET_PING, "ping", 4) < 0)
+		return -1;
+	step(&server, &server_handler);
+	if (check_reply(&down, WEBSOCKET_PONG, "ping", 4) < 0)
+		return -1;
+	step(&client, &client_handler);
+	if (client.error != WEBSOCKET_NO_DATA || down.len != 0)
+		return fprintf(stderr, "pong: client error %d\n", client.error), -1;
+
+	if (send_client(&client, WEBSOCKET_FIN | WEBSOCKET_TEXT, "hello", 5) < 0)
+		return -1;
+	step(&server, &server_handler);
+	step(&client, &client_handler);
+	if (client.error != WEBSOCKET_NO_DATA || client.msgop != WEBSOCKET_TEXT ||
+			client.msglen != 5 || memcmp(client.msg, "hello", 5) != 0)
+		return fprintf(stderr, "echo: client error %d\n", client.error), -1;
+
+	if (send_client(&client, WEBSOCKET_FIN | WEBSOCKET_CLOSE, status, sizeof status) < 0)
+		return -1;
+	step(&server, &server_handler);
+	if (server.error != 0)
+		return fprintf(stderr, "close: server error %d\n", server.error), -1;
+	if (check_reply(&down, WEBSOCKET_CLOSE, status, sizeof status) < 0)
+		return -1;
+	step(&client, &client_handler);
+	if (client.error != 0)
+		return fprintf(stderr, "close: client error %d\n", client.error), -1;
+
+	return 0;
+}
+
+/* A server refuses frames its client left unmasked, short or long enough for
+   the inline decoder, and a client refuses masked ones, before anything goes back. */
+static int check_mask(void) {
+	static const size_t lens[] = {2, 200};
+	static unsigned char payload[200], in[PIPESIZE], out[PIPESIZE];
+	unsigned char mask[4] = {0x0b, 0x72, 0xe4, 0x19};
+	struct websocket_client client;
+	struct websocket_state state;
+	struct websocket_result r;
+	ssize_t n;
+	size_t i;
+	int role;
+
+	memset(payload, 'm', sizeof payload);
+	if (websocket_client_init(&client, "/", NULL, 0) < 0)
+		return fprintf(stderr, "websocket_client_init failed\n"), -1;
+
+	for (role = 0; role < 2; ++role)
+		for (i = 0; i < sizeof lens / sizeof lens[0]; ++i) {
+			websocket_state_init_http(&state, NULL);
+			state.client = role ? &client : NULL;
+
+			n = websocket_message(WEBSOCKET_FIN | WEBSOCKET_TEXT, role ? mask : NULL, in, sizeof in, payload, lens[i]);
+			r = websocket_update(&state, out, sizeof out, in, n, &server_handler, NULL);
+
+			if (r.error != WEBSOCKET_DATA_ERROR || r.dstlen != 0)
+				return fprintf(stderr, "mask: %s took %zu bytes %s, err=%d\n", role ? "client" : "server",
+					lens[i], role ? "masked" : "unmasked", r.error), -1;
+		}
+
+	return 0;
+}
+
+/* A response with the right accept key still upgrades only on a 101. */
+static int check_handshake_status(void) {
+	static const char *const lines[] = {
+		"HTTP/1.1 200 Switching Protocols", "HTTP/1.0 101 Switching Protocols",
+		"HTTP/1.1 1010 Switching Protocols", "HTTP/1.1 10",
+	};
+	static const unsigned char nonce[WEBSOCKET_NONCESIZE] = "0123456789abcdef";
+	unsigned char request[256], response[256], bad[256];
+	ssize_t n, m, line;
+	size_t i, k;
+
+	if ((n = websocket_writerequest(request, sizeof request, nonce, "/", NULL, 0)) < 0 ||
+			(m = websocket_writeresponse(response, sizeof response, request, n)) < 0)
+		return fprintf(stderr, "handshake/status: no response\n"), -1;
+
+	if (websocket_readresponse(response, m, nonce) != m)
+		return fprintf(stderr, "handshake/status: 101 refused\n"), -1;
+
+	line = (unsigned char *) memchr(response, '\r', m) - response;
+
+	for (i = 0; i < sizeof lines / sizeof lines[0]; ++i) {
+		k = strlen(lines[i]);
+		memcpy(bad, lines[i], k);
+		memcpy(bad + k, response + line, m - line);
+
+		if (websocket_readresponse(bad, k + m - line, nonce) != WEBSOCKET_DATA_ERROR)
+			return fprintf(stderr, "handshake/status: \"%s\" taken\n", lines[i]), -1;
+	}
+
+	return 0;
+}
+
+#if WEBSOCKET_DEFLATE
+/* Messages compressed with context takeover, an empty one between, must inflate
+   back in order on one stream, as the peer's would. */
+static int check_deflate_empty(void) {
+	static const char *messages[] = {"hello hello", "", "hello hello"};
+	static const unsigned char trailer[4] = {0x00, 0x00, 0xff, 0xff};
+	struct websocket_deflate_pool *pool;
+	struct websocket_deflate ctx;
+	struct websocket_frame frame;
+	unsigned char buf[256], in[256], out[256];
+	z_stream z;
+	ssize_t n, head;
+	size_t i, len;
+	int err = 0;
+
+	if ((pool = websocket_deflate_pool_create(6, 0, 0)) == NULL)
+		return fprintf(stderr, "websocket_deflate_pool_create failed\n"), -1;
+
+	websocket_deflate_init(&ctx, pool, NULL, 1);
+	ctx.enabled = 1;
+	memset(&z, 0, sizeof z);
+	inflateInit2(&z, -15);
+
+	for (i = 0; i < sizeof messages / sizeof messages[0] && err == 0; ++i) {
+		len = strlen(messages[i]);
+
+		if ((n = websocket_deflate_message(
+				&ctx, WEBSOCKET_FIN | WEBSOCKET_TEXT, NULL, buf, sizeof buf, messages[i], len)) < 0) {
+			fprintf(stderr, "deflate: message %zu err=%zd\n", i, n);
+			err = -1;
+			break;
+		}
+
+		if ((head = websocket_readframe(buf, n, &frame)) < 0 || !(frame.header[0] & WEBSOCKET_RSV1) ||
+				frame.length == 0 || (size_t) (n - head) != frame.length) {
+			fprintf(stderr, "deflate: message %zu frame\n", i);
+			err = -1;
+			break;
+		}
+
+		memcpy(in, buf + head, frame.length);
+		memcpy(in + frame.length, trailer, sizeof trailer);
+		z.next_in = in;
+		z.avail_in = (uInt) (frame.length + sizeof trailer);
+		z.next_out = out;
+		z.avail_out = sizeof out;
+
+		if (inflate(&z, Z_SYNC_FLUSH) != Z_OK || z.avail_in != 0 ||
+				sizeof out - z.avail_out != len || memcmp(out, messages[i], len) != 0) {
+			fprintf(stderr, "deflate: message %zu does not inflate back\n", i);
+			err = -1;
+		}
+	}
+
+	inflateEnd(&z);
+	websocket_deflate_release(&ctx);
+	websocket_deflate_pool_destroy(pool);
+	return err;
+}
+
+/* With deflate on, RSV1 opens a compressed message; on a continuation or a
+   control frame it is refused all the same. */
+static int check_deflate_rsv1(void) {
+	static const unsigned char bad[] = {
+		WEBSOCKET_FIN | WEBSOCKET_RSV1 | WEBSOCKET_CONTINUATION,
+		WEBSOCKET_FIN | WEBSOCKET_RSV1 | WEBSOCKET_PING,
+	};
+	struct websocket_deflate_pool *pool;
+	struct websocket_deflate client, server;
+	struct websocket_state state;
+	struct websocket_result r;
+	unsigned char in[256], out[256], expect[256], mask[4] = {0x31, 0xa7, 0x5e, 0x08};
+	ssize_t n, m;
+	size_t i;
+	int err = 0;
+
+	if ((pool = websocket_deflate_pool_create(6, 0, 0)) == NULL)
+		return fprintf(stderr, "websocket_deflate_pool_create failed\n"), -1;
+
+	websocket_deflate_init(&client, pool, NULL, 0);
+	websocket_deflate_init(&server, pool, NULL, 1);
+	client.enabled = server.enabled = 1;
+
+	n = websocket_deflate_message(&client, WEBSOCKET_FIN | WEBSOCKET_TEXT, mask, in, sizeof in, "hello hello", 11);
+	m = websocket_message(WEBSOCKET_FIN | WEBSOCKET_TEXT, NULL, expect, sizeof expect, "hello hello", 11);
+
+	websocket_state_init_http(&state, NULL);
+	state.deflate = &server;
+	r = websocket_update(&state, out, sizeof out, in, n, &server_handler, NULL);
+
+	if (n < 0 || r.error != WEBSOCKET_NO_DATA || r.srclen != n || r.dstlen != m || memcmp(out, expect, m) != 0) {
+		fprintf(stderr, "deflate: compressed message err=%d\n", r.error);
+		err = -1;
+	}
+
+	for (i = 0; err == 0 && i < sizeof bad; ++i) {
+		/* the continuation goes in the middle of a plain message */
+		n = websocket_message(WEBSOCKET_TEXT, mask, in, sizeof in, "frag", 4);
+		n += websocket_message(bad[i], mask, in + n, sizeof in - n, "ment", 4);
+		r = websocket_update(&state, out, sizeof out, in, n, &server_handler, NULL);
+
+		if (r.error != WEBSOCKET_DATA_ERROR) {
+			fprintf(stderr, "deflate: RSV1 on %02x err=%d\n", bad[i], r.error);
+			err = -1;
+		}
+
+		websocket_state_init_http(&state, NULL);
+		state.deflate = &server;
+	}
+
+	websocket_deflate_release(&client);
+	websocket_deflate_release(&server);
+	websocket_deflate_pool_destroy(pool);
+	return err;
+}
+#endif
+
+#if WEBSOCKET_STATS
+static unsigned long long sum(const unsigned long long *v, size_t n) {
+	unsigned long long total = 0;
+	size_t i;
+
+	for (i = 0; i < n; ++i)
+		total += v[i];
+
+	return total;
+}
+
+static int handled;
+
+static ssize_t counting_handler(int op, void *dst, size_t size, const void *src, size_t len, void *userdata) {
+	++handled;
+	return server_handler(op, dst, size, src, len, userdata);
+}
+
+/* A scripted exchange is counted the same on the connection and the thread:
+   the upgrade, every frame by opcode, size and masking, each handler call and
+   the close; the echoes written go to the thread alone. */
+static int check_stats(void) {
+	static const struct {
+		unsigned char op;
+		size_t len;
+	} script[] = {
+		{WEBSOCKET_FIN | WEBSOCKET_TEXT, 5},
+		{WEBSOCKET_FIN | WEBSOCKET_PING, 1},
+		{WEBSOCKET_FIN | WEBSOCKET_BINARY, 300},
+		{WEBSOCKET_FIN | WEBSOCKET_CLOSE, 2},
+	};
+	static const unsigned char status[] = {0x03, 0xe8};
+	static struct pipe in, out;
+	static unsigned char payload[300];
+	struct websocket_stats before, after, conn, total;
+	struct websocket_http http;
+	struct websocket_state state;
+	struct websocket_result r;
+	unsigned char mask[4] = {0x0f, 0xf0, 0x55, 0xaa}, op;
+	size_t i;
+	ssize_t n;
+
+	memset(&in, 0, sizeof in);
+	memset(&out, 0, sizeof out);
+	memset(&conn, 0, sizeof conn);
+	memset(&total, 0, sizeof total);
+	memset(payload, 'x', sizeof payload);
+
+	memcpy(in.buf, upgrade, sizeof upgrade - 1);
+	in.len = sizeof upgrade - 1;
+	for (i = 0; i < sizeof script / sizeof script[0]; ++i) {
+		if ((n = websocket_message(
+				script[i].op, mask, in.buf + in.len, PIPESIZE - in.len,
+				(script[i].op & WEBSOCKET_OPCODE) == WEBSOCKET_CLOSE ? status : payload, script[i].len)) < 0)
+			return fprintf(stderr, "stats: websocket_message err=%zd\n", n), -1;
+		in.len += n;
+	}
+
+	websocket_stats_snapshot(&before);
+	websocket_state_init_http(&state, &http);
+	state.stats = &conn;
+	handled = 0;
+
+	r = websocket_update(&state, out.buf, PIPESIZE, in.buf, in.len, &counting_handler, NULL);
+	websocket_stats_snapshot(&after);
+
+	if (r.error != 0 || (size_t) r.srclen != in.len)
+		return fprintf(stderr, "stats: update err=%d\n", r.error), -1;
+
+	for (i = 0; i < sizeof script / sizeof script[0]; ++i) {
+		op = script[i].op & WEBSOCKET_OPCODE;
+		if (conn.framesin[op] != 1 || conn.bytesin[op] != script[i].len ||
+				after.framesin[op] - before.framesin[op] != 1 ||
+				after.bytesin[op] - before.bytesin[op] != script[i].len)
+			return fprintf(stderr, "stats: opcode %u in\n", op), -1;
+	}
+
+	if (conn.masked != 308 ||
+			sum(conn.framesize, WEBSOCKET_STATS_BUCKETS) != 4 || conn.framesize[9] != 1 ||
+			sum(conn.handlertime, WEBSOCKET_STATS_BUCKETS) != (unsigned long long) handled ||
+			conn.handshakes != 1 || after.handshakes - before.handshakes != 1 ||
+			conn.yields[0] != 1 || sum(conn.yields, 8) != 1)
+		return fprintf(stderr, "stats: connection counts\n"), -1;
+
+	/* the echoes and replies, which only the thread sees; none of them masked */
+	if (sum(conn.framesout, 16) != 0 || after.masked - before.masked != 308 ||
+			after.framesout[WEBSOCKET_PONG] - before.framesout[WEBSOCKET_PONG] != 1 ||
+			after.bytesout[WEBSOCKET_PONG] - before.bytesout[WEBSOCKET_PONG] != 1 ||
+			after.framesout[WEBSOCKET_CLOSE] - before.framesout[WEBSOCKET_CLOSE] != 1 ||
+			after.bytesout[WEBSOCKET_CLOSE] - before.bytesout[WEBSOCKET_CLOSE] != 2 ||
+			after.framesout[WEBSOCKET_TEXT] - before.framesout[WEBSOCKET_TEXT] != 1 ||
+			after.bytesout[WEBSOCKET_TEXT] - before.bytesout[WEBSOCKET_TEXT] != 5 ||
+			after.framesout[WEBSOCKET_BINARY] - before.framesout[WEBSOCKET_BINARY] != 1 ||
+			after.bytesout[WEBSOCKET_BINARY] - before.bytesout[WEBSOCKET_BINARY] != 300)
+		return fprintf(stderr, "stats: frames out\n"), -1;
+
+	websocket_stats_merge(&total, &conn);
+	websocket_stats_merge(&total, &conn);
+	if (total.framesin[WEBSOCKET_BINARY] != 2 || total.bytesin[WEBSOCKET_BINARY] != 600 ||
+			total.masked != 616 || total.handshakes != 2 || total.framesize[9] != 2)
+		return fprintf(stderr, "stats: merge\n"), -1;
+
+	return 0;
+}
+#endif
+
+#if __linux__
+/* Engine checks: a server adopts one end of a socketpair, the check is the peer
+   on the other end and runs the server until what it expects has come back. */
+
+/* io_uring where the kernel has it, and epoll always */
+static const unsigned backends[] = {0, WEBSOCKET_SERVER_EPOLL};
+
+static int closed;
+
+static void count_close(struct websocket_conn *conn) {
+	(void) conn;
+	++closed;
+}
+
+/* serve until len bytes have reached the peer, or give up after a second */
+static size_t peer_recv(struct websocket_server *server, int fd, unsigned char *buf, size_t len) {
+	size_t off = 0;
+	ssize_t n;
+	int i;
+
+	for (i = 0; off < len && i < 100; ++i) {
+		websocket_server_poll(server, 10);
+		while (off < len && (n = recv(fd, buf + off, len - off, MSG_DONTWAIT)) > 0)
+			off += n;
+	}
+
+	return off;
+}
+
+static int peer_expect(struct websocket_server *server, int fd, const void *expect, size_t len) {
+	static unsigned char buf[PIPESIZE];
+
+	if (peer_recv(server, fd, buf, len) != len || memcmp(buf, expect, len) != 0)
+		return fprintf(stderr, "engine: peer did not get what it expected\n"), -1;
+
+	return 0;
+}
+
+/* the peer masks what it sends, as a client must */
+static int peer_send(int fd, unsigned char op, const void *src, size_t len) {
+	static unsigned char buf[PIPESIZE];
+	unsigned char mask[4] = {0x5a, 0x01, 0xc3, 0x7e};
+	ssize_t n;
+
+	if ((n = websocket_message(op, mask, buf, sizeof buf, src, len)) < 0 || send(fd, buf, n, 0) != n)
+		return fprintf(stderr, "engine: peer send failed\n"), -1;
+
+	return 0;
+}
+
+static int peer_connect(struct websocket_server *server, int *fd) {
+	unsigned char response[256];
+	ssize_t n;
+	int sv[2];
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0)
+		return fprintf(stderr, "engine: socketpair failed\n"), -1;
+	if (websocket_server_adopt(server, sv[0]) < 0)
+		return close(sv[0]), close(sv[1]), fprintf(stderr, "engine: adopt failed\n"), -1;
+
+	*fd = sv[1];
+	n = websocket_writeresponse(response, sizeof response, upgrade, sizeof upgrade - 1);
+
+	if (send(*fd, upgrade, sizeof upgrade - 1, 0) != sizeof upgrade - 1 ||
+			peer_expect(server, *fd, response, n) < 0)
+		return fprintf(stderr, "engine: no handshake\n"), -1;
+
+	return 0;
+}
+
+/* Messages come back through the engine as the handler wrote them, pings and
+   closes are answered unmasked, and a peer that hangs up is released. */
+static int engine_echo(unsigned flags) {
+	static const unsigned char status[] = {0x03, 0xe8, 'b', 'y', 'e'};
+	static unsigned char msg[1000], expect[PIPESIZE];
+	struct websocket_server_params params = {0};
+	struct websocket_server server;
+	size_t i;
+	ssize_t n;
+	int fd, err = 0;
+
+	params.handler = &server_handler;
+	params.close = &count_close;
+	params.flags = flags;
+	closed = 0;
+
+	if (websocket_server_init(&server, -1, &params) < 0)
+		return fprintf(stderr, "engine: init failed\n"), -1;
+
+	for (i = 0; i < sizeof msg; ++i)
+		msg[i] = (unsigned char) ('a' + i % 26);
+
+	if (peer_connect(&server, &fd) < 0)
+		err = -1;
+	else {
+		for (i = 0; err == 0 && i < 3; ++i) {
+			n = websocket_message(WEBSOCKET_FIN | WEBSOCKET_TEXT, NULL, expect, sizeof expect, msg, i * 400);
+			if (peer_send(fd, WEBSOCKET_FIN | WEBSOCKET_TEXT, msg, i * 400) < 0 ||
+					peer_expect(&server, fd, expect, n) < 0)
+				err = -1;
+		}
+
+		n = websocket_message(WEBSOCKET_FIN | WEBSOCKET_PONG, NULL, expect, sizeof expect, "ping", 4);
+		if (err == 0 && (peer_send(fd, WEBSOCKET_FIN | WEBSOCKET_PING, "ping", 4) < 0 ||
+				peer_expect(&server, fd, expect, n) < 0))
+			err = -1;
+
+		n = websocket_message(WEBSOCKET_FIN | WEBSOCKET_CLOSE, NULL, expect, sizeof expect, status, sizeof status);
+		if (err == 0 && (peer_send(fd, WEBSOCKET_FIN | WEBSOCKET_CLOSE, status, sizeof status) < 0 ||
+				peer_expect(&server, fd, expect, n) < 0))
+			err = -1;
+
+		close(fd);
+		for (i = 0; closed == 0 && i < 100; ++i)
+			websocket_server_poll(&server, 10);
+		if (err == 0 && (closed != 1 || server.count != 0)) {
+			fprintf(stderr, "engine: hangup not released\n");
+			err = -1;
+		}
+	}
+
+	websocket_server_release(&server);
+	return err;
+}
+
+static int check_engine_echo(void) {
+	size_t i;
+
+	for (i = 0; i < sizeof backends / sizeof backends[0]; ++i)
+		if (engine_echo(backends[i]) < 0)
+			return fprintf(stderr, "engine/echo: flags %u\n", backends[i]), -1;
+
+	return 0;
+}
+
+/* nothing from the handler, so all a peer gets is what the engine queued */
+static ssize_t quiet_handler(int op, void *dst, size_t size, const void *src, size_t len, void *userdata) {
+	(void) op;
+	(void) dst;
+	(void) size;
+	(void) src;
+	(void) len;
+	(void) userdata;
+	return 0;
+}
+
+/* serve a while and check that nothing reached the peer */
+static int peer_quiet(struct websocket_server *server, int fd) {
+	unsigned char c;
+
+	if (peer_recv(server, fd, &c, 1) != 0 && peer_recv(server, fd, &c, 1) != 0)
+		return fprintf(stderr, "engine: peer got something early\n"), -1;
+
+	return 0;
+}
+
+/* One frame goes to every peer, byte for byte, but not into the middle of a
+   fragmented message; a peer in the middle of one gets it once the message is
+   over, and so does a message sent on its own. A message sent after the
+   broadcast comes after it. */
+static int engine_broadcast(unsigned flags) {
+	static unsigned char msg[3000], expect[PIPESIZE], after[64];
+	struct websocket_server_params params = {0};
+	struct websocket_server server;
+	size_t i, count = 0;
+	ssize_t n, m;
+	int fds[3], err = 0;
+
+	params.handler = &quiet_handler;
+	params.flags = flags;
+
+	if (websocket_server_init(&server, -1, &params) < 0)
+		return fprintf(stderr, "broadcast: init failed\n"), -1;
+
+	for (i = 0; i < sizeof msg; ++i)
+		msg[i] = (unsigned char) i;
+	n = websocket_message(WEBSOCKET_FIN | WEBSOCKET_BINARY, NULL, expect, sizeof expect, msg, sizeof msg);
+	m = websocket_message(WEBSOCKET_FIN | WEBSOCKET_TEXT, NULL, after, sizeof after, "after", 5);
+
+	for (count = 0; count < 3 && err == 0; ++count)
+		if (peer_connect(&server, &fds[count]) < 0) {
+			err = -1;
+			break;
+		}
+
+	if (err == 0 && (peer_send(fds[0], WEBSOCKET_TEXT, "frag", 4) < 0 || peer_quiet(&server, fds[0]) < 0))
+		err = -1;
+
+	if (err == 0 && websocket_broadcast(
+			&server, server.conns, server.count, WEBSOCKET_FIN | WEBSOCKET_BINARY, msg, sizeof msg) != 3) {
+		fprintf(stderr, "broadcast: not taken by every connection\n");
+		err = -1;
+	}
+
+	if (err == 0 && websocket_conn_send(server.conns[1], WEBSOCKET_FIN | WEBSOCKET_TEXT, "after", 5) < 0)
+		err = -1;
+
+	if (err == 0 && (peer_quiet(&server, fds[0]) < 0 ||
+			peer_expect(&server, fds[1], expect, n) < 0 || peer_expect(&server, fds[1], after, m) < 0 ||
+			peer_expect(&server, fds[2], expect, n) < 0))
+		err = -1;
+
+	if (err == 0 && (peer_send(fds[0], WEBSOCKET_FIN | WEBSOCKET_CONTINUATION, "ment", 4) < 0 ||
+			peer_expect(&server, fds[0], expect, n) < 0))
+		err = -1;
+
+	/* with nothing queued in front, a message sent mid-message still waits */
+	if (err == 0 && (peer_send(fds[0], WEBSOCKET_TEXT, "frag", 4) < 0 || peer_quiet(&server, fds[0]) < 0 ||
+			websocket_conn_send(server.conns[0], WEBSOCKET_FIN | WEBSOCKET_TEXT, "after", 5) < 0 ||
+			peer_quiet(&server, fds[0]) < 0))
+		err = -1;
+
+	if (err == 0 && (peer_send(fds[0], WEBSOCKET_FIN | WEBSOCKET_CONTINUATION, "ment", 4) < 0 ||
+			peer_expect(&server, fds[0], after, m) < 0))
+		err = -1;
+
+	for (i = 0; i < count; ++i)
+		close(fds[i]);
+
+	websocket_server_release(&server);
+	return err;
+}
+
+static int check_engine_broadcast(void) {
+	size_t i;
+
+	for (i = 0; i < sizeof backends / sizeof backends[0]; ++i)
+		if (engine_broadcast(backends[i]) < 0)
+			return fprintf(stderr, "engine/broadcast: flags %u\n", backends[i]), -1;
+
+	return 0;
+}
+
+static struct websocket_conn *opened;
+static int pressures[4];
+static int npressures;
+
+static void keep_open(struct websocket_conn *conn) {
+	opened = conn;
+}
+
+static void count_pressure(struct websocket_conn *conn, int paused) {
+	(void) conn;
+	if (npressures < 4)
+		pressures[npressures] = paused;
+	++npressures;
+}
+
+/* A peer that stops reading pauses its connection once the queue reaches
+   highwater, and resumes it once it has read the queue down to lowwater;
+   nothing is lost on the way. */
+static int engine_pressure(unsigned flags) {
+	static unsigned char msg[1024], buf[PIPESIZE];
+	struct websocket_server_params params = {0};
+	struct websocket_server server;
+	size_t sent = 0, got = 0;
+	ssize_t n;
+	int i, fd, err = 0;
+
+	params.handler = &quiet_handler;
+	params.open = &keep_open;
+	params.pressure = &count_pressure;
+	params.highwater = 64 * 1024;
+	params.lowwater = 16 * 1024;
+	params.flags = flags;
+	npressures = 0;
+
+	if (websocket_server_init(&server, -1, &params) < 0)
+		return fprintf(stderr, "pressure: init failed\n"), -1;
+
+	if (peer_connect(&server, &fd) < 0)
+		err = -1;
+	else {
+		memset(msg, 'x', sizeof msg);
+		while (npressures == 0 && sent < 64 * 1024 * 1024) {
+			if ((n = websocket_conn_send(opened, WEBSOCKET_FIN | WEBSOCKET_BINARY, msg, sizeof msg)) < 0)
+				break;
+			sent += n;
+			websocket_server_poll(&server, 0);
+		}
+
+		if (npressures != 1 || pressures[0] != 1 || server.npaused != 1) {
+			fprintf(stderr, "pressure: not paused after %zu bytes\n", sent);
+			err = -1;
+		}
+
+		/* on io_uring the last send can complete after its bytes are in */
+		for (i = 0; err == 0 && (got < sent || server.qbytes > 0) && i < 1000; ++i) {
+			websocket_server_poll(&server, 1);
+			while ((n = recv(fd, buf, sizeof buf, MSG_DONTWAIT)) > 0)
+				got += n;
+		}
+
+		if (err == 0 && (npressures != 2 || pressures[1] != 0 || server.npaused != 0 ||
+				server.ndropped != 0 || got != sent || server.qbytes != 0)) {
+			fprintf(stderr, "pressure: %d calls, %zu of %zu bytes back\n", npressures, got, sent);
+			err = -1;
+		}
+
+		close(fd);
+	}
+
+	websocket_server_release(&server);
+	return err;
+}
+
+static int check_engine_pressure(void) {
+	size_t i;
+
+	for (i = 0; i < sizeof backends / sizeof backends[0]; ++i)
+		if (engine_pressure(backends[i]) < 0)
+			return fprintf(stderr, "engine/pressure: flags %u\n", backends[i]), -1;
+
+	return 0;
+}
+
+/* on a worker, after a delay that differs from message to message */
+static void slow_echo(struct websocket_job *job) {
+	volatile unsigned spin;
+
+	for (spin = 0; spin < (job->data[1] & 7u) * 1000u; ++spin)
+		;
+
+	websocket_job_reply(job, WEBSOCKET_FIN | job->op, job->data, job->len);
+}
+
+/* Bursts from two peers, worked on by several threads with delays that vary,
+   come back to each peer in the order it sent them. */
+static int engine_workers(unsigned flags, struct websocket_workers *workers) {
+	static unsigned char burst[2][PIPESIZE], expect[2][PIPESIZE];
+	unsigned char mask[4] = {0x11, 0x22, 0x33, 0x44}, msg[2];
+	struct websocket_server_params params = {0};
+	struct websocket_server server;
+	size_t k, i, len[2], explen[2];
+	ssize_t n;
+	int fds[2], count, err = 0;
+
+	params.work = &slow_echo;
+	params.workers = workers;
+	params.flags = flags;
+
+	if (websocket_server_init(&server, -1, &params) < 0)
+		return fprintf(stderr, "workers: init failed\n"), -1;
+
+	for (count = 0; count < 2 && err == 0; ++count)
+		if (peer_connect(&server, &fds[count]) < 0) {
+			err = -1;
+			break;
+		}
+
+	for (k = 0; err == 0 && k < 2; ++k) {
+		for (i = 0, len[k] = 0, explen[k] = 0; i < 48; ++i) {
+			msg[0] = (unsigned char) k;
+			msg[1] = (unsigned char) i;
+			len[k] += websocket_message(
+				WEBSOCKET_FIN | WEBSOCKET_BINARY, mask, burst[k] + len[k], PIPESIZE - len[k], msg, 2);
+			explen[k] += websocket_message(
+				WEBSOCKET_FIN | WEBSOCKET_BINARY, NULL, expect[k] + explen[k], PIPESIZE - explen[k], msg, 2);
+		}
+
+		if ((n = send(fds[k], burst[k], len[k], 0)) < 0 || (size_t) n != len[k]) {
+			fprintf(stderr, "workers: peer send failed\n");
+			err = -1;
+		}
+	}
+
+	for (k = 0; err == 0 && k < 2; ++k)
+		if (peer_expect(&server, fds[k], expect[k], explen[k]) < 0)
+			err = -1;
+
+	while (count > 0)
+		close(fds[--count]);
+
+	websocket_server_release(&server);
+	return err;
+}
+
+static int check_engine_workers(void) {
+	struct websocket_workers *workers;
+	size_t i;
+	int err = 0;
+
+	if ((workers = websocket_workers_create(4)) == NULL)
+		return fprintf(stderr, "workers: create failed\n"), -1;
+
+	for (i = 0; err == 0 && i < sizeof backends / sizeof backends[0]; ++i)
+		if (engine_workers(backends[i], workers) < 0) {
+			fprintf(stderr, "engine/workers: flags %u\n", backends[i]);
+			err = -1;
+		}
+
+	websocket_workers_destroy(workers);
+	return err;
+}
+
+/* a poll that sends what is due leaves the peer nothing to read */
+static int peer_held(struct websocket_server *server, int fd) {
+	unsigned char c;
+
+	websocket_server_poll(server, 0);
+	if (recv(fd, &c, 1, MSG_DONTWAIT) > 0)
+		return fprintf(stderr, "cork: peer got something early\n"), -1;
+
+	return 0;
+}
+
+/* Frames queued from outside the handler wait for the cork, all go out in one
+   write on a flush, and a frame left alone goes out once corkus is up. */
+static int engine_cork(unsigned flags) {
+	static const char *const text[] = {"one", "two", "three", "four"};
+	unsigned char expect[64];
+	struct websocket_server_params params = {0};
+	struct websocket_server server;
+	unsigned long long nsends;
+	size_t i, n = 0, m = 0;
+	int fd, err = 0;
+
+	params.handler = &quiet_handler;
+	params.corkus = 400000;
+	params.flags = flags;
+
+	if (websocket_server_init(&server, -1, &params) < 0)
+		return fprintf(stderr, "cork: init failed\n"), -1;
+
+	if (peer_connect(&server, &fd) < 0)
+		return websocket_server_release(&server), -1;
+
+	for (i = 0; i < 4; ++i)
+		n += websocket_message(
+			WEBSOCKET_FIN | WEBSOCKET_TEXT, NULL, expect + n, sizeof expect - n, text[i], strlen(text[i]));
+
+	for (i = 0; err == 0 && i < 3; ++i)
+		if (websocket_conn_send(server.conns[0], WEBSOCKET_FIN | WEBSOCKET_TEXT, text[i], strlen(text[i])) < 0)
+			err = -1;
+
+	m = n - (2 + strlen(text[3]));
+	nsends = server.nsends;
+
+	if (err == 0 && peer_held(&server, fd) < 0)
+		err = -1;
+
+	if (err == 0) {
+		websocket_conn_flush(server.conns[0]);
+		if (peer_expect(&server, fd, expect, m) < 0)
+			err = -1;
+		else if (server.nsends - nsends != 1) {
+			fprintf(stderr, "cork: %llu sends for a flush\n", server.nsends - nsends);
+			err = -1;
+		}
+	}
+
+	if (err == 0 && (websocket_conn_send(server.conns[0], WEBSOCKET_FIN | WEBSOCKET_TEXT, text[3], strlen(text[3])) < 0 ||
+			peer_held(&server, fd) < 0 || peer_expect(&server, fd, expect + m, n - m) < 0))
+		err = -1;
+
+	close(fd);
+	websocket_server_release(&server);
+	return err;
+}
+
+static int check_engine_cork(void) {
+	size_t i;
+
+	for (i = 0; i < sizeof backends / sizeof backends[0]; ++i)
+		if (engine_cork(backends[i]) < 0)
+			return fprintf(stderr, "engine/cork: flags %u\n", backends[i]), -1;
+
+	return 0;
+}
+
+/* A ping queued behind a large message, and the pong to a ping the peer sends
+   while that message is stuck in the socket, both come out between two of its
+   fragments instead of after the last one. */
+static int engine_lane(unsigned flags) {
+	static unsigned char msg[1024 * 1024], buf[sizeof msg + sizeof msg / 64];
+	unsigned char *p, op;
+	struct websocket_server_params params = {0};
+	struct websocket_server server;
+	size_t i, len, total, seen = 0, hdr;
+	int fd, n, ping = -1, pong = -1, err = 0;
+
+	params.handler = &quiet_handler;
+	params.highwater = 4 * sizeof msg;
+	params.fragsize = 16384;
+	params.flags = flags;
+
+	if (websocket_server_init(&server, -1, &params) < 0)
+		return fprintf(stderr, "lane: init failed\n"), -1;
+
+	if (peer_connect(&server, &fd) < 0)
+		return websocket_server_release(&server), -1;
+
+	for (i = 0; i < sizeof msg; ++i)
+		msg[i] = (unsigned char) (i * 7);
+
+	if (websocket_conn_send(server.conns[0], WEBSOCKET_FIN | WEBSOCKET_BINARY, msg, sizeof msg) < 0)
+		err = -1;
+
+	for (i = 0; err == 0 && i < 5; ++i)
+		websocket_server_poll(&server, 10);
+
+	if (err == 0 && (websocket_conn_send(server.conns[0], WEBSOCKET_FIN | WEBSOCKET_PING, "srv", 3) < 0 ||
+			peer_send(fd, WEBSOCKET_FIN | WEBSOCKET_PING, "cli", 3) < 0))
+		err = -1;
+
+	for (i = 0; err == 0 && i < 5; ++i)
+		websocket_server_poll(&server, 10);
+
+	/* 64 fragments with 4-byte headers, and the ping and pong */
+	total = sizeof msg + sizeof msg / params.fragsize * 4 + 2 * 5;
+	if (err == 0 && peer_recv(&server, fd, buf, total) != total) {
+		fprintf(stderr, "lane: short read\n");
+		err = -1;
+	}
+
+	for (n = 0, p = buf; err == 0 && p < buf + total; ++n, p += hdr + len) {
+		op = p[0] & 0x0f;
+		len = p[1] & 0x7f;
+		hdr = 2;
+		if (len == 126)
+			len = (size_t) p[2] << 8 | p[3], hdr = 4;
+
+		if (op == WEBSOCKET_PING && len == 3 && memcmp(p + hdr, "srv", 3) == 0)
+			ping = n;
+		else if (op == WEBSOCKET_PONG && len == 3 && memcmp(p + hdr, "cli", 3) == 0)
+			pong = n;
+		else if (op != (seen == 0 ? WEBSOCKET_BINARY : WEBSOCKET_CONTINUATION) ||
+				(p[0] & WEBSOCKET_FIN) != (seen + len == sizeof msg ? WEBSOCKET_FIN : 0) ||
+				memcmp(p + hdr, msg + seen, len) != 0) {
+			fprintf(stderr, "lane: frame %d is not the next fragment\n", n);
+			err = -1;
+		} else
+			seen += len;
+	}
+
+	if (err == 0 && (seen != sizeof msg || ping < 0 || pong < 0 || ping >= n - 1 || pong >= n - 1)) {
+		fprintf(stderr, "lane: ping at frame %d and pong at %d of %d\n", ping, pong, n);
+		err = -1;
+	}
+
+	close(fd);
+	websocket_server_release(&server);
+	return err;
+}
+
+static int check_engine_lane(void) {
+	size_t i;
+
+	for (i = 0; i < sizeof backends / sizeof backends[0]; ++i)
+		if (engine_lane(backends[i]) < 0)
+			return fprintf(stderr, "engine/lane: flags %u\n", backends[i]), -1;
+
+	return 0;
+}
+/* serve until the peer has had nothing for a tenth of a second */
+static size_t peer_drain(struct websocket_server *server, int fd, unsigned char *buf, size_t len) {
+	size_t off = 0;
+	ssize_t n;
+	int idle;
+
+	for (idle = 0; off < len && idle < 10; ++idle) {
+		websocket_server_poll(server, 10);
+		while (off < len && (n = recv(fd, buf + off, len - off, MSG_DONTWAIT)) > 0)
+			off += n, idle = 0;
+	}
+
+	return off;
+}
+
+/* Walk frames that carry msg in one binary message, as far as they go, and an
+   optional close after them; returns how much of msg came, or -1. */
+static long peer_frames(const unsigned char *p, size_t len, const unsigned char *msg, size_t total, int *closing) {
+	size_t hdr, n, seen = 0;
+	const unsigned char *end = p + len;
+
+	for (*closing = 0; p < end; p += hdr + n) {
+		n = p[1] & 0x7f;
+		hdr = 2;
+		if (n == 126 && end - p >= 4)
+			n = (size_t) p[2] << 8 | p[3], hdr = 4;
+		if ((size_t) (end - p) < hdr + n || *closing)
+			return -1;
+
+		if ((p[0] & 0x0f) == WEBSOCKET_CLOSE)
+			*closing = 1;
+		else if ((p[0] & 0x0f) != (seen == 0 ? WEBSOCKET_BINARY : WEBSOCKET_CONTINUATION) ||
+				(p[0] & WEBSOCKET_FIN) != (seen + n == total ? WEBSOCKET_FIN : 0) ||
+				memcmp(p + hdr, msg + seen, n) != 0)
+			return -1;
+		else
+			seen += n;
+	}
+
+	return (long) seen;
+}
+
+/* A file goes out as the fragments of one message, and the descriptor of the
+   server is closed once they are gone: sent whole, with a close behind them,
+   cut short by an abort, or refused with nothing queued. */
+static int engine_sendfile(unsigned flags) {
+	static unsigned char msg[1024 * 1024], buf[sizeof msg + sizeof msg / 64];
+	char path[] = "/tmp/check-XXXXXX";
+	struct websocket_server_params params = {0};
+	struct websocket_server server;
+	size_t i, len;
+	ssize_t total;
+	long seen;
+	int fd, file, probe, closing, err = 0;
+
+	for (i = 0; i < sizeof msg; ++i)
+		msg[i] = (unsigned char) (i * 13);
+
+	if ((file = mkstemp(path)) < 0)
+		return fprintf(stderr, "sendfile: no file\n"), -1;
+	unlink(path);
+	if (write(file, msg, sizeof msg) != (ssize_t) sizeof msg)
+		return close(file), fprintf(stderr, "sendfile: short write\n"), -1;
+
+	params.handler = &quiet_handler;
+	params.fragsize = 16384;
+	params.maxqueue = 2 * sizeof msg;
+	params.flags = flags;
+
+	if (websocket_server_init(&server, -1, &params) < 0)
+		return close(file), fprintf(stderr, "sendfile: init failed\n"), -1;
+
+	if (peer_connect(&server, &fd) < 0)
+		return close(file), websocket_server_release(&server), -1;
+
+	/* the server duplicates into the lowest free descriptor */
+	probe = dup(file);
+	close(probe);
+
+	len = 200000;
+	if ((total = websocket_conn_sendfile(server.conns[0], WEBSOCKET_FIN | WEBSOCKET_BINARY, file, 100, len)) < 0 ||
+			fcntl(probe, F_GETFD) < 0) {
+		fprintf(stderr, "sendfile: not queued\n");
+		err = -1;
+	}
+
+	if (err == 0 && (peer_recv(&server, fd, buf, total) != (size_t) total ||
+			peer_frames(buf, total, msg + 100, len, &closing) != (long) len || closing)) {
+		fprintf(stderr, "sendfile: peer did not get the file\n");
+		err = -1;
+	}
+
+	for (i = 0; err == 0 && fcntl(probe, F_GETFD) >= 0 && i < 100; ++i)
+		websocket_server_poll(&server, 10);
+	if (err == 0 && fcntl(probe, F_GETFD) >= 0) {
+		fprintf(stderr, "sendfile: descriptor left open after sending\n");
+		err = -1;
+	}
+
+	/* past maxqueue: nothing queued, nothing left open */
+	if (err == 0 && (websocket_conn_sendfile(server.conns[0], WEBSOCKET_FIN | WEBSOCKET_BINARY, file, 0, 3 * sizeof msg) !=
+			WEBSOCKET_NO_BUFFER_SPACE || server.qbytes != 0 || fcntl(probe, F_GETFD) >= 0)) {
+		fprintf(stderr, "sendfile: refused file left behind\n");
+		err = -1;
+	}
+
+	/* the peer holds off while a close is sent behind the file */
+	if (err == 0 && websocket_conn_sendfile(server.conns[0], WEBSOCKET_FIN | WEBSOCKET_BINARY, file, 0, sizeof msg) < 0)
+		err = -1;
+	for (i = 0; err == 0 && i < 5; ++i)
+		websocket_server_poll(&server, 10);
+
+	if (err == 0) {
+		websocket_conn_send(server.conns[0], WEBSOCKET_FIN | WEBSOCKET_CLOSE, "\x03\xe8", 2);
+		if (websocket_conn_sendfile(server.conns[0], WEBSOCKET_FIN | WEBSOCKET_BINARY, file, 0, 1) != WEBSOCKET_DATA_ERROR) {
+			fprintf(stderr, "sendfile: taken after close\n");
+			err = -1;
+		}
+	}
+
+	if (err == 0 && (peer_frames(buf, peer_drain(&server, fd, buf, sizeof buf), msg, sizeof msg, &closing) !=
+			(long) sizeof msg || !closing)) {
+		fprintf(stderr, "sendfile: close did not follow the file\n");
+		err = -1;
+	}
+
+	for (i = 0; err == 0 && fcntl(probe, F_GETFD) >= 0 && i < 100; ++i)
+		websocket_server_poll(&server, 10);
+	if (err == 0 && fcntl(probe, F_GETFD) >= 0) {
+		fprintf(stderr, "sendfile: descriptor left open after close\n");
+		err = -1;
+	}
+
+	close(fd);
+
+	/* an abort drops the fragments not started, and never half of one */
+	if (err == 0 && peer_connect(&server, &fd) < 0)
+		err = -1;
+	else if (err == 0) {
+		probe = dup(file);
+		close(probe);
+
+		if (websocket_conn_sendfile(server.conns[server.count - 1], WEBSOCKET_FIN | WEBSOCKET_BINARY, file, 0, sizeof msg) < 0)
+			err = -1;
+		for (i = 0; err == 0 && i < 5; ++i)
+			websocket_server_poll(&server, 10);
+		if (err == 0)
+			websocket_conn_abort(server.conns[server.count - 1]);
+
+		seen = peer_frames(buf, peer_drain(&server, fd, buf, sizeof buf), msg, sizeof msg, &closing);
+		if (err == 0 && (seen < 0 || seen == (long) sizeof msg || closing)) {
+			fprintf(stderr, "sendfile: abort sent %ld bytes of the file\n", seen);
+			err = -1;
+		}
+
+		for (i = 0; err == 0 && fcntl(probe, F_GETFD) >= 0 && i < 100; ++i)
+			websocket_server_poll(&server, 10);
+		if (err == 0 && fcntl(probe, F_GETFD) >= 0) {
+			fprintf(stderr, "sendfile: descriptor left open after abort\n");
+			err = -1;
+		}
+
+		close(fd);
+	}
+
+	close(file);
+	websocket_server_release(&server);
+	return err;
+}
+
+static int check_engine_sendfile(void) {
+	size_t i;
+
+	for (i = 0; i < sizeof backends / sizeof backends[0]; ++i)
+		if (engine_sendfile(backends[i]) < 0)
+			return fprintf(stderr, "engine/sendfile: flags %u\n", backends[i]), -1;
+
+	return 0;
+}
+
+/* A close sent while a large message is still queued goes out after all of it,
+   and so does the end of websocket_conn_close; sends after either are refused. */
+static int engine_close(unsigned flags) {
+	static unsigned char msg[1024 * 1024], buf[sizeof msg + sizeof msg / 64];
+	unsigned char expect[64];
+	struct websocket_server_params params = {0};
+	struct websocket_server server;
+	struct websocket_conn *conn;
+	size_t i;
+	ssize_t n;
+	int fd, closing, err = 0;
+
+	params.handler = &quiet_handler;
+	params.fragsize = 16384;
+	params.flags = flags;
+
+	for (i = 0; i < sizeof msg; ++i)
+		msg[i] = (unsigned char) (i * 5);
+
+	if (websocket_server_init(&server, -1, &params) < 0)
+		return fprintf(stderr, "close: init failed\n"), -1;
+
+	if (peer_connect(&server, &fd) < 0)
+		return websocket_server_release(&server), -1;
+
+	conn = server.conns[0];
+	if (websocket_conn_send(conn, WEBSOCKET_FIN | WEBSOCKET_BINARY, msg, sizeof msg) < 0 ||
+			websocket_conn_send(conn, WEBSOCKET_FIN | WEBSOCKET_CLOSE, "\x03\xe8", 2) < 0 ||
+			websocket_conn_send(conn, WEBSOCKET_FIN | WEBSOCKET_TEXT, "late", 4) != WEBSOCKET_DATA_ERROR) {
+		fprintf(stderr, "close: sends around the close\n");
+		err = -1;
+	}
+
+	if (err == 0 && (peer_frames(buf, peer_drain(&server, fd, buf, sizeof buf), msg, sizeof msg, &closing) !=
+			(long) sizeof msg || !closing)) {
+		fprintf(stderr, "close: the message did not come whole before the close\n");
+		err = -1;
+	}
+
+	close(fd);
+
+	if (err == 0 && peer_connect(&server, &fd) < 0)
+		err = -1;
+	else if (err == 0) {
+		conn = server.conns[server.count - 1];
+		n = websocket_message(WEBSOCKET_FIN | WEBSOCKET_TEXT, NULL, expect, sizeof expect, "last", 4);
+
+		if (websocket_conn_send(conn, WEBSOCKET_FIN | WEBSOCKET_TEXT, "last", 4) < 0)
+			err = -1;
+		websocket_conn_close(conn);
+		if (err == 0 && websocket_conn_send(conn, WEBSOCKET_FIN | WEBSOCKET_TEXT, "late", 4) != WEBSOCKET_DATA_ERROR) {
+			fprintf(stderr, "close: taken after websocket_conn_close\n");
+			err = -1;
+		}
+
+		if (err == 0 && (peer_drain(&server, fd, buf, sizeof buf) != (size_t) n || memcmp(buf, expect, n) != 0)) {
+			fprintf(stderr, "close: websocket_conn_close lost what was sent\n");
+			err = -1;
+		}
+
+		close(fd);
+	}
+
+	websocket_server_release(&server);
+	return err;
+}
+
+static int check_engine_close(void) {
+	size_t i;
+
+	for (i = 0; i < sizeof backends / sizeof backends[0]; ++i)
+		if (engine_close(backends[i]) < 0)
+			return fprintf(stderr, "engine/close: flags %u\n", backends[i]), -1;
+
+	return 0;
+}
+#endif
+
+static const struct {
+	const char *name;
+	int (*check)(void);
+} checks[] = {
+	{"messagev", &check_messagev},
+	{"readframes", &check_readframes},
+	{"inline", &check_inline},
+	{"handshake/trickle", &check_handshake_trickle},
+	{"assembly", &check_assembly},
+	{"control", &check_control},
+	{"mask", &check_mask},
+	{"utf8", &check_utf8},
+	{"wheel", &check_wheel},
+	{"roundtrip", &check_roundtrip},
+	{"handshake/status", &check_handshake_status},
+#if WEBSOCKET_DEFLATE
+	{"deflate/empty", &check_deflate_empty},
+	{"deflate/rsv1", &check_deflate_rsv1},
+#endif
+#if WEBSOCKET_STATS
+	{"stats", &check_stats},
+#endif
+#if __linux__
+	{"engine/echo", &check_engine_echo},
+	{"engine/broadcast", &check_engine_broadcast},
+	{"engine/pressure", &check_engine_pressure},
+	{"engine/workers", &check_engine_workers},
+	{"engine/cork", &check_engine_cork},
+	{"engine/lane", &check_engine_lane},
+	{"engine/sendfile", &check_engine_sendfile},
+	{"engine/close", &check_engine_close},
+#endif
+};
+
+int main(void) {
+	size_t i;
+	int failed = 0;
+
+	for (i = 0; i < sizeof checks / sizeof checks[0]; ++i)
+		if (checks[i].check() < 0) {
+			printf("FAIL %s\n", checks[i].name);
+			++failed;
+		} else
+			printf("ok   %s\n", checks[i].name);
+
+	return failed != 0;
+}
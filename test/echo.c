@@ -0,0 +1,56 @@
+
+#ifndef _nofeatures
+# if _WIN32
+#  define WIN32_LEAN_AND_MEAN 1
+# elif __linux__
+#  define _BSD_SOURCE 1
+#  define _DEFAULT_SOURCE 1
+#  define _POSIX_C_SOURCE 200809L
+#  define _SVID_SOURCE 1
+# elif __APPLE__
+#  define _DARWIN_C_SOURCE 1
+# endif
+#endif /* _nofeatures */
+
+#include "aw-websocket.h"
+#include "echoloop.h"
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+int main(int argc, char *argv[]) {
+	struct sockaddr_in sin;
+	int lfd, c, one = 1, port = 9001, fanout = 0;
+	unsigned flags = 0, workers = 0, corkus = 0;
+
+	while ((c = getopt(argc, argv, "BEp:w:u:")) != -1)
+		switch (c) {
+		case 'B': fanout = 1; break;
+		case 'E': flags |= WEBSOCKET_SERVER_EPOLL; break;
+		case 'p': port = atoi(optarg); break;
+		case 'w': workers = strtoul(optarg, NULL, 0); break;
+		case 'u': corkus = strtoul(optarg, NULL, 0); break;
+		default: return fprintf(stderr, "usage: %s [-B] [-E] [-p port] [-w workers] [-u corkus]\n", argv[0]), 2;
+		}
+
+	signal(SIGPIPE, SIG_IGN);
+
+	memset(&sin, 0, sizeof sin);
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(port);
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	if ((lfd = socket(AF_INET, SOCK_STREAM, 0)) < 0 ||
+			setsockopt(lfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof one) < 0 ||
+			bind(lfd, (struct sockaddr *) &sin, sizeof sin) < 0 ||
+			listen(lfd, 4096) < 0)
+		return perror("listen"), 1;
+
+	printf("[%d] echo listening on 127.0.0.1:%d\n", getpid(), port);
+	return echoloop(lfd, NULL, 0, flags, fanout, workers, corkus) < 0;
+}
@@ -0,0 +1,121 @@
+
+#ifndef _nofeatures
+# if _WIN32
+#  define WIN32_LEAN_AND_MEAN 1
+# elif __linux__
+#  define _BSD_SOURCE 1
+#  define _DEFAULT_SOURCE 1
+#  define _POSIX_C_SOURCE 200809L
+#  define _SVID_SOURCE 1
+# elif __APPLE__
+#  define _DARWIN_C_SOURCE 1
+# endif
+#endif /* _nofeatures */
+
+#include "echoloop.h"
+#include "aw-websocket.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static unsigned long long frames; /* echoed or fanned out */
+
+static ssize_t echo(int op, void *dst, size_t size, const void *src, size_t len, void *userdata) {
+	struct websocket_conn *conn = userdata;
+	struct websocket_frame frame;
+	ssize_t off = 0;
+
+	(void) op;
+
+	if (conn->state.offset == 0) {
+		frames++;
+		memset(&frame, 0, sizeof frame);
+		frame.length = conn->state.frame.length;
+		frame.header[0] = conn->state.frame.header[0];
+
+		if ((off = websocket_writeframe(dst, size, &frame)) < 0)
+			return off;
+	}
+
+	return websocket_writedata(dst, off, size, src, len);
+}
+
+/* on a worker thread, once the message is complete */
+static void echowork(struct websocket_job *job) {
+	__atomic_add_fetch(&frames, 1, __ATOMIC_RELAXED);
+	websocket_job_reply(job, WEBSOCKET_FIN | job->op, job->data, job->len);
+}
+
+static unsigned char *frame;
+static size_t framesize;
+
+/* Collect each frame and fan it out to every connection, the sender included. */
+static ssize_t broadcast(int op, void *dst, size_t size, const void *src, size_t len, void *userdata) {
+	struct websocket_conn *conn = userdata;
+	struct websocket_server *server = conn->server;
+	unsigned long long length = conn->state.frame.length;
+	unsigned char *p;
+
+	(void) op;
+	(void) dst;
+	(void) size;
+
+	if (length > framesize) {
+		if ((p = realloc(frame, length)) == NULL)
+			return WEBSOCKET_NO_BUFFER_SPACE;
+		frame = p;
+		framesize = length;
+	}
+
+	memcpy(frame + conn->state.offset, src, len);
+
+	if (conn->state.offset + len == length)
+		frames += websocket_broadcast(server, server->conns, server->count, conn->state.frame.header[0], frame, length);
+
+	return 0;
+}
+
+int echoloop(int lfd, const int *fds, size_t count, unsigned flags, int fanout, unsigned workers, unsigned corkus) {
+	struct websocket_server server;
+	struct websocket_server_params params;
+	size_t i;
+
+	memset(&params, 0, sizeof params);
+	params.handler = fanout ? &broadcast : &echo;
+	params.flags = flags;
+	params.corkus = corkus;
+
+	if (workers > 0 && !fanout) {
+		if ((params.workers = websocket_workers_create(workers)) == NULL)
+			return perror("websocket_workers_create"), -1;
+		params.work = &echowork;
+	}
+
+	if (websocket_server_init(&server, lfd, &params) < 0)
+		return perror("websocket_server_init"), -1;
+
+	fprintf(stderr, "[%d] %s using %s\n",
+		getpid(), fanout ? "broadcast" : params.work != NULL ? "echo on workers" : "echo",
+		server.uring != NULL ? "io_uring" : "epoll");
+
+	for (i = 0; i < count; ++i)
+		if (websocket_server_adopt(&server, fds[i]) < 0)
+			return perror("websocket_server_adopt"), -1;
+
+	while (lfd >= 0 || server.count > 0)
+		if (websocket_server_poll(&server, -1) < 0)
+			return perror("websocket_server_poll"), websocket_server_release(&server), -1;
+
+	/* one write per frame is what sending each on its own would cost */
+	if (frames > 0)
+		fprintf(stderr, "[%d] %llu sends for %llu frames: %.3f per frame, %.1f%% saved\n",
+			getpid(), server.nsends, frames, (double) server.nsends / frames,
+			100.0 * (1.0 - (double) server.nsends / frames));
+
+	websocket_server_release(&server);
+	if (params.workers != NULL)
+		websocket_workers_destroy(params.workers);
+	free(frame);
+	return 0;
+}
@@ -0,0 +1,16 @@
+
+#ifndef ECHOLOOP_H
+#define ECHOLOOP_H
+
+#include <stddef.h>
+
+/* Serve websocket echo on the listening socket lfd (or -1) and on the
+   already connected fds until no connections remain. flags are passed
+   on as websocket_server_params.flags. With fanout, every frame received
+   is broadcast to all connections instead of echoed to its sender. With
+   workers, messages are echoed whole from that many worker threads. corkus
+   is passed on as websocket_server_params.corkus. Sends per frame are
+   reported on exit. */
+int echoloop(int lfd, const int *fds, size_t count, unsigned flags, int fanout, unsigned workers, unsigned corkus);
+
+#endif /* ECHOLOOP_H */
@@ -0,0 +1,226 @@
+
+#ifndef _nofeatures
+# if _WIN32
+#  define WIN32_LEAN_AND_MEAN 1
+# elif __linux__
+#  define _BSD_SOURCE 1
+#  define _DEFAULT_SOURCE 1
+#  define _POSIX_C_SOURCE 200809L
+#  define _SVID_SOURCE 1
+# elif __APPLE__
+#  define _DARWIN_C_SOURCE 1
+# endif
+#endif /* _nofeatures */
+
+#include "aw-websocket.h"
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* Memory per idle connection: upgrade many connections through the engine, then
+   measure how much this process grew. Client ends are passed to a child that only
+   holds them open, so the server ends alone count against the descriptor limit. */
+
+#define BATCH (128)
+
+static const char request[] =
+	"GET /chat HTTP/1.1\r\n"
+	"Host: server.example.com\r\n"
+	"Upgrade: websocket\r\n"
+	"Connection: Upgrade\r\n"
+	"Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+	"Sec-WebSocket-Version: 13\r\n"
+	"\r\n";
+
+static ssize_t discard(int op, void *dst, size_t size, const void *src, size_t len, void *userdata) {
+	(void) op;
+	(void) dst;
+	(void) size;
+	(void) src;
+	(void) len;
+	(void) userdata;
+	return 0;
+}
+
+static size_t rss(void) {
+	unsigned long size, resident = 0;
+	FILE *f;
+
+	if ((f = fopen("/proc/self/statm", "r")) != NULL) {
+		if (fscanf(f, "%lu %lu", &size, &resident) != 2)
+			resident = 0;
+		fclose(f);
+	}
+
+	return resident * sysconf(_SC_PAGESIZE);
+}
+
+static int sendfds(int sd, const int *fds, size_t count) {
+	union {
+		struct cmsghdr hdr;
+		char buf[CMSG_SPACE(BATCH * sizeof (int))];
+	} u;
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	struct iovec iov;
+	char c = 0;
+
+	memset(&msg, 0, sizeof msg);
+	iov.iov_base = &c;
+	iov.iov_len = 1;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = u.buf;
+	msg.msg_controllen = CMSG_SPACE(count * sizeof (int));
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(count * sizeof (int));
+	memcpy(CMSG_DATA(cmsg), fds, count * sizeof (int));
+
+	return sendmsg(sd, &msg, 0) == 1 ? 0 : -1;
+}
+
+/* keep every descriptor received until the parent hangs up */
+static void hold(int sd) {
+	union {
+		struct cmsghdr hdr;
+		char buf[CMSG_SPACE(BATCH * sizeof (int))];
+	} u;
+	struct msghdr msg;
+	struct iovec iov;
+	char c;
+
+	for (;;) {
+		memset(&msg, 0, sizeof msg);
+		iov.iov_base = &c;
+		iov.iov_len = 1;
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = u.buf;
+		msg.msg_controllen = sizeof u.buf;
+
+		if (recvmsg(sd, &msg, 0) <= 0)
+			break;
+	}
+}
+
+static size_t upgraded(struct websocket_server *server) {
+	size_t i, n = 0;
+
+	for (i = 0; i < server->count; ++i)
+		n += server->conns[i]->state.http == NULL;
+
+	return n;
+}
+
+/* open count more connections and wait until every one is upgraded */
+static int fill(struct websocket_server *server, int ctl, size_t count) {
+	int pair[2], fds[BATCH];
+	size_t i, j, n, total = server->count + count;
+
+	for (i = 0; i < count; i += n) {
+		for (n = 0; n < BATCH && i + n < count; ++n) {
+			if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair) < 0)
+				return perror("socketpair"), -1;
+			if (write(pair[0], request, sizeof request - 1) != sizeof request - 1)
+				return perror("write"), -1;
+			if (websocket_server_adopt(server, pair[1]) < 0)
+				return perror("websocket_server_adopt"), -1;
+			fds[n] = pair[0];
+		}
+
+		if (sendfds(ctl, fds, n) < 0)
+			return perror("sendmsg"), -1;
+
+		for (j = 0; j < n; ++j)
+			close(fds[j]);
+
+		while (websocket_server_poll(server, 0) > 0)
+			;
+	}
+
+	while (upgraded(server) < total)
+		if (websocket_server_poll(server, 10) < 0)
+			return perror("websocket_server_poll"), -1;
+
+	return 0;
+}
+
+int main(int argc, char *argv[]) {
+	struct websocket_server server;
+	struct websocket_server_params params;
+	struct rlimit rl;
+	int ctl[2], c;
+	size_t conns = 1000000, before, middle, after;
+	unsigned flags = 0;
+	pid_t pid;
+
+	while ((c = getopt(argc, argv, "Ec:")) != -1)
+		switch (c) {
+		case 'E': flags |= WEBSOCKET_SERVER_EPOLL; break;
+		case 'c': conns = strtoul(optarg, NULL, 0); break;
+		default: return fprintf(stderr, "usage: %s [-E] [-c conns]\n", argv[0]), 2;
+		}
+
+	signal(SIGPIPE, SIG_IGN);
+
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+		rl.rlim_cur = rl.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rl);
+
+		if (rl.rlim_cur != RLIM_INFINITY && conns + 64 > rl.rlim_cur) {
+			fprintf(stderr, "RLIMIT_NOFILE is %lu, using %lu connections\n",
+				(unsigned long) rl.rlim_cur, (unsigned long) rl.rlim_cur - 64);
+			conns = rl.rlim_cur - 64;
+		}
+	}
+
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, ctl) < 0)
+		return perror("socketpair"), 1;
+
+	if ((pid = fork()) < 0)
+		return perror("fork"), 1;
+
+	if (pid == 0) {
+		close(ctl[0]);
+		hold(ctl[1]);
+		_exit(0);
+	}
+
+	close(ctl[1]);
+
+	memset(&params, 0, sizeof params);
+	params.handler = &discard;
+	params.flags = flags;
+
+	if (websocket_server_init(&server, -1, &params) < 0)
+		return perror("websocket_server_init"), 1;
+
+	/* the second half shows the cost per connection once shared pools are warm */
+	before = rss();
+	if (fill(&server, ctl[0], conns / 2) < 0)
+		return 1;
+	middle = rss();
+	if (fill(&server, ctl[0], conns - conns / 2) < 0)
+		return 1;
+	after = rss();
+
+	printf("connections %zu, %s\n", conns, server.uring != NULL ? "io_uring" : "epoll");
+	printf("record %zu B, state %zu B, handshake %zu B (borrowed until upgraded)\n",
+		sizeof (struct websocket_conn), sizeof (struct websocket_state), sizeof (struct websocket_http));
+	printf("rss grew %.1f MB: %.0f B per idle connection, %.0f B at the margin\n",
+		(after - before) / 1e6, (double) (after - before) / conns,
+		(double) (after - middle) / (conns - conns / 2));
+
+	close(ctl[0]);
+	waitpid(pid, NULL, 0);
+	websocket_server_release(&server);
+	return 0;
+}
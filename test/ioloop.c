@@ -1,25 +1,77 @@
 
 #include "ioloop.h"
+#include "aw-websocket.h"
 #include <errno.h>
+#include <stdlib.h>
 #include <string.h>
 
+#if __linux__
+
+/* Reads land in a mirrored ring, so whatever is left over stays contiguous in
+   front of the next read and nothing is moved. */
 ssize_t ioloop(
-		ssize_t fd, void *buffer, size_t size, ioloop_read *read,
+		ssize_t fd, size_t size, ioloop_read *read,
 		ioloop_handle *handle, void *cookie) {
-	char *p = buffer;
+	struct websocket_ring ring;
+	ssize_t err;
+	int more = 0;
+
+	if (websocket_ring_init(&ring, size) < 0)
+		return -errno;
+
+	for (;;) {
+		if (websocket_ring_len(&ring) == 0 || more) {
+			if (websocket_ring_avail(&ring) == 0) {
+				err = -ENOMEM;
+				break;
+			}
+
+			if ((err = read(fd, websocket_ring_space(&ring), websocket_ring_avail(&ring), cookie)) <= 0)
+				break;
+
+			websocket_ring_produce(&ring, err);
+			more = 0;
+		}
+
+		if ((err = handle(websocket_ring_data(&ring), websocket_ring_len(&ring), ring.size, cookie)) < 0) {
+			if (err != -EAGAIN)
+				break;
+
+			more = 1;
+			continue;
+		}
+
+		websocket_ring_consume(&ring, err);
+	}
+
+	websocket_ring_release(&ring);
+	return err;
+}
+
+#else
+
+ssize_t ioloop(
+		ssize_t fd, size_t size, ioloop_read *read,
+		ioloop_handle *handle, void *cookie) {
+	char *buffer, *p;
 	size_t n = 0;
 	ssize_t err;
 	int more = 0;
 
+	if ((p = buffer = malloc(size)) == NULL)
+		return -ENOMEM;
+
 	for (;;) {
 		if (n == 0 || more) {
-			if (n == size)
-				return -ENOMEM;
+			if (n == size) {
+				err = -ENOMEM;
+				break;
+			}
 
 			memmove(buffer, p, n);
 
-			if ((err = read(fd, (char *) buffer + n, size - n, cookie)) <= 0)
-				return err;
+			if ((err = read(fd, buffer + n, size - n, cookie)) <= 0)
+				break;
 
 			p = buffer;
 			n += err;
@@ -28,13 +80,18 @@ ssize_t ioloop(
 
 		if ((err = handle(p, n, size, cookie)) < 0) {
 			if (err != -EAGAIN)
-				return err;
+				break;
 
 			more = 1;
+			continue;
 		}
 
 		p += err;
 		n -= err;
 	}
+
+	free(buffer);
+	return err;
 }
 
+#endif
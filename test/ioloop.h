@@ -7,8 +7,10 @@
 typedef ssize_t (ioloop_read)(ssize_t fd, void *p, size_t size, void *cookie);
 typedef ssize_t (ioloop_handle)(void *p, size_t len, size_t size, void *cookie);
 
+/* Read into a buffer of at least size bytes and hand everything unconsumed to
+   handle, which returns how much it used or -EAGAIN to wait for more. */
 ssize_t ioloop(
-	ssize_t fd, void *buffer, size_t size, ioloop_read *read,
+	ssize_t fd, size_t size, ioloop_read *read,
 	ioloop_handle *handle, void *cookie);
 
 #endif /* IOLOOP_H */
@@ -0,0 +1,405 @@
+
+#ifndef _nofeatures
+# if _WIN32
+#  define WIN32_LEAN_AND_MEAN 1
+# elif __linux__
+#  define _BSD_SOURCE 1
+#  define _DEFAULT_SOURCE 1
+#  define _POSIX_C_SOURCE 200809L
+#  define _SVID_SOURCE 1
+# elif __APPLE__
+#  define _DARWIN_C_SOURCE 1
+# endif
+#endif /* _nofeatures */
+
+#include "aw-websocket.h"
+#include "echoloop.h"
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define INSIZE (4096)
+
+#define HANDSHAKE (0)
+#define RUN (1)
+#define DONE (2)
+
+struct client {
+	int sd;
+	int state;
+	size_t sent;
+	size_t issued;
+	size_t echoed;
+	unsigned long long left;
+	double *t0; /* per message in flight */
+	size_t inlen;
+	size_t outoff;
+	size_t outlen;
+	unsigned char nonce[WEBSOCKET_NONCESIZE];
+	unsigned char *out;
+	unsigned char in[INSIZE];
+};
+
+static size_t conns = 100;
+static size_t msgsize = 64;
+static size_t fragments = 1;
+static size_t messages = 1000;
+static size_t burst = 1;
+static const char *host = "127.0.0.1";
+static int port = 9001;
+static int fanout;
+
+static unsigned char *payload;
+static size_t outsize;
+static double *rtts;
+static size_t nrtts;
+static size_t delivered;
+static size_t upgraded;
+static struct client *sender;
+static struct websocket_random rng;
+
+static double now(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static int cmp_double(const void *a, const void *b) {
+	double x = *(const double *) a, y = *(const double *) b;
+	return (x > y) - (x < y);
+}
+
+static int send_message(struct client *client) {
+	size_t i, off, n, fraglen = (msgsize + fragments - 1) / fragments;
+	unsigned char op;
+	ssize_t err;
+
+	for (i = 0, off = 0; i < fragments; ++i, off += n) {
+		n = off + fraglen < msgsize ? fraglen : msgsize - off;
+		op = (i == 0 ? WEBSOCKET_BINARY : WEBSOCKET_CONTINUATION) | (i + 1 == fragments ? WEBSOCKET_FIN : 0);
+
+		if ((err = websocket_clientmessage(
+				&rng, op, client->out + client->outlen, outsize - client->outlen,
+				payload + off, n)) < 0)
+			return fprintf(stderr, "websocket_clientmessage err=%zd\n", err), -1;
+
+		client->outlen += err;
+	}
+
+	client->t0[client->issued++ % burst] = now();
+	return 0;
+}
+
+/* keep up to burst messages in flight */
+static int send_messages(struct client *client) {
+	while (client->issued < messages && client->issued - client->sent < burst)
+		if (send_message(client) < 0)
+			return -1;
+
+	return 0;
+}
+
+static int client_flush(struct client *client) {
+	ssize_t err;
+
+	while (client->outoff < client->outlen) {
+		if ((err = send(
+				client->sd, client->out + client->outoff, client->outlen - client->outoff,
+				MSG_NOSIGNAL)) < 0)
+			return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+		client->outoff += err;
+	}
+
+	client->outoff = client->outlen = 0;
+	return 0;
+}
+
+static int client_read(struct client *client) {
+	struct websocket_frame frame;
+	size_t off = 0;
+	ssize_t err;
+
+	if ((err = recv(client->sd, client->in + client->inlen, sizeof client->in - client->inlen, 0)) == 0)
+		return -1;
+	if (err < 0)
+		return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+
+	client->inlen += err;
+
+
+	if (client->state == HANDSHAKE) {
+		if ((err = websocket_readresponse(client->in, client->inlen, client->nonce)) < 0)
+			return client->inlen == sizeof client->in ? -1 : 1;
+
+		off = err;
+		client->state = RUN;
+
+		/* with fan-out, one client sends once everyone listens */
+		if (!fanout) {
+			if (send_messages(client) < 0)
+				return -1;
+		} else if (++upgraded == conns && (send_messages(sender) < 0 || client_flush(sender) < 0))
+			return -1;
+	}
+
+	while (client->state == RUN && off < client->inlen) {
+		if (client->left == 0) {
+			if ((err = websocket_readframe(client->in + off, client->inlen - off, &frame)) < 0)
+				break;
+			off += err;
+			client->left = frame.length;
+		}
+
+		err = client->inlen - off < client->left ? client->inlen - off : client->left;
+		client->left -= err;
+		client->echoed += err;
+		off += err;
+
+		if (client->left == 0 && client->echoed == msgsize) {
+			client->echoed = 0;
+			delivered++;
+
+			if (fanout && client != sender) {
+				if (++client->sent == messages)
+					client->state = DONE;
+				continue;
+			}
+
+			rtts[nrtts++] = now() - client->t0[client->sent % burst];
+
+			if (++client->sent == messages)
+				client->state = DONE;
+			else if (send_messages(client) < 0)
+				return -1;
+		}
+	}
+
+	memmove(client->in, client->in + off, client->inlen - off);
+	client->inlen -= off;
+	return 1;
+}
+
+/* Edge triggered: keep going until the socket would block or we are done. */
+static int client_service(struct client *client) {
+	int err;
+
+	while (client->state != DONE) {
+		if (client_flush(client) < 0)
+			return -1;
+		if (client->outlen > 0)
+			break;
+		if ((err = client_read(client)) <= 0)
+			return err;
+	}
+
+	return 0;
+}
+
+static int client_start(struct client *client) {
+	ssize_t err;
+
+	websocket_random_bytes(&rng, client->nonce, sizeof client->nonce);
+
+	if ((err = websocket_writerequest(
+			client->out, outsize, client->nonce, "/", NULL, 0)) < 0)
+		return fprintf(stderr, "websocket_writerequest err=%zd\n", err), -1;
+
+	client->outlen = err;
+	return client_flush(client);
+}
+
+static int tcp_connect(void) {
+	struct sockaddr_in sin;
+	int sd, one = 1;
+
+	memset(&sin, 0, sizeof sin);
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(port);
+	inet_pton(AF_INET, host, &sin.sin_addr);
+
+	if ((sd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+		return -1;
+
+	if (connect(sd, (struct sockaddr *) &sin, sizeof sin) < 0)
+		return close(sd), -1;
+
+	setsockopt(sd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+	return sd;
+}
+
+static void usage(const char *argv0) {
+	fprintf(stderr,
+		"usage: %s [-S [-E] [-w workers] [-u corkus]] [-B] [-H host] [-p port] [-c conns] [-m size]\n"
+		"       [-f fragments] [-n messages] [-b burst]\n"
+		"  -S  serve echo in a forked child over socketpairs instead of tcp\n"
+		"      (100k+ connections need RLIMIT_NOFILE above 2 * conns)\n"
+		"  -E  make that child use epoll even where io_uring is available\n"
+		"  -w  and echo from that many worker threads\n"
+		"  -u  and cork replies for up to that many microseconds; the child\n"
+		"      reports its sends per frame when done\n"
+		"  -b  keep that many messages in flight per connection\n"
+		"  -B  broadcast: the first connection sends and the server fans every\n"
+		"      frame out to all of them (run echo with -B when not using -S)\n", argv0);
+	exit(2);
+}
+
+int main(int argc, char *argv[]) {
+	struct rlimit rl;
+	struct client *clients;
+	struct epoll_event ev, *events;
+	int *fds = NULL, pair[2], c, n, epfd, pairs = 0;
+	unsigned flags = 0, workers = 0, corkus = 0;
+	pid_t pid = 0;
+	size_t i, active;
+	double t;
+
+	while ((c = getopt(argc, argv, "SEBH:p:c:m:f:n:w:u:b:")) != -1)
+		switch (c) {
+		case 'S': pairs = 1; break;
+		case 'E': flags |= WEBSOCKET_SERVER_EPOLL; break;
+		case 'B': fanout = 1; break;
+		case 'H': host = optarg; break;
+		case 'p': port = atoi(optarg); break;
+		case 'c': conns = strtoul(optarg, NULL, 0); break;
+		case 'm': msgsize = strtoul(optarg, NULL, 0); break;
+		case 'f': fragments = strtoul(optarg, NULL, 0); break;
+		case 'n': messages = strtoul(optarg, NULL, 0); break;
+		case 'w': workers = strtoul(optarg, NULL, 0); break;
+		case 'u': corkus = strtoul(optarg, NULL, 0); break;
+		case 'b': burst = strtoul(optarg, NULL, 0); break;
+		default: usage(argv[0]);
+		}
+
+	if (conns == 0 || fragments == 0 || messages == 0 || burst == 0 || fragments > msgsize)
+		usage(argv[0]);
+
+	signal(SIGPIPE, SIG_IGN);
+
+	if (websocket_random_init(&rng) < 0)
+		return fprintf(stderr, "websocket_random_init failed\n"), 1;
+
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+		rl.rlim_cur = rl.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rl);
+	}
+
+	outsize = burst * (msgsize + fragments * 14) + 512;
+
+	if ((payload = malloc(msgsize)) == NULL ||
+			(clients = calloc(conns, sizeof *clients)) == NULL ||
+			(events = calloc(256, sizeof *events)) == NULL ||
+			(rtts = malloc(conns * messages * sizeof *rtts)) == NULL ||
+			(pairs && (fds = malloc(conns * sizeof *fds)) == NULL))
+		return fprintf(stderr, "malloc failed\n"), 1;
+
+	memset(payload, 'x', msgsize);
+
+	for (i = 0; i < conns; ++i) {
+		if (pairs) {
+			if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair) < 0)
+				return perror("socketpair"), 1;
+			clients[i].sd = pair[0];
+			fds[i] = pair[1];
+		} else if ((clients[i].sd = tcp_connect()) < 0)
+			return perror("connect"), 1;
+
+		if ((clients[i].out = malloc(outsize)) == NULL ||
+				(clients[i].t0 = malloc(burst * sizeof *clients[i].t0)) == NULL)
+			return fprintf(stderr, "malloc failed\n"), 1;
+	}
+
+	if (pairs) {
+		if ((pid = fork()) < 0)
+			return perror("fork"), 1;
+
+		if (pid == 0) {
+			for (i = 0; i < conns; ++i)
+				close(clients[i].sd);
+			_exit(echoloop(-1, fds, conns, flags, fanout, workers, corkus) < 0);
+		}
+
+		for (i = 0; i < conns; ++i)
+			close(fds[i]);
+	}
+
+	sender = &clients[0];
+	t = now();
+
+	if ((epfd = epoll_create1(0)) < 0)
+		return perror("epoll_create1"), 1;
+
+	for (i = 0; i < conns; ++i) {
+		fcntl(clients[i].sd, F_SETFL, fcntl(clients[i].sd, F_GETFL) | O_NONBLOCK);
+
+		ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+		ev.data.ptr = &clients[i];
+
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, clients[i].sd, &ev) < 0)
+			return perror("epoll_ctl"), 1;
+
+		if (client_start(&clients[i]) < 0)
+			return fprintf(stderr, "handshake failed\n"), 1;
+	}
+
+	for (active = conns; active > 0;) {
+		if ((n = epoll_wait(epfd, events, 256, -1)) < 0) {
+			if (errno == EINTR)
+				continue;
+			return perror("epoll_wait"), 1;
+		}
+
+		for (c = 0; c < n; ++c) {
+			struct client *client = events[c].data.ptr;
+
+			if (client->state == DONE)
+				continue;
+
+			if (client_service(client) < 0)
+				return fprintf(stderr, "connection %zu failed\n", (size_t) (client - clients)), 1;
+
+			if (client->state == DONE)
+				--active;
+		}
+	}
+
+	t = now() - t;
+
+	for (i = 0; i < conns; ++i) {
+		close(clients[i].sd);
+		free(clients[i].out);
+		free(clients[i].t0);
+	}
+
+	if (pid > 0)
+		waitpid(pid, NULL, 0);
+
+	qsort(rtts, nrtts, sizeof *rtts, &cmp_double);
+
+	printf("connections %zu, message %zu B in %zu fragment(s), %s%s\n",
+		conns, msgsize, fragments, pairs ? "socketpair" : "tcp", fanout ? ", broadcast" : "");
+	printf("%zu messages in %.3f s: %.0f msg/s, %.2f MB/s\n",
+		delivered, t / 1e9, delivered / (t / 1e9), delivered * msgsize / (t / 1e3));
+	printf("rtt p50 %.1f us, p99 %.1f us, p999 %.1f us\n",
+		rtts[nrtts / 2] / 1e3, rtts[nrtts * 99 / 100] / 1e3, rtts[nrtts * 999 / 1000] / 1e3);
+
+	close(epfd);
+	free(rtts);
+	free(events);
+	free(clients);
+	free(payload);
+	free(fds);
+	return 0;
+}
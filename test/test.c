@@ -137,11 +137,11 @@ static ssize_t process_data(struct client *client, char *p, size_t n) {
 
 	if ((len = client->frame.length - client->off) > n)
 		len = n;
+	if (len > sizeof tbuf - 1)
+		len = sizeof tbuf - 1;
 
-	websocket_maskdata(p, len, &client->frame, client->off);
+	websocket_unmaskcopy(tbuf + tn, p, len, &client->frame, client->off);
 	client->off += len;
-
-	memcpy(tbuf + tn, p, len);
 	tn += len;
 
 	p += len;
@@ -260,7 +260,7 @@ int main(int argc, char *argv[]) {
 	err = socket_send(client.sd, buf, err);
 
 	client.state = RESPONSE;
-	err = ioloop(client.sd, buf, sizeof buf, &read_socket, &handle_data, &client);
+	err = ioloop(client.sd, sizeof buf, &read_socket, &handle_data, &client);
 	socket_close(client.sd);
 
 	printf("[%d] done\n", getpid());